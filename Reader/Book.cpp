@@ -2,11 +2,16 @@
 #include "Book.h"
 #include "types.h"
 #include "Utils.h"
+#include "Charset.h"
 #include <process.h>
+#include <shlwapi.h>
+#include <emmintrin.h>
 #ifdef _DEBUG
 #include <assert.h>
 #endif
 
+#define HASH_SAMPLE_SIZE        (64 * 1024)
+
 
 Book::Book()
     : m_Data(NULL)
@@ -14,6 +19,9 @@ Book::Book()
     , m_hThread(NULL)
     , m_bForceKill(FALSE)
     , m_Rule(NULL)
+    , m_FileSize(0)
+    , m_FileTime(0)
+    , m_FileHash(0)
 {
     memset(m_fileName, 0, sizeof(m_fileName));
     m_Chapters.clear();
@@ -59,6 +67,7 @@ bool Book::OpenBook(char *data, int size, HWND hWnd)
 
 bool Book::CloseBook(void)
 {
+    m_PageIndex.Stop();
     if (m_Text)
     {
         free(m_Text);
@@ -114,6 +123,7 @@ void Book::UpdateMd5(void)
 
 wchar_t * Book::GetText(void)
 {
+    MergeText();
     return m_Text;
 }
 
@@ -233,9 +243,25 @@ bool Book::GetChapterTitle(TCHAR* title, int size)
     return true;
 }
 
+#define DECODE_CHUNK_SIZE   (1024 * 1024)
+#define CP_UTF16_LE         1200
+#define CP_UTF16_BE         1201
+
 bool Book::DecodeText(const char *src, int srcsize, wchar_t **dst, int *dstsize)
 {
     type_t bom = Unknown;
+    UINT cp;
+    wchar_t *text = NULL;
+    int len = 0;
+    int pos = 0;
+    int index = 0;
+    int off, n, count;
+    bool flag = true;
+
+#if TEST_MODEL
+    UnitTest5();
+    Utils::UnitTest6();
+#endif
 
     if (Unknown != (bom = Utils::check_bom(src, srcsize)))
     {
@@ -243,84 +269,180 @@ bool Book::DecodeText(const char *src, int srcsize, wchar_t **dst, int *dstsize)
         {
             src += 3;
             srcsize -= 3;
-            *dst = Utils::utf8_to_utf16_ex(src, srcsize, dstsize);
-            (*dstsize)--;
+            cp = CP_UTF8;
         }
         else if (utf16_le == bom)
         {
             src += 2;
             srcsize -= 2;
-            *dstsize = srcsize / 2;
-            *dst = (wchar_t *)malloc(sizeof(wchar_t) * ((*dstsize) + 1));
-            memcpy(*dst, src, srcsize);
-            (*dst)[*dstsize] = 0;
+            cp = CP_UTF16_LE;
         }
         else if (utf16_be == bom)
         {
             src += 2;
             srcsize -= 2;
-            *dstsize = srcsize / 2;
-            *dst = (wchar_t *)malloc(sizeof(wchar_t) * ((*dstsize) + 1));
-            memcpy(*dst, src, srcsize);
-            (*dst)[*dstsize] = 0;
-            *dst = (wchar_t *)Utils::be_to_le((char *)(*dst), srcsize);
+            cp = CP_UTF16_BE;
         }
-        else if (utf32_le == bom || utf32_be == bom)
+        else
         {
-            // not support
+            // utf32 not support
             return false;
         }
     }
     else if (Utils::is_ascii(src, srcsize > 1024 ? 1024 : srcsize))
     {
-#if 0
-        *dst = Utils::utf8_to_utf16(src, dstsize);
-        (*dstsize)--;
-#else
-        *dst = Utils::utf8_to_utf16_ex(src, srcsize, dstsize);
-#endif
+        cp = CP_UTF8;
     }
     else if (Utils::is_utf8(src, srcsize > 1024 ? 1024 : srcsize))
     {
-#if 0
-        *dst = Utils::utf8_to_utf16(src, dstsize);
-        (*dstsize)--;
-#else
-        *dst = Utils::utf8_to_utf16_ex(src, srcsize, dstsize); // fixed bug : invalid utf8 text
-#endif
+        cp = CP_UTF8; // fixed bug : invalid utf8 text
     }
     else
     {
-#if 0
-        *dst = Utils::ansi_to_utf16(src, dstsize);
-        (*dstsize)--;
-#else
-        *dst = Utils::ansi_to_utf16_ex(src, srcsize, dstsize);
-#endif
+        cp = Charset::guess(src, srcsize); // gbk, big5 or system code page
+    }
+
+    // 1st pass: length of decoded text
+    for (off = 0; off < srcsize; off += n)
+    {
+        n = GetDecodeChunk(cp, src + off, srcsize - off);
+        len += DecodeChunk(cp, src + off, n, NULL, 0);
     }
 
-    FormatText(*dst, dstsize);
+    text = (wchar_t *)malloc(sizeof(wchar_t) * (len + 1));
+    if (!text)
+        return false;
 
+    // 2nd pass: decode and format chunk by chunk, formatted text is never longer than decoded text, so do it in place
+    for (off = 0; off < srcsize && pos < len; off += n)
+    {
+        if (m_bForceKill)
+        {
+            free(text);
+            return false;
+        }
+        n = GetDecodeChunk(cp, src + off, srcsize - off);
+        count = DecodeChunk(cp, src + off, n, text + pos, len - pos);
+        FormatAppend(text + pos, count, text, &index, &flag, pos + count == len);
+        pos += count;
+    }
+    text[index] = 0;
+
+    *dst = text;
+    *dstsize = index;
     return true;
 }
 
+int Book::GetDecodeChunk(UINT cp, const char *src, int size)
+{
+    const unsigned char *str = (const unsigned char *)src;
+    int n, i;
+
+    if (size <= DECODE_CHUNK_SIZE)
+        return size;
+
+    n = DECODE_CHUNK_SIZE;
+    if (CP_UTF16_LE == cp || CP_UTF16_BE == cp)
+        return n;
+
+    if (CP_UTF8 == cp)
+    {
+        // don't split multi-byte sequence, back to the lead byte
+        for (i = n; i > n - 4; i--)
+        {
+            if ((str[i] & 0xC0) != 0x80)
+                return i;
+        }
+        return n;
+    }
+
+    // dbcs, lead byte can only be known from the start of chunk
+    for (i = 0; i < n; )
+    {
+        if (CP_GB18030 == cp || CP_BIG5 == cp)
+            i += Charset::next_char(cp, str + i, size - i);
+        else
+            i += IsDBCSLeadByte(str[i]) ? 2 : 1;
+    }
+    return i;
+}
+
+int Book::DecodeChunk(UINT cp, const char *src, int size, wchar_t *dst, int dstsize)
+{
+    const unsigned char *str = (const unsigned char *)src;
+    int count, i;
+
+    if (CP_UTF16_LE == cp || CP_UTF16_BE == cp)
+    {
+        count = size / 2;
+        if (!dst)
+            return count;
+        if (count > dstsize)
+            count = dstsize;
+        if (CP_UTF16_LE == cp)
+        {
+            memcpy(dst, src, count * sizeof(wchar_t));
+        }
+        else
+        {
+            for (i = 0; i < count; i++)
+            {
+                dst[i] = (wchar_t)((str[2 * i] << 8) | str[2 * i + 1]);
+            }
+        }
+        return count;
+    }
+
+    if (size <= 0)
+        return 0;
+    if (CP_UTF8 == cp)
+        return Utils::utf8_decode(src, size, dst, dst ? dstsize : 0);
+    if (CP_GB18030 == cp || CP_BIG5 == cp)
+        return Charset::decode(cp, src, size, dst, dst ? dstsize : 0);
+    return MultiByteToWideChar(cp, 0, src, size, dst, dst ? dstsize : 0);
+}
+
 bool Book::FormatText(wchar_t *text, int *len, bool flag)
 {
-    wchar_t *buf = NULL;
-    int i, index = 0;
+    int index = 0;
     if (!text || *len == 0)
         return false;
 
-    buf = (wchar_t *)malloc(((*len) + 1) * sizeof(wchar_t));
-    for (i = 0; i < (*len); i++)
+    // in place, output is never longer than input
+    FormatAppend(text, *len, text, &index, &flag, true);
+    text[index] = 0;
+    *len = index;
+    return true;
+}
+
+// append formatted text to dst[*index], dst can be the same buffer as text.
+// end: text is the tail of whole text.
+// simd: false to format char by char, for test only.
+void Book::FormatAppend(const wchar_t *text, int len, wchar_t *dst, int *index, bool *flag, bool end, bool simd)
+{
+    int i, n, k = *index;
+
+    simd = simd && Utils::get_simd_level() >= simd_sse2;
+
+    for (i = 0; i < len; i++)
     {
+        // chars before the first blank or nul of next 16 chars are copied as is
+        if (simd && !*flag && i + 16 <= len && (n = GetPlainLength(text + i)) > 0)
+        {
+            if (dst + k != text + i)
+                memmove(dst + k, text + i, n * sizeof(wchar_t));
+            k += n;
+            i += n - 1;
+            continue;
+        }
+
 #if 1
-        if (flag && IsBlanks(text[i]))
+        if (*flag && IsBlanks(text[i]))
             continue;
-        flag = false;
+        *flag = false;
 #endif
         // fixed bug : invalid utf8 text
-        if (i < ((*len) - 1) && text[i] == 0x00)
+        if ((!end || i < len - 1) && text[i] == 0x00)
             continue; 
 
         // 0x0d 0x0a -> 0x0a
@@ -330,22 +452,43 @@ bool Book::FormatText(wchar_t *text, int *len, bool flag)
         // Remove extra spaces
         if (0x20 == text[i] || 0xA0 == text[i]) // Keep up to 4 consecutive spaces
         {
-            if (index > 3 && buf[index - 1] == text[i] && buf[index - 2] == text[i] && buf[index - 3] == text[i] && buf[index - 4] == text[i])
+            if (k > 3 && dst[k - 1] == text[i] && dst[k - 2] == text[i] && dst[k - 3] == text[i] && dst[k - 4] == text[i])
                 continue;
         }
         else if (IsBlanks(text[i])) // Keep up to 2 consecutive spaces
         {
-            if (index > 1 && buf[index - 1] == text[i] && buf[index - 2] == text[i])
+            if (k > 1 && dst[k - 1] == text[i] && dst[k - 2] == text[i])
                 continue;
         }
 		
-        buf[index++] = text[i];
+        dst[k++] = text[i];
     }
-    buf[index] = 0;
-    *len = index;
-    memcpy(text, buf, ((*len) + 1) * sizeof(wchar_t));
-    free(buf);
-    return true;
+    *index = k;
+}
+
+// count of chars before the first char <= 0x20, 0xA0 or 0x3000 in 16 chars
+int Book::GetPlainLength(const wchar_t *text)
+{
+    const __m128i space = _mm_set1_epi16(0x20);
+    const __m128i nbsp = _mm_set1_epi16((short)0xA0);
+    const __m128i ideo = _mm_set1_epi16(0x3000);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128((const __m128i *)text);
+    __m128i b = _mm_loadu_si128((const __m128i *)(text + 8));
+    UINT mask;
+    int n;
+
+    // unsigned c <= 0x20 <=> saturated c - 0x20 == 0
+    a = _mm_or_si128(_mm_cmpeq_epi16(_mm_subs_epu16(a, space), zero),
+        _mm_or_si128(_mm_cmpeq_epi16(a, nbsp), _mm_cmpeq_epi16(a, ideo)));
+    b = _mm_or_si128(_mm_cmpeq_epi16(_mm_subs_epu16(b, space), zero),
+        _mm_or_si128(_mm_cmpeq_epi16(b, nbsp), _mm_cmpeq_epi16(b, ideo)));
+    mask = (UINT)_mm_movemask_epi8(_mm_packs_epi16(a, b)); // one bit per char
+    if (!mask)
+        return 16;
+    for (n = 0; !(mask & (1 << n)); n++)
+        ;
+    return n;
 }
 
 bool Book::IsBlanks(wchar_t c)
@@ -357,6 +500,63 @@ bool Book::IsBlanks(wchar_t c)
     return false;
 }
 
+void Book::UnitTest5(void)
+{
+#if TEST_MODEL
+#define CASE_TEXT(s) s, sizeof(s) / sizeof(s[0]) - 1
+    static const struct {
+        const wchar_t *text;
+        int len;
+        const wchar_t *expect;
+        int count;
+    } cases[] = {
+        { CASE_TEXT(L"  \x3000\t\r\nabc"), CASE_TEXT(L"abc") },
+        { CASE_TEXT(L"a      b\xA0\xA0\xA0\xA0\xA0\xA0" L"c"), CASE_TEXT(L"a    b\xA0\xA0\xA0\xA0" L"c") },
+        { CASE_TEXT(L"a\x3000\x3000\x3000" L"b\t\t\tc"), CASE_TEXT(L"a\x3000\x3000" L"b\t\tc") },
+        { CASE_TEXT(L"ab\r\ncd\r\r\n\n\nef\n\r"), CASE_TEXT(L"ab\ncd\n\nef\n") },
+        { CASE_TEXT(L"ab\0cd\0"), CASE_TEXT(L"abcd\0") },
+        // blanks, cr/lf and nul around the 16 chars blocks
+        { CASE_TEXT(L"0123456789abcde\r\n0123456789abcd      0123456789abcdef\0x"),
+          CASE_TEXT(L"0123456789abcde\n0123456789abcd    0123456789abcdefx") },
+        { CASE_TEXT(L"0123456789abcdef\x3000\x3000\x3000\x3000\xA0\xA0\xA0\xA0\xA0" L"0123456789abcde\t\r\n\r\n\r\n"),
+          CASE_TEXT(L"0123456789abcdef\x3000\x3000\xA0\xA0\xA0\xA0" L"0123456789abcde\t\n\n") },
+        { CASE_TEXT(L"                \r\n\r\n0123456789abcdef0123456789abcdef"), CASE_TEXT(L"0123456789abcdef0123456789abcdef") },
+    };
+#undef CASE_TEXT
+    wchar_t buf[64], out[64];
+    int i, j, index, n;
+    bool flag;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        assert(cases[i].len < sizeof(buf) / sizeof(buf[0]));
+
+        // simd, in place
+        memcpy(buf, cases[i].text, cases[i].len * sizeof(wchar_t));
+        index = 0;
+        flag = true;
+        FormatAppend(buf, cases[i].len, buf, &index, &flag, true);
+        assert(index == cases[i].count && !memcmp(buf, cases[i].expect, index * sizeof(wchar_t)));
+
+        // char by char
+        index = 0;
+        flag = true;
+        FormatAppend(cases[i].text, cases[i].len, out, &index, &flag, true, false);
+        assert(index == cases[i].count && !memcmp(out, cases[i].expect, index * sizeof(wchar_t)));
+
+        // chunk by chunk, as DecodeText does
+        index = 0;
+        flag = true;
+        for (j = 0; j < cases[i].len; j += n)
+        {
+            n = cases[i].len - j > 20 ? 20 : cases[i].len - j;
+            FormatAppend(cases[i].text + j, n, out, &index, &flag, j + n == cases[i].len);
+        }
+        assert(index == cases[i].count && !memcmp(out, cases[i].expect, index * sizeof(wchar_t)));
+    }
+#endif
+}
+
 void Book::ForceKill(void)
 {
     if (m_hThread)
@@ -413,6 +613,65 @@ bool Book::CalcMd5(TCHAR *fileName, u128_t *md5, char **data, int *size)
 }
 #endif
 
+bool Book::GetIndexFileName(TCHAR *filename, BOOL create)
+{
+    static TCHAR indexdir[MAX_PATH] = { 0 };
+    u64 hash = 14695981039346656037ULL; // fnv-1a
+    int i;
+
+    if (!indexdir[0])
+    {
+        GetModuleFileName(NULL, indexdir, sizeof(TCHAR) * (MAX_PATH - 1));
+        for (i = _tcslen(indexdir) - 1; i >= 0; i--)
+        {
+            if (indexdir[i] == _T('\\') || indexdir[i] == _T('/'))
+            {
+                memcpy(&indexdir[i + 1], INDEX_FILE_SAVE_PATH, (_tcslen(INDEX_FILE_SAVE_PATH) + 1) * sizeof(TCHAR));
+                break;
+            }
+        }
+    }
+    if (create && !PathFileExists(indexdir))
+    {
+        if (CreateDirectory(indexdir, NULL))
+        {
+            SetFileAttributes(indexdir, FILE_ATTRIBUTE_HIDDEN);
+        }
+    }
+
+    for (i = 0; m_fileName[i]; i++)
+    {
+        hash ^= (u64)towlower(m_fileName[i]);
+        hash *= 1099511628211ULL;
+    }
+    _stprintf(filename, _T("%s%016llx.idx"), indexdir, hash);
+    return true;
+}
+
+// hash of size and the head, middle and tail of content, no need to read whole file
+u64 Book::HashContent(const char *data, u64 size)
+{
+    u64 hash = 14695981039346656037ULL; // fnv-1a
+    u64 offsets[3];
+    u64 i, j, n;
+
+    offsets[0] = 0;
+    offsets[1] = size > HASH_SAMPLE_SIZE ? (size - HASH_SAMPLE_SIZE) / 2 : 0;
+    offsets[2] = size > HASH_SAMPLE_SIZE ? size - HASH_SAMPLE_SIZE : 0;
+    n = size < HASH_SAMPLE_SIZE ? size : HASH_SAMPLE_SIZE;
+    for (i = 0; i < 3; i++)
+    {
+        for (j = 0; j < n; j++)
+        {
+            hash ^= (unsigned char)data[offsets[i] + j];
+            hash *= 1099511628211ULL;
+        }
+    }
+    hash ^= size;
+    hash *= 1099511628211ULL;
+    return hash;
+}
+
 unsigned __stdcall Book::OpenBookThread(void* pArguments)
 {
     ob_thread_param_t *param = (ob_thread_param_t *)pArguments;
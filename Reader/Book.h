@@ -77,9 +77,16 @@ protected:
     virtual bool ParserBook(HWND hWnd) = 0;
     // srcsize and dstsize not include \0
     virtual bool DecodeText(const char *src, int srcsize, wchar_t **dst, int *dstsize);
+    int GetDecodeChunk(UINT cp, const char *src, int size);
+    int DecodeChunk(UINT cp, const char *src, int size, wchar_t *dst, int dstsize);
+    void FormatAppend(const wchar_t *text, int len, wchar_t *dst, int *index, bool *flag, bool end, bool simd = true);
+    int GetPlainLength(const wchar_t *text);
+    void UnitTest5(void);
     
     bool IsBlanks(wchar_t c);
     void ForceKill(void);
+    bool GetIndexFileName(TCHAR *filename, BOOL create);
+    static u64 HashContent(const char *data, u64 size);
 
 protected:
     static unsigned __stdcall OpenBookThread(void* pArguments);
@@ -95,6 +102,9 @@ protected:
 #endif
     bool m_bForceKill;
     chapter_rule_t *m_Rule;
+    u64 m_FileSize; // key of index file
+    u64 m_FileTime;
+    u64 m_FileHash;
 };
 
 typedef struct ob_thread_param_t
@@ -371,6 +371,10 @@ void Cache::default_header(header_t* header)
 
     header->meun_font_follow = 0;
 
+    // default prefetch window of online book
+    header->prefetch_ahead = 3;
+    header->prefetch_behind = 1;
+
     for (i = 0; i<MAX_CUST_COLOR_COUNT; i++)
     {
         header->cust_colors[i] = 0x00FFFFFF;
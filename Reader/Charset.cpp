@@ -0,0 +1,269 @@
+#include "stdafx.h"
+#include "Charset.h"
+#include "Utils.h"
+#include <emmintrin.h>
+
+#define GUESS_CHARS             512 // non-ascii chars judged by guess
+#define GB18030_BMP_SIZE        39420
+#define GB18030_SUPP_START      189000 // linear index of 0x90308130, U+10000
+
+UINT Charset::guess(const char *data, int size)
+{
+    const unsigned char *str = (const unsigned char *)data;
+    BOOL gb = TRUE;
+    BOOL big5 = TRUE;
+    int chars = 0;
+    int pairs = 0;
+    int low_trails = 0;
+    int i, len;
+    UINT ch;
+    UINT acp = GetACP();
+
+    // japanese and korean text are also valid gbk, trust the system code page
+    if (acp == 932 || acp == 949)
+        return CP_ACP;
+
+    // ascii is same in all of them, a page may start with kilobytes of ascii markup.
+    // judge on the first non-ascii chars, the last char may be truncated by size.
+    for (i = 0; gb && i < size && chars < GUESS_CHARS; i += len)
+    {
+        i += ascii_length(str + i, size - i);
+        if (i >= size)
+            break;
+        len = get_char(CP_GB18030, str + i, size - i, &ch);
+        if (len == 1 && ch < 0x80)
+            continue;
+        if (ch == 0xFFFD && size - i >= 4)
+            gb = FALSE;
+        chars++;
+    }
+    if (chars == 0)
+        return CP_ACP;
+
+    chars = 0;
+    for (i = 0; big5 && i < size && chars < GUESS_CHARS; i += len)
+    {
+        i += ascii_length(str + i, size - i);
+        if (i >= size)
+            break;
+        len = get_char(CP_BIG5, str + i, size - i, &ch);
+        if (len == 1 && ch < 0x80)
+            continue;
+        if (ch == 0xFFFD && size - i >= 2)
+            big5 = FALSE;
+        if (len == 2)
+        {
+            pairs++;
+            if (str[i + 1] < 0x80)
+                low_trails++;
+        }
+        chars++;
+    }
+
+    // most gbk chars have trail byte >= 0xA1, but big5 chars often < 0x80
+    if (big5 && pairs > 0 && (!gb || acp == CP_BIG5 || low_trails * 4 >= pairs))
+        return CP_BIG5;
+    if (gb)
+        return CP_GB18030;
+    return CP_ACP;
+}
+
+int Charset::decode(UINT cp, const char *str, int size, wchar_t *dst, int dstsize)
+{
+    const unsigned char *s = (const unsigned char *)str;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v;
+    int i = 0;
+    int count = 0;
+    int k, len, n;
+    UINT ch;
+
+    while (i < size)
+    {
+        // ascii block
+        k = ascii_length(s + i, size - i);
+        if (k > 0)
+        {
+            if (dstsize > 0)
+            {
+                if (count + k > dstsize)
+                    return 0;
+                for (len = 0; len < k; len += 16)
+                {
+                    v = _mm_loadu_si128((const __m128i *)(s + i + len));
+                    _mm_storeu_si128((__m128i *)(dst + count + len), _mm_unpacklo_epi8(v, zero));
+                    _mm_storeu_si128((__m128i *)(dst + count + len + 8), _mm_unpackhi_epi8(v, zero));
+                }
+            }
+            i += k;
+            count += k;
+            continue;
+        }
+
+        len = get_char(cp, s + i, size - i, &ch);
+        i += len;
+        n = ch > 0xFFFF ? 2 : 1;
+        if (dstsize > 0)
+        {
+            if (count + n > dstsize)
+                return 0;
+            if (n == 2)
+            {
+                ch -= 0x10000;
+                dst[count] = (wchar_t)(0xD800 + (ch >> 10));
+                dst[count + 1] = (wchar_t)(0xDC00 + (ch & 0x3FF));
+            }
+            else
+            {
+                dst[count] = (wchar_t)ch;
+            }
+        }
+        count += n;
+    }
+    return count;
+}
+
+int Charset::to_utf8(UINT cp, const char *str, int size, char *dst, int dstsize)
+{
+    const unsigned char *s = (const unsigned char *)str;
+    unsigned char *d = (unsigned char *)dst;
+    int i = 0;
+    int count = 0;
+    int k, len, n;
+    UINT ch;
+
+    while (i < size)
+    {
+        // ascii block
+        k = ascii_length(s + i, size - i);
+        if (k > 0)
+        {
+            if (dstsize > 0)
+            {
+                if (count + k > dstsize)
+                    return 0;
+                memcpy(d + count, s + i, k);
+            }
+            i += k;
+            count += k;
+            continue;
+        }
+
+        len = get_char(cp, s + i, size - i, &ch);
+        i += len;
+        n = ch < 0x80 ? 1 : ch < 0x800 ? 2 : ch < 0x10000 ? 3 : 4;
+        if (dstsize > 0)
+        {
+            if (count + n > dstsize)
+                return 0;
+            switch (n)
+            {
+            case 1:
+                d[count] = (unsigned char)ch;
+                break;
+            case 2:
+                d[count] = (unsigned char)(0xC0 | (ch >> 6));
+                d[count + 1] = (unsigned char)(0x80 | (ch & 0x3F));
+                break;
+            case 3:
+                d[count] = (unsigned char)(0xE0 | (ch >> 12));
+                d[count + 1] = (unsigned char)(0x80 | ((ch >> 6) & 0x3F));
+                d[count + 2] = (unsigned char)(0x80 | (ch & 0x3F));
+                break;
+            default:
+                d[count] = (unsigned char)(0xF0 | (ch >> 18));
+                d[count + 1] = (unsigned char)(0x80 | ((ch >> 12) & 0x3F));
+                d[count + 2] = (unsigned char)(0x80 | ((ch >> 6) & 0x3F));
+                d[count + 3] = (unsigned char)(0x80 | (ch & 0x3F));
+                break;
+            }
+        }
+        count += n;
+    }
+    return count;
+}
+
+int Charset::next_char(UINT cp, const unsigned char *str, int size)
+{
+    UINT ch;
+
+    return get_char(cp, str, size, &ch);
+}
+
+// decode one char, invalid bytes are U+FFFD
+int Charset::get_char(UINT cp, const unsigned char *str, int size, UINT *ch)
+{
+    unsigned char b = str[0];
+    unsigned char t;
+    int index, low, high, mid;
+
+    *ch = b;
+    if (b < 0x80)
+        return 1;
+
+    *ch = 0xFFFD;
+    if (b == 0x80 || b == 0xFF || size < 2)
+        return 1;
+
+    t = str[1];
+    if (CP_BIG5 == cp)
+    {
+        if (t >= 0x40 && t <= 0x7E)
+            index = t - 0x40;
+        else if (t >= 0xA1 && t <= 0xFE)
+            index = t - 0xA1 + 63;
+        else
+            return 1;
+        *ch = g_Big5Table[(b - 0x81) * 157 + index];
+        if (*ch == 0)
+            *ch = 0xFFFD;
+        return 2;
+    }
+
+    // gb18030 two bytes
+    if (t >= 0x40 && t <= 0xFE && t != 0x7F)
+    {
+        *ch = g_GB18030Table[(b - 0x81) * 190 + t - 0x40 - (t > 0x7F ? 1 : 0)];
+        return 2;
+    }
+
+    // gb18030 four bytes
+    if (t < 0x30 || t > 0x39 || size < 4
+        || str[2] < 0x81 || str[2] > 0xFE || str[3] < 0x30 || str[3] > 0x39)
+        return 1;
+
+    index = (((b - 0x81) * 10 + (t - 0x30)) * 126 + (str[2] - 0x81)) * 10 + (str[3] - 0x30);
+    if (index < GB18030_BMP_SIZE)
+    {
+        // last range which index <= current
+        low = 0;
+        high = sizeof(g_GB18030Ranges) / sizeof(g_GB18030Ranges[0]) - 1;
+        while (low < high)
+        {
+            mid = low + (high - low + 1) / 2;
+            if (g_GB18030Ranges[mid].index <= index)
+                low = mid;
+            else
+                high = mid - 1;
+        }
+        *ch = g_GB18030Ranges[low].code + (index - g_GB18030Ranges[low].index);
+    }
+    else if (index >= GB18030_SUPP_START && index - GB18030_SUPP_START <= 0x10FFFF - 0x10000)
+    {
+        *ch = 0x10000 + (index - GB18030_SUPP_START);
+    }
+    return 4;
+}
+
+// ascii bytes at the head, 16 bytes per step
+int Charset::ascii_length(const unsigned char *str, int size)
+{
+    int i = 0;
+
+    if (Utils::get_simd_level() < simd_sse2)
+        return 0;
+
+    while (i + 16 <= size && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(str + i))))
+        i += 16;
+    return i;
+}
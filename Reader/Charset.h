@@ -0,0 +1,37 @@
+#ifndef __CHARSET_H__
+#define __CHARSET_H__
+
+#include "types.h"
+
+#define CP_BIG5                 950
+#define CP_GB18030              54936
+
+typedef struct charset_range_t
+{
+    unsigned short index;
+    unsigned short code;
+} charset_range_t;
+
+extern const unsigned short g_GB18030Table[126 * 190];
+extern const charset_range_t g_GB18030Ranges[206];
+extern const unsigned short g_Big5Table[126 * 157];
+
+// built-in chinese decoders, no need of system code page
+class Charset
+{
+public:
+    // CP_GB18030, CP_BIG5 or CP_ACP if the text is not chinese
+    static UINT guess(const char *data, int size);
+    // same as MultiByteToWideChar(cp, 0, ...)
+    static int decode(UINT cp, const char *str, int size, wchar_t *dst, int dstsize);
+    // same as decode, but output is utf8
+    static int to_utf8(UINT cp, const char *str, int size, char *dst, int dstsize);
+    // bytes of next char
+    static int next_char(UINT cp, const unsigned char *str, int size);
+
+protected:
+    static int get_char(UINT cp, const unsigned char *str, int size, UINT *ch);
+    static int ascii_length(const unsigned char *str, int size);
+};
+
+#endif
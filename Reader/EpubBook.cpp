@@ -5,23 +5,49 @@
 #include "libxml/xmlreader.h"
 #include "libxml/HTMLparser.h"
 #include "libxml/xpath.h"
+#include <process.h>
 #include <shlwapi.h>
+#if TEST_MODEL
+#include <assert.h>
+#endif
+
+#define PARSER_MAX_THREADS      16
+
+#define OPS_TAG_INLINE          0
+#define OPS_TAG_BLOCK           1
+#define OPS_TAG_BREAK           2
+#define OPS_TAG_SKIP            3
 
 
 EpubBook::EpubBook()
     : m_Cover(NULL)
+    , m_ScaledCover(NULL)
+    , m_FullCover(NULL)
+    , m_CoverThumb(false)
+    , m_Zip(NULL)
+    , m_hFile(INVALID_HANDLE_VALUE)
+    , m_hMapping(NULL)
+    , m_CacheSize(0)
+    , m_CacheTick(0)
+    , m_StartPos(0)
+    , m_Texts(NULL)
+    , m_hFillThread(NULL)
+    , m_FillDone(0)
+    , m_hWnd(NULL)
+    , m_OpenTime(0)
 {
+    memset(&m_Stream, 0, sizeof(m_Stream));
     xmlInitParser();
 }
 
 EpubBook::~EpubBook()
 {
     ForceKill();
-    FreeFilelist();
-    if (m_Cover)
-    {
-        delete m_Cover;
-    }
+    StopFill();
+    FreeTexts(m_Texts, (int)m_Epub.spine.size());
+    FreeEpub(m_Epub);
+    CloseZip();
+    FreeCover();
     xmlCleanupParser();
 }
 
@@ -45,39 +71,195 @@ Bitmap * EpubBook::GetCoverImage(void)
     return m_Cover;
 }
 
+// cover scaled to the size of cover page, it is scaled again only when the size is changed
+Bitmap * EpubBook::GetCoverImage(int w, int h)
+{
+    if (!m_Cover)
+        return NULL;
+
+    if (m_ScaledCover)
+    {
+        if ((int)m_ScaledCover->GetWidth() == w && (int)m_ScaledCover->GetHeight() == h)
+            return m_ScaledCover;
+        delete m_ScaledCover;
+        m_ScaledCover = NULL;
+    }
+    m_ScaledCover = ScaleImage(m_Cover, w, h);
+    return m_ScaledCover;
+}
+
+void EpubBook::SetStartPos(int pos)
+{
+    m_StartPos = pos;
+}
+
+// for the callers reading the whole text, chapters parsed in background are merged when it returns
+void EpubBook::WaitFill(void)
+{
+    if (m_hFillThread)
+        WaitForSingleObject(m_hFillThread, INFINITE);
+    MergeText();
+}
+
 bool EpubBook::ParserBook(HWND hWnd)
 {
     bool ret = false;
-    epub_t epub;
-    mainfest_t::iterator itor;
-    navmap_t::iterator it;
+    bool fill = false;
+#if TEST_MODEL
+    char msg[256] = { 0 };
+#endif
+
+    m_OpenTime = GetTickCount();
 
-    // unzip epub file
-    if (!UnzipBook())
+#if TEST_MODEL
+    UnitTest7();
+#endif
+
+    // read zip directory, entries are inflated when they are parsed
+    if (!OpenZip())
         goto end;
 
     // parser epub file
-    epub.ocf = "META-INF/container.xml";
-    if (!ParserOcf(epub))
+    m_Epub.ocf = "META-INF/container.xml";
+    if (!ParserOcf(m_Epub))
+        goto end;
+
+    if (!ParserOpf(m_Epub))
         goto end;
 
-    if (!ParserOpf(epub))
+    if (!ParserNcx(m_Epub))
         goto end;
 
-    if (!ParserNcx(epub))
+    // opened before, show the chapter of last position first and parser the others in background
+    if (LoadSpineIndex(m_Epub) && ParserFirstChapter(m_Epub))
+    {
+        // the thumbnail is shown until the cover is decoded in background
+        if (!LoadCoverThumb())
+        {
+            ParserCover(m_Epub);
+            SaveCoverThumb();
+        }
+#if TEST_MODEL
+        sprintf(msg, "{%s:%d} first chapter in %u ms\n", __FUNCTION__, __LINE__, GetTickCount() - m_OpenTime);
+        OutputDebugStringA(msg);
+#endif
+        StartFill(hWnd);
+        fill = true;
+        ret = true;
         goto end;
+    }
 
     // parser epub cover image
-    ParserCover(epub);
+    ParserCover(m_Epub);
 
     // Parser epub chapters & text
-    if (!ParserChapters(epub))
+    if (!ParserChapters(m_Epub))
         goto end;
 
+    SaveSpineIndex();
+    SaveCoverThumb();
     ret = true;
 
 end:
-    // free epub
+    if (!fill)
+    {
+        FreeEpub(m_Epub);
+        CloseZip();
+    }
+    if (!ret)
+    {
+        FreeCover();
+        CloseBook();
+    }
+
+    return ret;
+}
+
+// called when the text is read, the background parsing is merged once it is done
+void EpubBook::MergeText(void)
+{
+    int count = (int)m_Epub.spine.size();
+    int pos, i;
+    bool same = true;
+#if TEST_MODEL
+    char msg[256] = { 0 };
+#endif
+
+    if (!m_FillDone)
+        return;
+
+    StopFill();
+    m_FillDone = 0;
+    m_PageIndex.Stop(); // paginating thread is reading text
+
+    for (i = 0; i < count; i++)
+    {
+        if (m_Texts[i].len != m_SpineLength[i])
+        {
+            same = false;
+            break;
+        }
+    }
+
+    if (same)
+    {
+        // every document fills its own place, positions are not changed
+        pos = 1;
+        for (i = 0; i < count; i++)
+        {
+            if (m_Texts[i].len > 0)
+                memcpy(m_Text + pos, m_Texts[i].text, m_Texts[i].len * sizeof(wchar_t));
+            pos += m_SpineLength[i];
+        }
+    }
+    else
+    {
+        // index is out of date, build the text again
+        free(m_Text);
+        m_Text = NULL;
+        m_TextLength = 0;
+        m_Chapters.clear();
+        MergeChapters(m_Epub, m_Texts);
+        if (m_CurrentPos && (*m_CurrentPos) >= m_TextLength)
+            (*m_CurrentPos) = 0;
+        SaveSpineIndex();
+    }
+
+    // full size cover replaces the thumbnail
+    if (m_FullCover)
+    {
+        delete m_Cover;
+        m_Cover = m_FullCover;
+        m_FullCover = NULL;
+        m_CoverThumb = false;
+        if (m_ScaledCover)
+        {
+            delete m_ScaledCover;
+            m_ScaledCover = NULL;
+        }
+    }
+
+    FreeTexts(m_Texts, count);
+    m_Texts = NULL;
+    FreeEpub(m_Epub);
+    CloseZip();
+    RemoveAllLine();
+
+    // bookmark texts were read from placeholders
+    if (m_hWnd)
+        PostMessage(m_hWnd, WM_UPDATE_CHAPTERS, 0, NULL);
+
+#if TEST_MODEL
+    sprintf(msg, "{%s:%d} all chapters in %u ms\n", __FUNCTION__, __LINE__, GetTickCount() - m_OpenTime);
+    OutputDebugStringA(msg);
+#endif
+}
+
+void EpubBook::FreeEpub(epub_t &epub)
+{
+    mainfest_t::iterator itor;
+    navmap_t::iterator it;
+
     for (itor = epub.mainfest.begin(); itor != epub.mainfest.end(); itor++)
     {
         delete itor->second;
@@ -89,18 +271,6 @@ end:
     }
     epub.navmap.clear();
     epub.spine.clear();
-    FreeFilelist();
-    if (!ret)
-    {
-        if (m_Cover)
-        {
-            delete m_Cover;
-            m_Cover = NULL;
-        }
-        CloseBook();
-    }
-
-    return ret;
 }
 
 void EpubBook::FreeFilelist(void)
@@ -111,79 +281,138 @@ void EpubBook::FreeFilelist(void)
         free(itor->second.data);
     }
     m_flist.clear();
+    m_CacheSize = 0;
 }
 
-bool EpubBook::UnzipBook(void)
+static voidpf ZCALLBACK zip_open(voidpf opaque, const void *filename, int mode)
+{
+    zip_stream_t *stream;
+
+    if (mode != (ZLIB_FILEFUNC_MODE_READ | ZLIB_FILEFUNC_MODE_EXISTING))
+        return NULL;
+    stream = (zip_stream_t *)malloc(sizeof(zip_stream_t));
+    if (stream)
+        *stream = *(zip_stream_t *)opaque;
+    return stream;
+}
+
+static uLong ZCALLBACK zip_read(voidpf opaque, voidpf stream, void *buf, uLong size)
+{
+    zip_stream_t *s = (zip_stream_t *)stream;
+
+    if (size > s->size - s->pos)
+        size = (uLong)(s->size - s->pos);
+    memcpy(buf, s->data + s->pos, size);
+    s->pos += size;
+    return size;
+}
+
+static uLong ZCALLBACK zip_write(voidpf opaque, voidpf stream, const void *buf, uLong size)
+{
+    return 0;
+}
+
+static ZPOS64_T ZCALLBACK zip_tell(voidpf opaque, voidpf stream)
+{
+    return ((zip_stream_t *)stream)->pos;
+}
+
+static long ZCALLBACK zip_seek(voidpf opaque, voidpf stream, ZPOS64_T offset, int origin)
+{
+    zip_stream_t *s = (zip_stream_t *)stream;
+    u64 pos;
+
+    switch (origin)
+    {
+    case ZLIB_FILEFUNC_SEEK_CUR:
+        pos = s->pos + offset;
+        break;
+    case ZLIB_FILEFUNC_SEEK_END:
+        pos = s->size + offset;
+        break;
+    case ZLIB_FILEFUNC_SEEK_SET:
+        pos = offset;
+        break;
+    default:
+        return -1;
+    }
+    if (pos > s->size)
+        return -1;
+    s->pos = pos;
+    return 0;
+}
+
+static int ZCALLBACK zip_close(voidpf opaque, voidpf stream)
+{
+    free(stream);
+    return 0;
+}
+
+static int ZCALLBACK zip_error(voidpf opaque, voidpf stream)
+{
+    return 0;
+}
+
+bool EpubBook::OpenZip(void)
 {
-    unzFile uf = NULL;
-    zlib_filefunc64_def ffunc = {0};
-    uLong i;
-    unz_global_info gi = {0};
-    int err = UNZ_ERRNO;
     unz_file_info64 file_info = {0};
+    unz64_file_pos file_pos = {0};
     char filename_inzip[MAX_PATH] = {0};
-    char *buf = NULL;
-    file_data_t fdata;
-    char* filename = NULL;
-    int len = 0;
+    zip_entry_t entry;
+    FILETIME ft;
+    DWORD len;
+    int err = UNZ_ERRNO;
 
-    filename = Utils::Utf16ToAnsi(m_fileName);
-    fill_fopen64_filefunc(&ffunc);
-    uf = unzOpen2_64(filename, &ffunc);
-    if (!uf)
+    CloseZip();
+
+    // map epub file, only the central directory and the entries used are read
+    m_hFile = CreateFile(m_fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
         goto end;
 
-    err = unzGetGlobalInfo(uf, &gi);
-    if (err != UNZ_OK)
+    len = GetFileSize(m_hFile, NULL);
+    if (len == INVALID_FILE_SIZE || len == 0)
         goto end;
 
-    FreeFilelist();
+    m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!m_hMapping)
+        goto end;
+    m_Stream.data = (const char *)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_Stream.data)
+        goto end;
+    m_Stream.size = len;
+    m_Stream.pos = 0;
 
-    for (i = 0; i < gi.number_entry; i++)
+    // key of index file
+    if (GetFileTime(m_hFile, NULL, NULL, &ft))
     {
-        // current file
-        {
-            err = unzGetCurrentFileInfo64(uf, &file_info, filename_inzip, sizeof(filename_inzip), NULL, 0, NULL, 0);
-            if (err != UNZ_OK)
-                goto end;
-
-            if (filename_inzip[file_info.size_filename - 1] == '\\' || filename_inzip[file_info.size_filename - 1] == '/')
-            {
-                // is directory
-            }
-            else
-            {
-                // check password
-                err = unzOpenCurrentFilePassword(uf, NULL);
-                if (err != UNZ_OK)
-                    goto end;
-
-                // create memory to save this file
-                buf = (char *)malloc((size_t)file_info.uncompressed_size);
-                if (!buf)
-                    goto end;
+        m_FileSize = len;
+        m_FileTime = ((u64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+        m_FileHash = HashContent(m_Stream.data, len);
+    }
 
-                // read file to memory
-                err = unzReadCurrentFile(uf, buf, (size_t)file_info.uncompressed_size);
-                if (err != file_info.uncompressed_size)
-                    goto end;
-                err = UNZ_OK;
+    m_Zip = OpenZipReader();
+    if (!m_Zip)
+        goto end;
 
-                // save to file map
-                fdata.data = buf;
-                fdata.size = (size_t)file_info.uncompressed_size;
-                m_flist.insert(std::make_pair(filename_inzip, fdata));
-                buf = NULL;
-            }
-            unzCloseCurrentFile(uf);
-        }
+    err = unzGoToFirstFile(m_Zip);
+    while (err == UNZ_OK)
+    {
+        err = unzGetCurrentFileInfo64(m_Zip, &file_info, filename_inzip, sizeof(filename_inzip), NULL, 0, NULL, 0);
+        if (err != UNZ_OK)
+            goto end;
 
-        // next file
-        if ((i + 1) < gi.number_entry)
+        // skip directory
+        if (file_info.size_filename > 0
+            && filename_inzip[file_info.size_filename - 1] != '\\' && filename_inzip[file_info.size_filename - 1] != '/')
         {
-            err = unzGoToNextFile(uf);
+            err = unzGetFilePos64(m_Zip, &file_pos);
             if (err != UNZ_OK)
                 goto end;
+            entry.pos = file_pos.pos_in_zip_directory;
+            entry.num = file_pos.num_of_file;
+            entry.size = (size_t)file_info.uncompressed_size;
+            m_zlist.insert(std::make_pair(filename_inzip, entry));
         }
 
         if (m_bForceKill)
@@ -191,25 +420,138 @@ bool EpubBook::UnzipBook(void)
             err = UNZ_ERRNO;
             goto end;
         }
+
+        err = unzGoToNextFile(m_Zip);
     }
+    if (err == UNZ_END_OF_LIST_OF_FILE)
+        err = UNZ_OK;
 
 end:
-    if (uf)
+    if (err != UNZ_OK)
+        CloseZip();
+    return err == UNZ_OK;
+}
+
+// every reader has its own position in the mapped file
+void *EpubBook::OpenZipReader(void)
+{
+    zlib_filefunc64_def ffunc = {0};
+
+    ffunc.zopen64_file = zip_open;
+    ffunc.zread_file = zip_read;
+    ffunc.zwrite_file = zip_write;
+    ffunc.ztell64_file = zip_tell;
+    ffunc.zseek64_file = zip_seek;
+    ffunc.zclose_file = zip_close;
+    ffunc.zerror_file = zip_error;
+    ffunc.opaque = &m_Stream;
+    return unzOpen2_64(m_fileName, &ffunc);
+}
+
+bool EpubBook::ReadZipFile(void *zip, const zip_entry_t &entry, file_data_t *fdata)
+{
+    unz64_file_pos file_pos = {0};
+    int err;
+
+    file_pos.pos_in_zip_directory = entry.pos;
+    file_pos.num_of_file = entry.num;
+    if (UNZ_OK != unzGoToFilePos64(zip, &file_pos))
+        return false;
+
+    if (UNZ_OK != unzOpenCurrentFilePassword(zip, NULL))
+        return false;
+
+    fdata->size = entry.size;
+    fdata->data = malloc(fdata->size + 1);
+    if (!fdata->data)
     {
-        unzCloseCurrentFile(uf);
-        unzClose(uf);
+        unzCloseCurrentFile(zip);
+        return false;
     }
-    if (buf)
-        free(buf);
+    err = unzReadCurrentFile(zip, fdata->data, (unsigned)fdata->size);
+    unzCloseCurrentFile(zip);
+    if (err != (int)fdata->size)
+    {
+        free(fdata->data);
+        fdata->data = NULL;
+        return false;
+    }
+    return true;
+}
 
-    if (err != UNZ_OK)
-        FreeFilelist();
-    return err == UNZ_OK;
+void EpubBook::CloseZip(void)
+{
+    FreeFilelist();
+    m_zlist.clear();
+    if (m_Zip)
+    {
+        unzClose(m_Zip);
+        m_Zip = NULL;
+    }
+    if (m_Stream.data)
+    {
+        UnmapViewOfFile(m_Stream.data);
+        m_Stream.data = NULL;
+    }
+    m_Stream.size = 0;
+    m_Stream.pos = 0;
+    if (m_hMapping)
+    {
+        CloseHandle(m_hMapping);
+        m_hMapping = NULL;
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
 }
 
-bool EpubBook::ParserOcf(epub_t &epub)
+// inflate an entry on demand, it is valid until next call
+file_data_t *EpubBook::GetFile(const std::string &name)
 {
     filelist_t::iterator itor;
+    filelist_t::iterator oldest;
+    ziplist_t::iterator zitor;
+    file_data_t fdata = {0};
+
+    itor = m_flist.find(name);
+    if (itor != m_flist.end())
+    {
+        itor->second.used = ++m_CacheTick;
+        return &itor->second;
+    }
+
+    zitor = m_zlist.find(name);
+    if (!m_Zip || zitor == m_zlist.end())
+        return NULL;
+
+    // drop the least recently used entries
+    while (!m_flist.empty() && m_CacheSize + zitor->second.size > EPUB_CACHE_SIZE)
+    {
+        oldest = m_flist.begin();
+        for (itor = m_flist.begin(); itor != m_flist.end(); itor++)
+        {
+            if (itor->second.used < oldest->second.used)
+                oldest = itor;
+        }
+        m_CacheSize -= oldest->second.size;
+        free(oldest->second.data);
+        m_flist.erase(oldest);
+    }
+
+    if (!ReadZipFile(m_Zip, zitor->second, &fdata))
+        return NULL;
+
+    fdata.used = ++m_CacheTick;
+    m_CacheSize += fdata.size;
+    itor = m_flist.insert(std::make_pair(name, fdata)).first;
+    return &itor->second;
+}
+
+bool EpubBook::ParserOcf(epub_t &epub)
+{
+    file_data_t *fdata;
     xmlDocPtr doc = NULL;
     const xmlChar *xpath = NULL;
     xmlXPathContextPtr xpathctx = NULL;
@@ -219,11 +561,11 @@ bool EpubBook::ParserOcf(epub_t &epub)
     int i;
     bool ret = false;
 
-    itor = m_flist.find(epub.ocf);
-    if (itor == m_flist.end())
+    fdata = GetFile(epub.ocf);
+    if (!fdata)
         goto end;
 
-    doc = xmlReadMemory((const char *)itor->second.data, itor->second.size, NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NOBLANKS);
+    doc = xmlReadMemory((const char *)fdata->data, fdata->size, NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NOBLANKS);
     if (!doc)
         goto end;
 
@@ -278,7 +620,7 @@ end:
 
 bool EpubBook::ParserOpf(epub_t &epub)
 {
-    filelist_t::iterator itor;
+    file_data_t *fdata;
     xmlDocPtr doc = NULL;
     const xmlChar *xpath = NULL;
     xmlXPathContextPtr xpathctx = NULL;
@@ -290,11 +632,11 @@ bool EpubBook::ParserOpf(epub_t &epub)
     int i,j;
     bool ret = false;
 
-    itor = m_flist.find(epub.opf);
-    if (itor == m_flist.end())
+    fdata = GetFile(epub.opf);
+    if (!fdata)
         goto end;
 
-    doc = xmlReadMemory((const char *)itor->second.data, itor->second.size, NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NOBLANKS);
+    doc = xmlReadMemory((const char *)fdata->data, fdata->size, NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NOBLANKS);
     if (!doc)
         goto end;
 
@@ -459,7 +801,7 @@ end:
 
 bool EpubBook::ParserNcx(epub_t &epub)
 {
-    filelist_t::iterator itor;
+    file_data_t *fdata;
     xmlDocPtr doc = NULL;
     xmlNodePtr node;
     xmlChar *order, *id, *text, *src;
@@ -476,11 +818,11 @@ bool EpubBook::ParserNcx(epub_t &epub)
     if (epub.ncx.empty())
         return true;
 
-    itor = m_flist.find(epub.path+epub.ncx);
-    if (itor == m_flist.end())
+    fdata = GetFile(epub.path+epub.ncx);
+    if (!fdata)
         goto end;
 
-    doc = xmlReadMemory((const char *)itor->second.data, itor->second.size, NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NOBLANKS);
+    doc = xmlReadMemory((const char *)fdata->data, fdata->size, NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NOBLANKS);
     if (!doc)
         goto end;
 
@@ -584,254 +926,839 @@ end:
     return ret;
 }
 
-bool EpubBook::ParserOps(file_data_t *fdata, wchar_t **text, int *len, wchar_t **title, int *tlen, bool parsertitle)
+static int GetOpsTag(xmlNodePtr node)
 {
-    filelist_t::iterator itor;
-    xmlDocPtr doc = NULL;
-    xmlChar *value;
-    const xmlChar *xpath = NULL;
-    xmlXPathContextPtr xpathctx = NULL;
-    xmlXPathObjectPtr xpathobj = NULL;
-    xmlNodeSetPtr nodeset;
+    static const char *blocks[] = { "p", "div", "li", "h1", "h2", "h3", "h4", "h5", "h6" };
     int i;
-    bool ret = false;
-    xmlChar *format_str = NULL;
-    int size;
-
-    xmlKeepBlanksDefault(0);
-    xmlIndentTreeOutput = 0;
-    doc = xmlReadMemory((const char *)fdata->data, fdata->size, NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NOBLANKS);
-    if (!doc)
-        goto end;
-
-    if (m_bForceKill)
-        goto end;
 
-#if 1 // format xml
-    xmlDocDumpFormatMemory(doc, &format_str, &size, 1);
-    xmlFreeDoc(doc);
-    if (!format_str || size <= 0)
+    if (xmlStrcasecmp(node->name, BAD_CAST"br") == 0)
+        return OPS_TAG_BREAK;
+    if (xmlStrcasecmp(node->name, BAD_CAST"script") == 0 || xmlStrcasecmp(node->name, BAD_CAST"style") == 0)
+        return OPS_TAG_SKIP;
+    for (i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++)
     {
-        if (format_str)
-            xmlFree(format_str);
-        goto end;
+        if (xmlStrcasecmp(node->name, BAD_CAST blocks[i]) == 0)
+            return OPS_TAG_BLOCK;
     }
-    
-    xmlKeepBlanksDefault(1);
-    xmlIndentTreeOutput = 0;
-    doc = xmlReadMemory((const char *)format_str, size, NULL, NULL, XML_PARSE_RECOVER/* | XML_PARSE_NOBLANKS*/);
-    xmlFree(format_str);
-    if (!doc)
-        goto end;
-#endif
-    
-    xpathctx = xmlXPathNewContext(doc);
-    if (!xpathctx)
-        goto end;
+    return OPS_TAG_INLINE;
+}
 
-    if (m_bForceKill)
-        goto end;
+static bool IsOpsText(xmlNodePtr node)
+{
+    return node->type == XML_TEXT_NODE || node->type == XML_CDATA_SECTION_NODE || node->type == XML_ENTITY_REF_NODE;
+}
 
-    if (parsertitle)
-    {
-        // parser title
-        xpath = BAD_CAST("//*[local-name()='title']");
-        xpathobj = xmlXPathEvalExpression(xpath, xpathctx);
-        if (!xpathobj)
-            goto body;
+// same as the content of the node after the document was dumped formatted and parsed again:
+// an element without text child gets a new line after its start tag and after each child.
+// in mixed content br and block elements start new lines too, script and style are skipped.
+static void GetOpsText(xmlNodePtr node, int format, std::string &text)
+{
+    xmlNodePtr child;
+    xmlChar *content;
+    int tag;
 
-        if (xmlXPathNodeSetIsEmpty(xpathobj->nodesetval))
-            goto body;
+    for (child = node->children; format && child; child = child->next)
+    {
+        if (IsOpsText(child))
+            format = 0;
+    }
 
-        nodeset = xpathobj->nodesetval;
-        for (i = 0; i < nodeset->nodeNr; i++)
+    if (format && node->children)
+        text += '\n';
+    for (child = node->children; child; child = child->next)
+    {
+        switch (child->type)
         {
-            value = xmlNodeGetContent(nodeset->nodeTab[i]);
-
-            if (!DecodeText((const char *)value, strlen((const char *)value), title, tlen))
-            {
-                xmlFree(value);
+        case XML_ELEMENT_NODE:
+            tag = GetOpsTag(child);
+            if (tag == OPS_TAG_SKIP)
                 break;
+            if (!format && (tag == OPS_TAG_BREAK || (tag == OPS_TAG_BLOCK && child != node->children)))
+                text += '\n';
+            GetOpsText(child, format, text);
+            if (!format && tag == OPS_TAG_BLOCK && child->next)
+                text += '\n';
+            break;
+        case XML_TEXT_NODE:
+        case XML_CDATA_SECTION_NODE:
+            if (child->content)
+                text += (const char *)child->content;
+            break;
+        case XML_ENTITY_REF_NODE:
+            content = xmlNodeGetContent(child);
+            if (content)
+            {
+                text += (const char *)content;
+                xmlFree(content);
             }
-            xmlFree(value);
+            break;
+        default:
             break;
         }
+        if (format)
+            text += '\n';
     }
+}
 
-    if (m_bForceKill)
-        goto end;
+// first element in document order, as xpath //*[local-name()='name']
+static xmlNodePtr FindOpsElement(xmlNodePtr node, const char *name)
+{
+    xmlNodePtr found;
 
-body:
-    if (xpathobj)
-        xmlXPathFreeObject(xpathobj);
+    for (; node; node = node->next)
     {
-        // parser body
-        xpath = BAD_CAST("//*[local-name()='body']");
-        xpathobj = xmlXPathEvalExpression(xpath, xpathctx);
-        if (!xpathobj)
-            goto end;
-
-        if (xmlXPathNodeSetIsEmpty(xpathobj->nodesetval))
-            goto end;
+        if (node->type != XML_ELEMENT_NODE)
+            continue;
+        if (xmlStrcmp(node->name, BAD_CAST name) == 0)
+            return node;
+        found = FindOpsElement(node->children, name);
+        if (found)
+            return found;
+    }
+    return NULL;
+}
 
-        nodeset = xpathobj->nodesetval;
-        for (i = 0; i < nodeset->nodeNr; i++)
+// an element inside mixed content is not formatted
+static int GetOpsFormat(xmlNodePtr node)
+{
+    xmlNodePtr child;
+
+    for (node = node->parent; node && node->type == XML_ELEMENT_NODE; node = node->parent)
+    {
+        for (child = node->children; child; child = child->next)
         {
-            value = xmlNodeGetContent(nodeset->nodeTab[i]);
+            if (IsOpsText(child))
+                return 0;
+        }
+    }
+    return 1;
+}
 
-            if (!DecodeText((const char *)value, strlen((const char *)value), text, len))
-                ret = false;
-            else
-                ret = true;
+bool EpubBook::ParserOps(file_data_t *fdata, wchar_t **text, int *len, wchar_t **title, int *tlen, bool parsertitle)
+{
+    xmlDocPtr doc = NULL;
+    xmlNodePtr node;
+    std::string value;
+    bool ret = false;
 
-            xmlFree(value);
-            break;
+    doc = xmlReadMemory((const char *)fdata->data, fdata->size, NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NOBLANKS);
+    if (!doc)
+        goto end;
+
+    if (m_bForceKill)
+        goto end;
+
+    if (parsertitle)
+    {
+        // parser title
+        node = FindOpsElement(doc->children, "title");
+        if (node)
+        {
+            GetOpsText(node, GetOpsFormat(node), value);
+            DecodeText(value.c_str(), value.size(), title, tlen);
+            value.clear();
         }
     }
 
+    if (m_bForceKill)
+        goto end;
+
+    // parser body
+    node = FindOpsElement(doc->children, "body");
+    if (!node)
+        goto end;
+
+    GetOpsText(node, GetOpsFormat(node), value);
+    ret = DecodeText(value.c_str(), value.size(), text, len);
+
 end:
-    if (xpathobj)
-        xmlXPathFreeObject(xpathobj);
-    if (xpathctx)
-        xmlXPathFreeContext(xpathctx);
     if (doc)
         xmlFreeDoc(doc);
     return ret;
 }
 
+// text of fixed documents, extracted as ParserOps does
+void EpubBook::UnitTest7(void)
+{
+#if TEST_MODEL
+    static const struct {
+        const char *xhtml;
+        const char *title;
+        const char *body;
+    } cases[] = {
+        // no mixed content: same as the formatted dump
+        { "<html><head><title>Title</title></head><body><div><p>one</p><p>two</p></div></body></html>",
+          "Title", "\n\none\ntwo\n\n" },
+        // br starts a new line
+        { "<html><body><p>a<br/>b<br/></p><p>c</p></body></html>",
+          NULL, "\na\nb\n\nc\n" },
+        // block elements inside mixed content are on their own lines
+        { "<html><body><div>x<p>y</p>z<h1>h</h1><div><p>p1</p><p>p2</p></div></div></body></html>",
+          NULL, "\nx\ny\nz\nh\n\np1\n\np2\n" },
+        // script and style are skipped
+        { "<html><body><p>a<script>var x;</script>b<style>p{}</style>c</p></body></html>",
+          NULL, "\nabc\n" },
+        // entity, cdata and inline elements
+        { "<html><body><p>a&amp;b<![CDATA[<c>]]><span>d</span><i>e<br/>f</i></p></body></html>",
+          NULL, "\na&b<c>de\nf\n" },
+        { "<html><head><title>A<b>B</b></title></head><body>text<ul><li>1</li><li>2</li></ul></body></html>",
+          "AB", "text1\n\n2" },
+    };
+    xmlDocPtr doc;
+    xmlNodePtr node;
+    std::string value;
+    int i;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        doc = xmlReadMemory(cases[i].xhtml, (int)strlen(cases[i].xhtml), NULL, NULL, XML_PARSE_RECOVER | XML_PARSE_NOBLANKS);
+        assert(doc);
+
+        node = FindOpsElement(doc->children, "title");
+        assert(!node == !cases[i].title);
+        if (node)
+        {
+            GetOpsText(node, GetOpsFormat(node), value);
+            assert(value == cases[i].title);
+            value.clear();
+        }
+
+        node = FindOpsElement(doc->children, "body");
+        assert(node);
+        GetOpsText(node, GetOpsFormat(node), value);
+        assert(value == cases[i].body);
+        value.clear();
+
+        xmlFreeDoc(doc);
+    }
+#endif
+}
+
 bool EpubBook::ParserChapters(epub_t &epub)
 {
-    typedef struct buffer_t
+    ops_text_t *texts = NULL;
+    bool ret = false;
+
+    texts = (ops_text_t *)calloc(epub.spine.size(), sizeof(ops_text_t));
+    if (!texts)
+        return false;
+
+    ParserTexts(epub, texts);
+    if (!m_bForceKill)
+        ret = MergeChapters(epub, texts);
+
+    FreeTexts(texts, (int)epub.spine.size());
+    return ret;
+}
+
+// spine documents are parsed on worker threads, a document already parsed is skipped
+void EpubBook::ParserTexts(epub_t &epub, ops_text_t *texts)
+{
+    spine_worker_t workers[PARSER_MAX_THREADS];
+    HANDLE threads[PARSER_MAX_THREADS] = { 0 };
+    SYSTEM_INFO si;
+    volatile long next = 0;
+    int count, i;
+
+    GetSystemInfo(&si);
+    count = (int)epub.spine.size();
+    if (count > (int)si.dwNumberOfProcessors)
+        count = (int)si.dwNumberOfProcessors;
+    if (count > PARSER_MAX_THREADS)
+        count = PARSER_MAX_THREADS;
+    if (count < 1)
+        count = 1;
+
+    for (i = 0; i < count; i++)
     {
-        wchar_t *text;
-        int len;
-    } buffer_t;
+        workers[i].book = this;
+        workers[i].epub = &epub;
+        workers[i].texts = texts;
+        workers[i].next = &next;
+    }
 
-    spine_t::iterator itspine;
-    filelist_t::iterator itflist;
-    mainfest_t::iterator itmfest;
+    // first worker on current thread
+    for (i = 1; i < count; i++)
+    {
+        threads[i] = (HANDLE)_beginthreadex(NULL, 0, ParserChaptersThread, &workers[i], 0, NULL);
+    }
+    ParserChaptersThread(&workers[0]);
+    for (i = 1; i < count; i++)
+    {
+        if (threads[i])
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+    }
+}
+
+// merge texts in spine order
+bool EpubBook::MergeChapters(epub_t &epub, ops_text_t *texts)
+{
     navmap_t::iterator itnav;
-    file_data_t *fdata;
+    mainfest_t::iterator itmfest;
     chapter_item_t chapter;
-    std::string filename;
-    wchar_t *text = NULL;
     wchar_t *title = NULL;
-    int len = 0, tlen = 0;
-    int index = 0, i=0, cidx=0;
-    buffer_t *buffer = NULL;
+    int count = (int)epub.spine.size();
+    int len, tlen = 0;
+    int index = 0, i, cidx = 0;
 
+    m_SpineLength.assign(count, 0);
+    m_SpineTitle.assign(count, std::wstring());
     m_TextLength = 1; // add one wchar_t '0x0a' new line for cover
-    buffer = (buffer_t *)malloc(epub.spine.size() * sizeof(buffer_t));
-    for (itspine = epub.spine.begin(); itspine != epub.spine.end(); itspine++)
+    for (i = 0; i < count; i++)
     {
-        if (m_bForceKill)
-            goto end;
-        itmfest = epub.mainfest.find(*itspine);
-        if (itmfest != epub.mainfest.end())
+        if (texts[i].len <= 0)
+            continue;
+        itmfest = epub.mainfest.find(epub.spine[i]);
+        itnav = epub.navmap.find(itmfest->second->href);
+        chapter.index = m_TextLength == 1 ? 0 : m_TextLength;
+        m_TextLength += texts[i].len;
+        if (itnav != epub.navmap.end())
         {
-            filename = epub.path + itmfest->second->href;
-            itflist = m_flist.find(filename);
-            itnav = epub.navmap.find(itmfest->second->href);
-            if (itflist != m_flist.end() /*&& itnav != epub.navmap.end()*/)
+            if (DecodeText(itnav->second->text.c_str(), itnav->second->text.size(), &title, &tlen))
             {
-                fdata = &(itflist->second);
-                if (ParserOps(fdata, &text, &len, &title, &tlen, itnav == epub.navmap.end()))
-                {
-                    if (len > 0)
-                    {
-                        buffer[index].text = text;
-                        buffer[index].len = len;
-                        chapter.index = m_TextLength == 1 ? 0 : m_TextLength;
-                        m_TextLength += len;
-                        if (itnav != epub.navmap.end())
-                        {
-                            DecodeText(itnav->second->text.c_str(), itnav->second->text.size(), &title, &tlen);
-                            chapter.title = title;
-                        }
-                        else
-                        {
-                            chapter.title = title;
-                        }
-                        if (title)
-                            free(title);
-                        if (!chapter.title.empty())
-                            m_Chapters.insert(std::make_pair(cidx++, chapter));
-                        index++;
-                    }
-                }
+                chapter.title = title;
+                free(title);
+                title = NULL;
+            }
+            else
+            {
+                chapter.title.clear();
             }
         }
-    }
-
-end:
-    if (m_bForceKill)
-    {
-        for (i = 0; i < index; i++)
+        else
         {
-            free(buffer[i].text);
+            chapter.title = texts[i].title ? texts[i].title : L"";
         }
-        free(buffer);
-        return false;
+        if (!chapter.title.empty())
+            m_Chapters.insert(std::make_pair(cidx++, chapter));
+        m_SpineLength[i] = texts[i].len;
+        m_SpineTitle[i] = chapter.title;
+        index++;
     }
+
     if (index > 0)
     {
         len = 1; // add one wchar_t '0x0a' new line for cover
         m_Text = (wchar_t *)malloc(sizeof(wchar_t) * (m_TextLength + 1));
+        if (!m_Text)
+            return false;
         m_Text[m_TextLength] = 0;
         m_Text[0] = 0x0A;
-        for (i = 0; i < index; i++)
+        for (i = 0; i < count; i++)
         {
-            memcpy(m_Text + len, buffer[i].text, buffer[i].len * sizeof(wchar_t));
-            len += buffer[i].len;
-            free(buffer[i].text);
+            if (texts[i].len <= 0)
+                continue;
+            memcpy(m_Text + len, texts[i].text, texts[i].len * sizeof(wchar_t));
+            len += texts[i].len;
         }
     }
-    free(buffer);
     return true;
 }
 
-bool EpubBook::ParserCover(epub_t &epub)
+void EpubBook::FreeTexts(ops_text_t *texts, int count)
 {
-    filelist_t::iterator itflist;
+    int i;
+
+    if (!texts)
+        return;
+    for (i = 0; i < count; i++)
+    {
+        if (texts[i].text)
+            free(texts[i].text);
+        if (texts[i].title)
+            free(texts[i].title);
+    }
+    free(texts);
+}
+
+unsigned __stdcall EpubBook::ParserChaptersThread(void* pArguments)
+{
+    spine_worker_t *worker = (spine_worker_t *)pArguments;
+    EpubBook *_this = worker->book;
+    epub_t *epub = worker->epub;
     mainfest_t::iterator itmfest;
+    ziplist_t::iterator zitor;
+    navmap_t::iterator itnav;
+    file_data_t fdata = {0};
+    ops_text_t *ops;
+    void *zip;
+    int i;
+
+    zip = _this->OpenZipReader();
+    if (!zip)
+        return 0;
+
+    while (!_this->m_bForceKill)
+    {
+        i = InterlockedIncrement(worker->next) - 1;
+        if (i >= (int)epub->spine.size())
+            break;
+        if (worker->texts[i].text)
+            continue;
+
+        itmfest = epub->mainfest.find(epub->spine[i]);
+        if (itmfest == epub->mainfest.end())
+            continue;
+        zitor = _this->m_zlist.find(epub->path + itmfest->second->href);
+        if (zitor == _this->m_zlist.end())
+            continue;
+        if (!ReadZipFile(zip, zitor->second, &fdata))
+            continue;
+
+        ops = &worker->texts[i];
+        itnav = epub->navmap.find(itmfest->second->href);
+        if (!_this->ParserOps(&fdata, &ops->text, &ops->len, &ops->title, &ops->tlen, itnav == epub->navmap.end()))
+            ops->len = 0;
+        free(fdata.data);
+        fdata.data = NULL;
+    }
+
+    unzClose(zip);
+    return 0;
+}
+
+// the text has its final length from index, documents not parsed yet are empty lines
+bool EpubBook::ParserFirstChapter(epub_t &epub)
+{
+    ops_text_t *texts = NULL;
+    chapter_item_t chapter;
+    mainfest_t::iterator itmfest;
+    navmap_t::iterator itnav;
     file_data_t *fdata;
-    IStream *pStream = NULL;
-    bool found = false;
+    int count = (int)epub.spine.size();
+    int first = -1, first_pos = 0;
+    int pos, i, cidx = 0;
 
-    if (m_Cover)
+    // spine document of last position
+    pos = 1; // one wchar_t '0x0a' new line for cover
+    for (i = 0; i < count; i++)
     {
-        delete m_Cover;
-        m_Cover = NULL;
+        if (m_SpineLength[i] <= 0)
+            continue;
+        if (first == -1 || pos <= m_StartPos)
+        {
+            first = i;
+            first_pos = pos;
+        }
+        pos += m_SpineLength[i];
     }
+    if (first == -1)
+        return false;
 
-    for (itmfest = epub.mainfest.begin(); itmfest != epub.mainfest.end(); itmfest++)
+    texts = (ops_text_t *)calloc(count, sizeof(ops_text_t));
+    if (!texts)
+        return false;
+
+    itmfest = epub.mainfest.find(epub.spine[first]);
+    fdata = GetFile(epub.path + itmfest->second->href);
+    if (!fdata)
+        goto fail;
+    itnav = epub.navmap.find(itmfest->second->href);
+    if (!ParserOps(fdata, &texts[first].text, &texts[first].len, &texts[first].title, &texts[first].tlen, itnav == epub.navmap.end()))
+        goto fail;
+    if (texts[first].len != m_SpineLength[first])
+        goto fail;
+
+    m_TextLength = pos;
+    m_Text = (wchar_t *)malloc(sizeof(wchar_t) * (m_TextLength + 1));
+    if (!m_Text)
+        goto fail;
+    wmemset(m_Text, 0x0A, m_TextLength);
+    m_Text[m_TextLength] = 0;
+    memcpy(m_Text + first_pos, texts[first].text, texts[first].len * sizeof(wchar_t));
+
+    pos = 1;
+    for (i = 0; i < count; i++)
     {
-        if (strstr(itmfest->first.c_str(), "cover") && strstr(itmfest->second->media_type.c_str(), "image/"))
+        if (m_SpineLength[i] <= 0)
+            continue;
+        if (!m_SpineTitle[i].empty())
         {
-            found = true;
-            break;
+            chapter.index = pos == 1 ? 0 : pos;
+            chapter.title = m_SpineTitle[i];
+            m_Chapters.insert(std::make_pair(cidx++, chapter));
         }
+        pos += m_SpineLength[i];
     }
 
-    if (!found)
+    m_Texts = texts;
+    return true;
+
+fail:
+    FreeTexts(texts, count);
+    return false;
+}
+
+void EpubBook::StartFill(HWND hWnd)
+{
+    m_hWnd = hWnd;
+    m_FillDone = 0;
+    m_hFillThread = (HANDLE)_beginthreadex(NULL, 0, FillTextThread, this, 0, NULL);
+    if (!m_hFillThread)
+        FillTextThread(this);
+}
+
+void EpubBook::StopFill(void)
+{
+    if (m_hFillThread)
+    {
+        m_bForceKill = TRUE;
+        WaitForSingleObject(m_hFillThread, INFINITE);
+        CloseHandle(m_hFillThread);
+        m_hFillThread = NULL;
+        m_bForceKill = FALSE;
+    }
+}
+
+unsigned __stdcall EpubBook::FillTextThread(void* pArguments)
+{
+    EpubBook *_this = (EpubBook *)pArguments;
+
+    _this->ParserTexts(_this->m_Epub, _this->m_Texts);
+    // zip entries are only read by this thread until the texts are merged
+    if (!_this->m_bForceKill && _this->m_CoverThumb)
+        _this->m_FullCover = _this->LoadCover(_this->m_Epub);
+    if (!_this->m_bForceKill)
+    {
+        InterlockedExchange(&_this->m_FillDone, 1);
+        // redraw, the texts are merged when the page is drawn
+        if (_this->m_hWnd)
+            InvalidateRect(_this->m_hWnd, NULL, FALSE);
+    }
+    return 0;
+}
+
+bool EpubBook::LoadSpineIndex(epub_t &epub)
+{
+    TCHAR filename[MAX_PATH];
+    FILE *fp = NULL;
+    char *buf = NULL;
+    int len = 0;
+    epub_index_header_t *header = NULL;
+    epub_spine_info_t *sinfo = NULL;
+    int i, n;
+    u32 length;
+    bool result = false;
+
+    if (!m_FileTime || !GetIndexFileName(filename, FALSE))
         return false;
 
-    itflist = m_flist.find(epub.path + itmfest->second->href);
-    if (itflist != m_flist.end())
+    // read file to memory
+    fp = _tfopen(filename, _T("rb"));
+    if (!fp)
+        goto end;
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (len < (int)sizeof(epub_index_header_t))
+        goto end;
+    buf = (char *)malloc(len);
+    if (!buf)
+        goto end;
+    if ((int)fread(buf, 1, len, fp) != len)
+        goto end;
+
+    // file is changed
+    header = (epub_index_header_t *)buf;
+    if (header->version != EPUB_INDEX_VERSION
+        || header->header_size != (u32)len
+        || header->file_size != m_FileSize
+        || header->file_time != m_FileTime
+        || header->file_hash != m_FileHash
+        || header->spine_size != (u32)epub.spine.size()
+        || header->spine_size > (u32)((len - offsetof(epub_index_header_t, spine_info_list)) / sizeof(epub_spine_info_t)))
+        goto end;
+
+    m_SpineLength.clear();
+    m_SpineTitle.clear();
+    length = 1;
+    for (i = 0; i < (int)header->spine_size; i++)
     {
-        fdata = &(itflist->second);
-        pStream = SHCreateMemStream((const BYTE *)fdata->data, fdata->size);
-        m_Cover = new Bitmap(pStream);
-        if (m_Cover)
+        sinfo = &(header->spine_info_list[i]);
+        m_SpineLength.push_back((int)sinfo->length);
+        m_SpineTitle.push_back(std::wstring());
+        length += sinfo->length;
+        if (sinfo->title_offset == 0)
+            continue;
+        n = (len - (int)sinfo->title_offset) / sizeof(TCHAR);
+        if (sinfo->title_offset >= (u32)len || n <= 0
+            || wcsnlen((TCHAR *)(buf + sinfo->title_offset), n) == (size_t)n)
+            goto end;
+        m_SpineTitle[i] = (TCHAR *)(buf + sinfo->title_offset);
+    }
+    if (length != header->text_length)
+        goto end;
+    result = true;
+
+end:
+    if (fp)
+        fclose(fp);
+    if (buf)
+        free(buf);
+    return result;
+}
+
+bool EpubBook::SaveSpineIndex(void)
+{
+    TCHAR filename[MAX_PATH];
+    FILE *fp = NULL;
+    epub_index_header_t *header = NULL;
+    char *buf = NULL;
+    int buf_size, offset, size;
+    int i, count = (int)m_SpineLength.size();
+    bool result = false;
+
+    if (!m_FileTime || count == 0 || !GetIndexFileName(filename, TRUE))
+        return false;
+
+    // calc buf size
+    buf_size = sizeof(epub_index_header_t) + (sizeof(epub_spine_info_t) * (count - 1));
+    offset = buf_size;
+    for (i = 0; i < count; i++)
+    {
+        if (!m_SpineTitle[i].empty())
+            buf_size += (m_SpineTitle[i].size() + 1) * sizeof(TCHAR);
+    }
+
+    buf = (char *)malloc(buf_size);
+    if (!buf)
+        goto end;
+    memset(buf, 0, offset);
+    header = (epub_index_header_t *)buf;
+    header->header_size = buf_size;
+    header->version = EPUB_INDEX_VERSION;
+    header->file_size = m_FileSize;
+    header->file_time = m_FileTime;
+    header->file_hash = m_FileHash;
+    header->text_length = m_TextLength;
+    header->spine_size = count;
+    for (i = 0; i < count; i++)
+    {
+        header->spine_info_list[i].length = m_SpineLength[i];
+        if (m_SpineTitle[i].empty())
+            continue;
+        size = (m_SpineTitle[i].size() + 1) * sizeof(TCHAR);
+        header->spine_info_list[i].title_offset = offset;
+        memcpy(buf + offset, m_SpineTitle[i].c_str(), size);
+        offset += size;
+    }
+
+    fp = _tfopen(filename, _T("wb"));
+    if (!fp)
+        goto end;
+    if ((int)fwrite(buf, 1, buf_size, fp) != buf_size)
+        goto end;
+    result = true;
+
+end:
+    if (fp)
+    {
+        fclose(fp);
+        if (!result)
+            DeleteFile(filename);
+    }
+    if (buf)
+        free(buf);
+    return result;
+}
+
+static bool GetEncoderClsid(const WCHAR *format, CLSID *clsid)
+{
+    ImageCodecInfo *codecs = NULL;
+    UINT num = 0, size = 0, i;
+    bool found = false;
+
+    GetImageEncodersSize(&num, &size);
+    if (size == 0)
+        return false;
+    codecs = (ImageCodecInfo *)malloc(size);
+    if (!codecs)
+        return false;
+    GetImageEncoders(num, size, codecs);
+    for (i = 0; i < num; i++)
+    {
+        if (wcscmp(codecs[i].MimeType, format) == 0)
         {
-            if (Gdiplus::Ok != m_Cover->GetLastStatus())
-            {
-                delete m_Cover;
-                m_Cover = NULL;
-            }
+            *clsid = codecs[i].Clsid;
+            found = true;
+            break;
         }
-        pStream->Release();
     }
+    free(codecs);
+    return found;
+}
 
+bool EpubBook::ParserCover(epub_t &epub)
+{
+    FreeCover();
+    m_Cover = LoadCover(epub);
     return m_Cover != NULL;
+}
+
+Bitmap * EpubBook::LoadCover(epub_t &epub)
+{
+    mainfest_t::iterator itmfest;
+    file_data_t *fdata;
+
+    for (itmfest = epub.mainfest.begin(); itmfest != epub.mainfest.end(); itmfest++)
+    {
+        if (strstr(itmfest->first.c_str(), "cover") && strstr(itmfest->second->media_type.c_str(), "image/"))
+            break;
+    }
+    if (itmfest == epub.mainfest.end())
+        return NULL;
+
+    fdata = GetFile(epub.path + itmfest->second->href);
+    if (!fdata)
+        return NULL;
+    return DecodeImage((const char *)fdata->data, (int)fdata->size);
+}
+
+// thumbnail is saved with spine index, it is valid when the index is loaded
+bool EpubBook::LoadCoverThumb(void)
+{
+    TCHAR filename[MAX_PATH];
+    FILE *fp = NULL;
+    char *buf = NULL;
+    int len = 0;
+
+    if (!m_FileTime || !GetIndexFileName(filename, FALSE))
+        return false;
+    PathRenameExtension(filename, _T(".png"));
+
+    fp = _tfopen(filename, _T("rb"));
+    if (!fp)
+        goto end;
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (len <= 0)
+        goto end;
+    buf = (char *)malloc(len);
+    if (!buf)
+        goto end;
+    if ((int)fread(buf, 1, len, fp) != len)
+        goto end;
+
+    FreeCover();
+    m_Cover = DecodeImage(buf, len);
+    m_CoverThumb = m_Cover != NULL;
+
+end:
+    if (fp)
+        fclose(fp);
+    if (buf)
+        free(buf);
+    return m_CoverThumb;
+}
+
+bool EpubBook::SaveCoverThumb(void)
+{
+    TCHAR filename[MAX_PATH];
+    Bitmap *thumb = NULL;
+    CLSID clsid;
+    int w, h;
+    bool result = false;
+
+    if (!m_FileTime || !GetIndexFileName(filename, TRUE))
+        return false;
+    PathRenameExtension(filename, _T(".png"));
+
+    if (!m_Cover)
+        goto end;
+
+    w = m_Cover->GetWidth();
+    h = m_Cover->GetHeight();
+    if (w >= h && w > COVER_THUMB_SIZE)
+    {
+        h = h * COVER_THUMB_SIZE / w;
+        w = COVER_THUMB_SIZE;
+    }
+    else if (h > w && h > COVER_THUMB_SIZE)
+    {
+        w = w * COVER_THUMB_SIZE / h;
+        h = COVER_THUMB_SIZE;
+    }
+
+    thumb = ScaleImage(m_Cover, w, h);
+    if (!thumb || !GetEncoderClsid(L"image/png", &clsid))
+        goto end;
+    result = Gdiplus::Ok == thumb->Save(filename, &clsid, NULL);
+
+end:
+    if (thumb)
+        delete thumb;
+    if (!result)
+        DeleteFile(filename);
+    return result;
+}
+
+void EpubBook::FreeCover(void)
+{
+    if (m_Cover)
+    {
+        delete m_Cover;
+        m_Cover = NULL;
+    }
+    if (m_ScaledCover)
+    {
+        delete m_ScaledCover;
+        m_ScaledCover = NULL;
+    }
+    if (m_FullCover)
+    {
+        delete m_FullCover;
+        m_FullCover = NULL;
+    }
+    m_CoverThumb = false;
+}
+
+Bitmap * EpubBook::DecodeImage(const char *data, int size)
+{
+    IStream *pStream = NULL;
+    Bitmap *image = NULL;
+
+    pStream = SHCreateMemStream((const BYTE *)data, size);
+    if (!pStream)
+        return NULL;
+    image = new Bitmap(pStream);
+    if (image && Gdiplus::Ok != image->GetLastStatus())
+    {
+        delete image;
+        image = NULL;
+    }
+    pStream->Release();
+    return image;
+}
+
+// scale with high quality once, the result is drawn without scaling
+Bitmap * EpubBook::ScaleImage(Bitmap *image, int w, int h)
+{
+    Bitmap *scaled = NULL;
+    Graphics *g = NULL;
+    ImageAttributes attr;
+
+    if (!image || w <= 0 || h <= 0)
+        return NULL;
+
+    scaled = new Bitmap(w, h, PixelFormat32bppPARGB);
+    if (!scaled)
+        return NULL;
+    if (Gdiplus::Ok != scaled->GetLastStatus())
+    {
+        delete scaled;
+        return NULL;
+    }
+
+    // mirror the edge pixels, or the border is blended with transparent
+    attr.SetWrapMode(WrapModeTileFlipXY);
+    g = Graphics::FromImage(scaled);
+    g->SetInterpolationMode(InterpolationModeHighQualityBicubic);
+    g->SetPixelOffsetMode(PixelOffsetModeHighQuality);
+    g->DrawImage(image, Rect(0, 0, w, h), 0, 0, image->GetWidth(), image->GetHeight(), UnitPixel, &attr);
+    delete g;
+    return scaled;
 }
\ No newline at end of file
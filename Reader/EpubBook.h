@@ -6,13 +6,34 @@
 #include <map>
 #include <vector>
 
+#define EPUB_CACHE_SIZE     (8 * 1024 * 1024) // inflated entries kept in memory
+#define COVER_THUMB_SIZE    400 // longer side of cover thumbnail, saved to INDEX_FILE_SAVE_PATH
+
 typedef struct file_data_t
 {
     void *data;
     size_t size;
+    u32 used; // last access, for lru
 } file_data_t;
 typedef std::map<std::string, file_data_t> filelist_t;
 
+// position of an entry in the central directory
+typedef struct zip_entry_t
+{
+    u64 pos;
+    u64 num;
+    size_t size;
+} zip_entry_t;
+typedef std::map<std::string, zip_entry_t> ziplist_t;
+
+// mapped epub file, read by unzip
+typedef struct zip_stream_t
+{
+    const char *data;
+    u64 size;
+    u64 pos;
+} zip_stream_t;
+
 typedef struct mainfest_item_t
 {
     std::string id;
@@ -43,6 +64,23 @@ typedef struct epub_t
     navmap_t navmap;
 } epub_t;
 
+// text of one spine document
+typedef struct ops_text_t
+{
+    wchar_t *text;
+    int len;
+    wchar_t *title;
+    int tlen;
+} ops_text_t;
+
+class EpubBook;
+typedef struct spine_worker_t
+{
+    EpubBook *book;
+    epub_t *epub;
+    ops_text_t *texts;
+    volatile long *next; // next spine document to parse
+} spine_worker_t;
 
 class EpubBook : public Book
 {
@@ -55,21 +93,66 @@ public:
     virtual bool SaveBook(HWND hWnd);
     virtual bool UpdateChapters(int offset);
     Bitmap * GetCoverImage(void);
+    Bitmap * GetCoverImage(int w, int h);
+    void SetStartPos(int pos);
+    void WaitFill(void);
 
 protected:
     virtual bool ParserBook(HWND hWnd);
+    virtual void MergeText(void);
+    void FreeEpub(epub_t &epub);
     void FreeFilelist(void);
-    bool UnzipBook(void);
+    bool OpenZip(void);
+    void CloseZip(void);
+    file_data_t *GetFile(const std::string &name);
+    void *OpenZipReader(void);
+    static bool ReadZipFile(void *zip, const zip_entry_t &entry, file_data_t *fdata);
     bool ParserOcf(epub_t &epub);
     bool ParserOpf(epub_t &epub);
     bool ParserNcx(epub_t &epub);
     bool ParserOps(file_data_t *fdata, wchar_t **text, int *len, wchar_t **title, int *tlen, bool parsertitle);
+    void UnitTest7(void);
     bool ParserChapters(epub_t &epub);
+    void ParserTexts(epub_t &epub, ops_text_t *texts);
+    bool MergeChapters(epub_t &epub, ops_text_t *texts);
+    static void FreeTexts(ops_text_t *texts, int count);
+    static unsigned __stdcall ParserChaptersThread(void* pArguments);
+    bool ParserFirstChapter(epub_t &epub);
+    void StartFill(HWND hWnd);
+    void StopFill(void);
+    static unsigned __stdcall FillTextThread(void* pArguments);
+    bool LoadSpineIndex(epub_t &epub);
+    bool SaveSpineIndex(void);
     bool ParserCover(epub_t &epub);
+    Bitmap * LoadCover(epub_t &epub);
+    bool LoadCoverThumb(void);
+    bool SaveCoverThumb(void);
+    void FreeCover(void);
+    static Bitmap * DecodeImage(const char *data, int size);
+    static Bitmap * ScaleImage(Bitmap *image, int w, int h);
 
 protected:
     Bitmap *m_Cover;
+    Bitmap *m_ScaledCover; // m_Cover scaled to the size of cover page
+    Bitmap *m_FullCover; // decoded in background when m_Cover is the thumbnail
+    bool m_CoverThumb;
     filelist_t m_flist;
+    ziplist_t m_zlist;
+    void *m_Zip;
+    HANDLE m_hFile;
+    HANDLE m_hMapping;
+    zip_stream_t m_Stream;
+    size_t m_CacheSize;
+    u32 m_CacheTick;
+    epub_t m_Epub; // kept until the background parsing is merged
+    std::vector<int> m_SpineLength; // text length of every spine document
+    std::vector<std::wstring> m_SpineTitle; // empty: not a chapter
+    int m_StartPos; // last position, its chapter is parsed first
+    ops_text_t *m_Texts; // parsed in background
+    HANDLE m_hFillThread;
+    volatile long m_FillDone;
+    HWND m_hWnd;
+    DWORD m_OpenTime;
 };
 
 #endif
@@ -0,0 +1,250 @@
+#include "stdafx.h"
+#include "GlyphCache.h"
+
+
+// BMP ranges that hold nearly all chars of txt/epub/online books, stored as dense table
+const GlyphCache::dense_range_t GlyphCache::m_DenseRanges[] =
+{
+    { 0x0020, 0x0250, 0 },      // ASCII, Latin-1, Latin Extended-A/B
+    { 0x2000, 0x2070, 592 },    // General Punctuation
+    { 0x3000, 0x3100, 704 },    // CJK Symbols and Punctuation, Hiragana, Katakana
+    { 0x4E00, 0xA000, 960 },    // CJK Unified Ideographs
+    { 0xFF00, 0xFFF0, 21952 }   // Halfwidth and Fullwidth Forms
+};
+const INT GlyphCache::m_DenseRangeCount = sizeof(m_DenseRanges) / sizeof(m_DenseRanges[0]);
+const INT GlyphCache::m_DenseSize = 22192;
+
+GdiCharMetrics::GdiCharMetrics()
+    : m_hdc(NULL)
+    , m_Extents(NULL)
+    , m_ExtentSize(0)
+{
+}
+
+GdiCharMetrics::~GdiCharMetrics()
+{
+    if (m_Extents)
+    {
+        free(m_Extents);
+        m_Extents = NULL;
+    }
+}
+
+void GdiCharMetrics::SetDC(HDC hdc)
+{
+    m_hdc = hdc;
+}
+
+BOOL GdiCharMetrics::GetCharWidths(const wchar_t *text, int len, LONG *widths)
+{
+    SIZE sz = { 0 };
+    int i;
+
+    if (!m_hdc || !text || len <= 0)
+        return FALSE;
+
+    if (len == 1)
+    {
+        if (!GetTextExtentPoint32(m_hdc, text, 1, &sz))
+            return FALSE;
+        widths[0] = sz.cx;
+        return TRUE;
+    }
+
+    if (m_ExtentSize < len)
+    {
+        m_ExtentSize = len;
+        m_Extents = (INT *)realloc(m_Extents, m_ExtentSize * sizeof(INT));
+    }
+
+    // one call for the whole run, the partial extents give the width of each char
+    if (!GetTextExtentExPoint(m_hdc, text, len, 0, NULL, m_Extents, &sz))
+        return FALSE;
+    widths[0] = m_Extents[0];
+    for (i = 1; i < len; i++)
+    {
+        widths[i] = m_Extents[i] - m_Extents[i - 1];
+    }
+    return TRUE;
+}
+
+GlyphCache::GlyphCache()
+    : m_Gap(0)
+    , m_Bound(FALSE)
+    , m_Dense(NULL)
+    , m_Metrics(NULL)
+{
+    memset(&m_Font, 0, sizeof(m_Font));
+}
+
+GlyphCache::~GlyphCache()
+{
+    Clear();
+    if (m_Dense)
+    {
+        free(m_Dense);
+        m_Dense = NULL;
+    }
+}
+
+BOOL GlyphCache::Bind(HDC hdc, INT gap)
+{
+    LOGFONT lf;
+    HFONT hFont;
+
+    memset(&lf, 0, sizeof(lf));
+    hFont = (HFONT)GetCurrentObject(hdc, OBJ_FONT);
+    if (!hFont || !GetObject(hFont, sizeof(LOGFONT), &lf))
+        return FALSE;
+
+    m_GdiMetrics.SetDC(hdc);
+    return Bind(&lf, gap, &m_GdiMetrics);
+}
+
+BOOL GlyphCache::Bind(const LOGFONT *font, INT gap, CharMetrics *metrics)
+{
+    m_Metrics = metrics;
+    if (m_Bound && m_Gap == gap && 0 == memcmp(font, &m_Font, sizeof(LOGFONT)))
+        return TRUE;
+
+    // font or char gap changed
+    Clear();
+    memcpy(&m_Font, font, sizeof(LOGFONT));
+    m_Gap = gap;
+    m_Bound = TRUE;
+    Prewarm();
+    return TRUE;
+}
+
+void GlyphCache::Clear(void)
+{
+    if (m_Dense)
+    {
+        memset(m_Dense, 0xFF, m_DenseSize * sizeof(LONG));
+    }
+    m_Sparse.clear();
+    m_Bound = FALSE;
+}
+
+void GlyphCache::Prewarm(void)
+{
+    INT i;
+
+    for (i = 0; i < m_DenseRangeCount; i++)
+    {
+        FillDense(i);
+    }
+}
+
+LONG GlyphCache::GetWidth(wchar_t c)
+{
+    return GetAdvance(c) - m_Gap;
+}
+
+LONG GlyphCache::GetAdvance(wchar_t c)
+{
+    LONG *slot;
+    std::unordered_map<wchar_t, LONG>::iterator itor;
+    LONG adv;
+
+    slot = FindDense(c);
+    if (slot)
+    {
+        if (*slot < 0)
+            *slot = Measure(c) + m_Gap;
+        return *slot;
+    }
+
+    itor = m_Sparse.find(c);
+    if (itor != m_Sparse.end())
+        return itor->second;
+
+    adv = Measure(c) + m_Gap;
+    m_Sparse.insert(std::make_pair(c, adv));
+    return adv;
+}
+
+LONG GlyphCache::GetTextWidth(const wchar_t *text, int len)
+{
+    LONG width = 0;
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        width += GetWidth(text[i]);
+    }
+    return width;
+}
+
+INT GlyphCache::GetGap(void)
+{
+    return m_Gap;
+}
+
+const LOGFONT * GlyphCache::GetFont(void)
+{
+    return &m_Font;
+}
+
+LONG GlyphCache::Measure(wchar_t c)
+{
+    LONG width = 0;
+
+    if (!m_Metrics || !m_Metrics->GetCharWidths(&c, 1, &width))
+        return 0;
+    return width;
+}
+
+LONG * GlyphCache::FindDense(wchar_t c)
+{
+    INT i;
+
+    if (!m_Dense)
+    {
+        m_Dense = (LONG *)malloc(m_DenseSize * sizeof(LONG));
+        if (!m_Dense)
+            return NULL;
+        memset(m_Dense, 0xFF, m_DenseSize * sizeof(LONG));
+    }
+
+    for (i = 0; i < m_DenseRangeCount; i++)
+    {
+        if (c < m_DenseRanges[i].begin)
+            return NULL;
+        if (c < m_DenseRanges[i].end)
+            return m_Dense + m_DenseRanges[i].offset + (c - m_DenseRanges[i].begin);
+    }
+    return NULL;
+}
+
+void GlyphCache::FillDense(INT range)
+{
+    const INT CHUNK_SIZE = 1024;
+    wchar_t text[CHUNK_SIZE];
+    LONG widths[CHUNK_SIZE];
+    const dense_range_t *r = &m_DenseRanges[range];
+    LONG *table;
+    INT begin, len, i;
+
+    if (!m_Metrics)
+        return;
+
+    table = FindDense(r->begin);
+    if (!table)
+        return;
+
+    for (begin = r->begin; begin < r->end; begin += len)
+    {
+        len = r->end - begin < CHUNK_SIZE ? r->end - begin : CHUNK_SIZE;
+        for (i = 0; i < len; i++)
+        {
+            text[i] = (wchar_t)(begin + i);
+        }
+        if (!m_Metrics->GetCharWidths(text, len, widths))
+            return; // measure on demand
+        for (i = 0; i < len; i++)
+        {
+            table[begin - r->begin + i] = widths[i] + m_Gap;
+        }
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef __GLYPH_CACHE_H__
+#define __GLYPH_CACHE_H__
+
+#include "types.h"
+#include <unordered_map>
+
+// metrics provider, measure the advance width of each char in text
+class CharMetrics
+{
+public:
+    virtual ~CharMetrics() {}
+    virtual BOOL GetCharWidths(const wchar_t *text, int len, LONG *widths) = 0;
+};
+
+class GdiCharMetrics : public CharMetrics
+{
+public:
+    GdiCharMetrics();
+    virtual ~GdiCharMetrics();
+
+public:
+    void SetDC(HDC hdc);
+    virtual BOOL GetCharWidths(const wchar_t *text, int len, LONG *widths);
+
+protected:
+    HDC m_hdc;
+    INT *m_Extents;
+    INT m_ExtentSize;
+};
+
+// advance width cache, keyed by (font, char_gap)
+class GlyphCache
+{
+public:
+    GlyphCache();
+    virtual ~GlyphCache();
+
+public:
+    BOOL Bind(HDC hdc, INT gap);
+    BOOL Bind(const LOGFONT *font, INT gap, CharMetrics *metrics);
+    void Clear(void);
+    void Prewarm(void);
+    LONG GetWidth(wchar_t c);
+    LONG GetAdvance(wchar_t c);
+    LONG GetTextWidth(const wchar_t *text, int len);
+    INT GetGap(void);
+    const LOGFONT *GetFont(void);
+
+protected:
+    LONG Measure(wchar_t c);
+    LONG *FindDense(wchar_t c);
+    void FillDense(INT range);
+
+protected:
+    typedef struct dense_range_t
+    {
+        wchar_t begin;
+        wchar_t end; // not include
+        INT offset;
+    } dense_range_t;
+    static const dense_range_t m_DenseRanges[];
+    static const INT m_DenseRangeCount;
+    static const INT m_DenseSize;
+
+    LOGFONT m_Font;
+    INT m_Gap;
+    BOOL m_Bound;
+    LONG *m_Dense; // -1: not measured
+    std::unordered_map<wchar_t, LONG> m_Sparse;
+    CharMetrics *m_Metrics;
+    GdiCharMetrics m_GdiMetrics;
+};
+
+#endif
@@ -3,16 +3,29 @@
 #include "libxml/HTMLparser.h"
 #include "libxml/xpath.h"
 #include "libxml/HTMLtree.h"
+#include "libxml/parserInternals.h"
+#include "libxml/SAX2.h"
 
 
 HtmlParser::HtmlParser()
 {
     xmlInitParser();
+    m_hMutex = CreateMutex(NULL, FALSE, NULL);
 }
 
 
 HtmlParser::~HtmlParser()
 {
+    std::map<std::string, void*>::iterator it;
+
+    for (it = m_Xpaths.begin(); it != m_Xpaths.end(); it++)
+    {
+        if (it->second)
+            xmlXPathFreeCompExpr((xmlXPathCompExprPtr)it->second);
+    }
+    m_Xpaths.clear();
+    if (m_hMutex)
+        CloseHandle(m_hMutex);
     xmlCleanupParser();
 }
 
@@ -69,6 +82,99 @@ void HtmlParser::ReleaseContent(char *content)
         free(content);
 }
 
+// compile once for each xpath string, a compiled expression can be evaluated by many threads
+void *HtmlParser::GetXpath(const std::string &xpath)
+{
+    std::map<std::string, void*>::iterator it;
+    xmlXPathCompExprPtr comp;
+
+    WaitForSingleObject(m_hMutex, INFINITE);
+    it = m_Xpaths.find(xpath);
+    if (it != m_Xpaths.end())
+    {
+        comp = (xmlXPathCompExprPtr)it->second;
+    }
+    else
+    {
+        comp = xmlXPathCompile(BAD_CAST xpath.c_str());
+        m_Xpaths[xpath] = comp; // keep invalid one too, don't compile it again
+    }
+    ReleaseMutex(m_hMutex);
+    return comp;
+}
+
+static bool IsTextNode(xmlNodePtr node)
+{
+    return node->type == XML_TEXT_NODE || node->type == XML_ENTITY_REF_NODE;
+}
+
+static bool IsBreakNode(xmlNodePtr node)
+{
+    // "<br>" in the dumped html, the one with attributes is kept
+    return node->type == XML_ELEMENT_NODE && node->ns == NULL && node->properties == NULL
+        && xmlStrEqual(node->name, BAD_CAST "br");
+}
+
+static const htmlElemDesc *GetElemDesc(xmlNodePtr node)
+{
+    if (node->type != XML_ELEMENT_NODE || node->ns != NULL || node->name == NULL)
+        return NULL;
+    return htmlTagLookup(node->name);
+}
+
+// put "\n" where htmlNodeDumpFormatOutput writes it when format is 1, and "\n" for each "<br>" or "<br><br>".
+// adjacent text nodes are merged by xmlAddChild, the same as parsing the dumped html.
+static void FormatNode(xmlDocPtr doc, xmlNodePtr node)
+{
+    const htmlElemDesc *info = GetElemDesc(node);
+    const htmlElemDesc *cinfo;
+    std::vector<xmlNodePtr> children;
+    xmlNodePtr cur;
+    bool block;
+    bool head, tail;
+    size_t i;
+    int n;
+
+    if (node->type != XML_ELEMENT_NODE || !node->children)
+        return;
+
+    block = info && !info->isinline && node->name[0] != 'p';
+    head = block && !IsTextNode(node->children) && node->children != node->last;
+    tail = block && !IsTextNode(node->last) && node->children != node->last;
+
+    for (cur = node->children; cur; cur = cur->next)
+        children.push_back(cur);
+    for (i = 0; i < children.size(); i++)
+        xmlUnlinkNode(children[i]);
+
+    if (head)
+        xmlAddChild(node, xmlNewDocText(doc, BAD_CAST "\n"));
+    for (i = 0; i < children.size(); i++)
+    {
+        cur = children[i];
+        if (IsBreakNode(cur))
+        {
+            for (n = 0; i < children.size() && IsBreakNode(children[i]); i++, n++)
+            {
+                if (n % 2 == 0)
+                    xmlAddChild(node, xmlNewDocText(doc, BAD_CAST "\n"));
+                xmlFreeNode(children[i]);
+            }
+            i--;
+            continue;
+        }
+
+        FormatNode(doc, cur);
+        xmlAddChild(node, cur);
+        cinfo = GetElemDesc(cur);
+        if (cinfo && !cinfo->isinline && i + 1 < children.size() && !IsTextNode(children[i + 1])
+            && node->name && node->name[0] != 'p')
+            xmlAddChild(node, xmlNewDocText(doc, BAD_CAST "\n"));
+    }
+    if (tail)
+        xmlAddChild(node, xmlNewDocText(doc, BAD_CAST "\n"));
+}
+
 #define GOTO_STOP(s) if (*(s)) goto _stop
 
 int HtmlParser::HtmlParseByXpath(const char* html, int len, const std::string& xpath, std::vector<std::string>& value, bool* stop, bool clear)
@@ -77,6 +183,7 @@ int HtmlParser::HtmlParseByXpath(const char* html, int len, const std::string& x
     xmlDocPtr doc = NULL;
     xmlXPathContextPtr xpathCtx = NULL;
     xmlXPathObjectPtr xpathObj = NULL;
+    xmlXPathCompExprPtr comp = NULL;
     xmlNodeSetPtr nodeset = NULL;
     xmlChar* keyword = NULL;
     char* content = NULL;
@@ -100,7 +207,8 @@ int HtmlParser::HtmlParseByXpath(const char* html, int len, const std::string& x
 
     GOTO_STOP(stop);
 
-    xpathObj = xmlXPathEvalExpression(BAD_CAST xpath.c_str(), xpathCtx);
+    comp = (xmlXPathCompExprPtr)GetXpath(xpath);
+    xpathObj = comp ? xmlXPathCompiledEval(comp, xpathCtx) : NULL;
     xmlXPathFreeContext(xpathCtx);
     xpathCtx = NULL;
     if (xpathObj == NULL)
@@ -156,15 +264,16 @@ _stop:
     return 1;
 }
 
-int HtmlParser::HtmlParseBegin(const char *html, int len, void** pdoc, void** pctx, bool* stop)
+int HtmlParser::HtmlParseBegin(const char *html, int len, void** pdoc, void** pctx, bool* stop, bool format)
 {
     xmlDocPtr doc = NULL;
     xmlXPathContextPtr xpathCtx = NULL;
+    xmlNodePtr node;
 
     *pdoc = NULL;
     *pctx = NULL;
     GOTO_STOP(stop);
-    doc = htmlReadMemory(html, len, NULL, NULL, HTML_PARSE_RECOVER);
+    doc = htmlReadMemory(html, len, NULL, NULL, format ? HTML_PARSE_RECOVER | HTML_PARSE_NOBLANKS : HTML_PARSE_RECOVER);
     if (doc == NULL)
     {
         return 1;
@@ -172,6 +281,13 @@ int HtmlParser::HtmlParseBegin(const char *html, int len, void** pdoc, void** pc
 
     GOTO_STOP(stop);
 
+    if (format)
+    {
+        for (node = doc->children; node; node = node->next)
+            FormatNode(doc, node);
+        GOTO_STOP(stop);
+    }
+
     xpathCtx = xmlXPathNewContext(doc);
     if (xpathCtx == NULL)
     {
@@ -197,6 +313,7 @@ int HtmlParser::HtmlParseByXpath(void* doc_, void* ctx_, const std::string& xpat
     xmlDocPtr doc = (xmlDocPtr)doc_;
     xmlXPathContextPtr xpathCtx = (xmlXPathContextPtr)ctx_;
     xmlXPathObjectPtr xpathObj = NULL;
+    xmlXPathCompExprPtr comp = NULL;
     xmlNodeSetPtr nodeset = NULL;
     xmlChar* keyword = NULL;
     char* content = NULL;
@@ -206,7 +323,10 @@ int HtmlParser::HtmlParseByXpath(void* doc_, void* ctx_, const std::string& xpat
 
     GOTO_STOP(stop);
 
-    xpathObj = xmlXPathEvalExpression(BAD_CAST xpath.c_str(), xpathCtx);
+    comp = (xmlXPathCompExprPtr)GetXpath(xpath);
+    if (comp == NULL)
+        return 1;
+    xpathObj = xmlXPathCompiledEval(comp, xpathCtx);
     if (xpathObj == NULL)
     {
         return 1;
@@ -262,6 +382,485 @@ int HtmlParser::HtmlParseEnd(void* doc_, void* ctx_)
     return 0;
 }
 
+// text of the element matched by a simple xpath, read by sax without building the tree.
+// supported: ('/' | '//') step, ..., ('/@' attr)?, step: (name | '*') ('[@attr=\'value\']' | '[n]')?
+typedef struct xpath_step_t
+{
+    bool desc; // '//'
+    std::string name; // empty: '*'
+    std::string attr; // predicate [@attr='value']
+    std::string value;
+    int pos; // predicate [n], 0: none
+} xpath_step_t;
+
+typedef struct sax_capture_t
+{
+    std::string text;
+    int depth; // element depth where capture begins
+    size_t index; // in value
+} sax_capture_t;
+
+typedef struct sax_frame_t
+{
+    const xmlChar *name;
+    const htmlElemDesc *info;
+    unsigned int match; // bit k: element matches step k, bit 0 is document
+    unsigned int desc; // bit k: element or an ancestor matches step k
+    int children;
+    int first; // node type of first child
+    int last; // node type of last child
+    const xmlChar *last_name; // name of last child which is not comment
+    int last_type; // type of last child which is not comment, 0: none
+    bool last_br; // last child is "<br>"
+    int brs; // "<br>" in a row
+    bool after; // last child wants "\n" if the next one is not text
+    size_t head; // capture count when first child comes
+    std::vector<size_t> head_pos; // "\n" after start tag waits for second child
+    int elements; // element children, for *[n]
+    std::vector<std::pair<const xmlChar*, int> > counts; // children count of each name, for [n]
+} sax_frame_t;
+
+typedef struct sax_state_t
+{
+    htmlParserCtxtPtr ctxt;
+    std::vector<xpath_step_t> steps;
+    std::string attr; // '/@attr' at last
+    std::vector<sax_frame_t> frames;
+    std::vector<sax_capture_t> captures; // open captures
+    std::vector<std::string> *value;
+    bool *stop;
+} sax_state_t;
+
+// blank text in these elements is kept by areBlanks() of HTMLparser.c
+static const char *const s_AllowPCData[] = {
+    "a", "abbr", "acronym", "address", "applet", "b", "bdo", "big",
+    "blockquote", "body", "button", "caption", "center", "cite", "code",
+    "dd", "del", "dfn", "div", "dt", "em", "font", "form", "h1", "h2",
+    "h3", "h4", "h5", "h6", "i", "iframe", "ins", "kbd", "label", "legend",
+    "li", "object", "p", "pre", "q", "s", "samp", "small", "span",
+    "strike", "strong", "td", "th", "tt", "u", "var"
+};
+
+static bool ParseXpathName(const char **p, std::string *name)
+{
+    const char *s = *p;
+
+    while (**p && (isalnum((unsigned char)**p) || **p == '-' || **p == '_'))
+        (*p)++;
+    if (*p == s)
+        return false;
+    name->assign(s, *p - s);
+    return true;
+}
+
+static bool ParseSimpleXpath(const char *xpath, std::vector<xpath_step_t> *steps, std::string *attr)
+{
+    const char *p = xpath;
+    const char *s;
+    xpath_step_t step;
+    char quote;
+
+    steps->clear();
+    attr->clear();
+    while (*p)
+    {
+        if (*p != '/')
+            return false;
+        p++;
+        step.desc = false;
+        step.name.clear();
+        step.attr.clear();
+        step.value.clear();
+        step.pos = 0;
+        if (*p == '/')
+        {
+            step.desc = true;
+            p++;
+        }
+        if (*p == '@')
+        {
+            // attribute of last step
+            p++;
+            if (step.desc || steps->empty() || !ParseXpathName(&p, attr) || *p)
+                return false;
+            return true;
+        }
+        if (*p == '*')
+            p++;
+        else if (!ParseXpathName(&p, &step.name))
+            return false;
+        if (*p == '[')
+        {
+            p++;
+            if (*p == '@')
+            {
+                p++;
+                if (!ParseXpathName(&p, &step.attr) || *p != '=')
+                    return false;
+                p++;
+                quote = *p;
+                if (quote != '\'' && quote != '"')
+                    return false;
+                s = ++p;
+                while (*p && *p != quote)
+                    p++;
+                if (!*p)
+                    return false;
+                step.value.assign(s, p - s);
+                p++;
+            }
+            else
+            {
+                while (*p >= '0' && *p <= '9')
+                    step.pos = step.pos * 10 + (*p++ - '0');
+                if (step.pos == 0)
+                    return false;
+            }
+            if (*p != ']')
+                return false;
+            p++;
+        }
+        steps->push_back(step);
+        if (steps->size() >= 31)
+            return false;
+    }
+    return !steps->empty();
+}
+
+static bool IsAllowPCData(const xmlChar *name)
+{
+    int i;
+
+    if (!name)
+        return false;
+    for (i = 0; i < sizeof(s_AllowPCData) / sizeof(s_AllowPCData[0]); i++)
+    {
+        if (xmlStrEqual(name, BAD_CAST s_AllowPCData[i]))
+            return true;
+    }
+    return false;
+}
+
+static void SaxAppend(sax_state_t *st, const char *text, int len)
+{
+    size_t i;
+
+    for (i = 0; i < st->captures.size(); i++)
+        st->captures[i].text.append(text, len);
+}
+
+// a child node comes to the element on top, type is the node type of libxml2 tree
+static void SaxChild(sax_state_t *st, int type, const xmlChar *name, bool br)
+{
+    sax_frame_t *f = &st->frames.back();
+    size_t i, j;
+
+    // text after text is merged
+    if (type == XML_TEXT_NODE && f->children > 0 && f->last == XML_TEXT_NODE)
+        return;
+
+    if (f->after && type != XML_TEXT_NODE)
+        SaxAppend(st, "\n", 1);
+    f->after = false;
+
+    f->children++;
+    if (f->children == 1)
+    {
+        f->first = type;
+        f->head = st->captures.size();
+    }
+    else if (f->children == 2 && !f->head_pos.empty())
+    {
+        // more than one child, "\n" after start tag
+        for (i = 0, j = 0; i < f->head && i < st->captures.size(); i++)
+        {
+            st->captures[i].text.insert(f->head_pos[j++], "\n");
+        }
+        f->head_pos.clear();
+    }
+    f->last = type;
+    if (type != XML_COMMENT_NODE)
+    {
+        f->last_type = type;
+        f->last_name = name;
+    }
+
+    if (br)
+    {
+        // "<br><br>" or "<br>" is "\n"
+        f->brs = f->last_br ? f->brs + 1 : 1;
+        if (f->brs % 2 == 1)
+            SaxAppend(st, "\n", 1);
+    }
+    f->last_br = br;
+}
+
+static void SaxHead(sax_state_t *st)
+{
+    sax_frame_t *f = &st->frames.back();
+    size_t i;
+
+    // decided on second child, remember where "\n" goes
+    if (f->children == 1 && f->first != XML_TEXT_NODE && f->info && !f->info->isinline && f->name[0] != 'p')
+    {
+        for (i = 0; i < f->head; i++)
+            f->head_pos.push_back(st->captures[i].text.size());
+    }
+}
+
+static void SaxStartElement(void *ctx, const xmlChar *name, const xmlChar **atts)
+{
+    htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr)ctx;
+    sax_state_t *st = (sax_state_t*)ctxt->_private;
+    sax_frame_t frame;
+    sax_frame_t *parent;
+    xpath_step_t *step;
+    const xmlChar *attr;
+    sax_capture_t cap;
+    bool br;
+    int pos = 0;
+    int any;
+    size_t i, k;
+
+    if (*st->stop)
+    {
+        xmlStopParser(ctxt);
+        return;
+    }
+
+    br = xmlStrEqual(name, BAD_CAST "br") && (!atts || !atts[0]);
+    parent = &st->frames.back();
+    SaxChild(st, XML_ELEMENT_NODE, name, br);
+    SaxHead(st);
+
+    // [n] counts children of the same name, *[n] all element children.
+    // "<br>" is text after format, it is not counted nor matched
+    any = br ? 0 : ++parent->elements;
+    for (i = 0; !br && i < parent->counts.size(); i++)
+    {
+        if (xmlStrEqual(parent->counts[i].first, name))
+        {
+            pos = ++parent->counts[i].second;
+            break;
+        }
+    }
+    if (!br && i == parent->counts.size())
+    {
+        parent->counts.push_back(std::make_pair(xmlDictLookup(ctxt->dict, name, -1), 1));
+        pos = 1;
+    }
+
+    frame.name = xmlDictLookup(ctxt->dict, name, -1);
+    frame.info = htmlTagLookup(name);
+    frame.match = 0;
+    frame.children = 0;
+    frame.first = 0;
+    frame.last = 0;
+    frame.last_name = NULL;
+    frame.last_type = 0;
+    frame.last_br = false;
+    frame.brs = 0;
+    frame.after = false;
+    frame.head = 0;
+    frame.elements = 0;
+    for (k = 1; !br && k <= st->steps.size(); k++)
+    {
+        step = &st->steps[k - 1];
+        if (!((step->desc ? parent->desc : parent->match) & (1 << (k - 1))))
+            continue;
+        if (!step->name.empty() && !xmlStrEqual(name, BAD_CAST step->name.c_str()))
+            continue;
+        if (step->pos && step->pos != (step->name.empty() ? any : pos))
+            continue;
+        if (!step->attr.empty())
+        {
+            attr = NULL;
+            for (i = 0; atts && atts[i]; i += 2)
+            {
+                if (xmlStrEqual(atts[i], BAD_CAST step->attr.c_str()))
+                {
+                    attr = atts[i + 1] ? atts[i + 1] : BAD_CAST "";
+                    break;
+                }
+            }
+            if (!attr || !xmlStrEqual(attr, BAD_CAST step->value.c_str()))
+                continue;
+        }
+        frame.match |= 1 << k;
+    }
+    frame.desc = parent->desc | frame.match;
+    st->frames.push_back(frame);
+
+    if (!(frame.match & (1 << st->steps.size())))
+        return;
+    if (!st->attr.empty())
+    {
+        for (i = 0; atts && atts[i]; i += 2)
+        {
+            if (xmlStrEqual(atts[i], BAD_CAST st->attr.c_str()))
+            {
+                st->value->push_back(atts[i + 1] ? (const char*)atts[i + 1] : "");
+                break;
+            }
+        }
+        return;
+    }
+    // results are in order of start tag
+    cap.depth = (int)st->frames.size();
+    cap.index = st->value->size();
+    st->captures.push_back(cap);
+    st->value->push_back(std::string());
+}
+
+static void SaxEndElement(void *ctx, const xmlChar *name)
+{
+    htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr)ctx;
+    sax_state_t *st = (sax_state_t*)ctxt->_private;
+    sax_frame_t *f;
+    sax_frame_t *parent;
+
+    if (st->frames.size() <= 1)
+        return;
+
+    f = &st->frames.back();
+    // "\n" before end tag
+    if (f->info && !f->info->isinline && f->name[0] != 'p' && f->children > 1
+        && f->last != XML_TEXT_NODE)
+        SaxAppend(st, "\n", 1);
+
+    if (!st->captures.empty() && st->captures.back().depth == (int)st->frames.size())
+    {
+        (*st->value)[st->captures.back().index].swap(st->captures.back().text);
+        st->captures.pop_back();
+    }
+
+    parent = &st->frames[st->frames.size() - 2];
+    parent->after = f->info && !f->info->isinline && parent->name && parent->name[0] != 'p';
+    st->frames.pop_back();
+}
+
+static void SaxCharacters(void *ctx, const xmlChar *ch, int len)
+{
+    htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr)ctx;
+    sax_state_t *st = (sax_state_t*)ctxt->_private;
+    sax_frame_t *f = &st->frames.back();
+    int i;
+
+    if (*st->stop)
+    {
+        xmlStopParser(ctxt);
+        return;
+    }
+
+    // blank text dropped by areBlanks() of HTMLparser.c when the tree is built
+    for (i = 0; i < len && IS_BLANK_CH(ch[i]); i++)
+        ;
+    if (i == len && ctxt->input->cur && *ctxt->input->cur == '<')
+    {
+        if (f->last_type == 0)
+        {
+            if (!IsAllowPCData(f->name))
+                return;
+        }
+        else if (f->last_type != XML_TEXT_NODE && !IsAllowPCData(f->last_name))
+        {
+            return;
+        }
+    }
+
+    SaxChild(st, XML_TEXT_NODE, NULL, false);
+    SaxAppend(st, (const char*)ch, len);
+}
+
+static void SaxCdataBlock(void *ctx, const xmlChar *value, int len)
+{
+    htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr)ctx;
+    sax_state_t *st = (sax_state_t*)ctxt->_private;
+    sax_frame_t *f = &st->frames.back();
+
+    // script and style, one node for all blocks
+    if (!(f->children > 0 && f->last == XML_CDATA_SECTION_NODE))
+    {
+        SaxChild(st, XML_CDATA_SECTION_NODE, NULL, false);
+        SaxHead(st);
+    }
+    SaxAppend(st, (const char*)value, len);
+}
+
+static void SaxComment(void *ctx, const xmlChar *value)
+{
+    htmlParserCtxtPtr ctxt = (htmlParserCtxtPtr)ctx;
+    sax_state_t *st = (sax_state_t*)ctxt->_private;
+
+    SaxChild(st, XML_COMMENT_NODE, NULL, false);
+    SaxHead(st);
+}
+
+
+int HtmlParser::HtmlParseContent(const char *html, int len, const std::string &xpath, std::vector<std::string> &value, bool *stop)
+{
+    htmlParserCtxtPtr ctxt = NULL;
+    sax_state_t st;
+    sax_frame_t root;
+    void *doc = NULL;
+    void *ctx = NULL;
+    int ret;
+
+    if (*stop)
+        return 1;
+
+    if (!ParseSimpleXpath(xpath.c_str(), &st.steps, &st.attr))
+    {
+        // other xpath on the tree
+        if (HtmlParseBegin(html, len, &doc, &ctx, stop, true))
+            return 1;
+        ret = HtmlParseByXpath(doc, ctx, xpath, value, stop);
+        HtmlParseEnd(doc, ctx);
+        return ret;
+    }
+
+    // same context as htmlReadMemory(), html context guesses latin1 for utf-8 text
+    ctxt = xmlCreateMemoryParserCtxt(html, len);
+    if (!ctxt)
+        return 1;
+    xmlSAX2InitHtmlDefaultSAXHandler(ctxt->sax);
+    htmlCtxtUseOptions(ctxt, HTML_PARSE_RECOVER | HTML_PARSE_NOBLANKS);
+    // the document and dtd are still built by default handlers, areBlanks() needs them
+    ctxt->sax->startElement = SaxStartElement;
+    ctxt->sax->endElement = SaxEndElement;
+    ctxt->sax->characters = SaxCharacters;
+    ctxt->sax->cdataBlock = SaxCdataBlock;
+    ctxt->sax->comment = SaxComment;
+    ctxt->sax->processingInstruction = NULL;
+    ctxt->_private = &st;
+
+    root.name = NULL;
+    root.info = NULL;
+    root.match = 1;
+    root.desc = 1;
+    root.children = 0;
+    root.first = 0;
+    root.last = 0;
+    root.last_name = NULL;
+    root.last_type = 0;
+    root.last_br = false;
+    root.brs = 0;
+    root.after = false;
+    root.head = 0;
+    root.elements = 0;
+    st.ctxt = ctxt;
+    st.frames.push_back(root);
+    st.value = &value;
+    st.stop = stop;
+
+    htmlParseDocument(ctxt);
+
+    if (ctxt->myDoc)
+        xmlFreeDoc(ctxt->myDoc);
+    htmlFreeParserCtxt(ctxt);
+    return *stop ? 1 : 0;
+}
+
 int HtmlParser::FormatHtml(char *html, int len, char **htmlfmt, int *fmtlen)
 {
     xmlDocPtr doc = NULL;
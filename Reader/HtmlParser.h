@@ -3,6 +3,7 @@
 
 #include <string>
 #include <vector>
+#include <map>
 
 class HtmlParser
 {
@@ -17,16 +18,25 @@ public:
     int HtmlParseByXpath(const char *html, int len, const std::string &xpath, std::vector<std::string> &value, bool *stop, bool clear = false);
 
     // for multi parser
-    int HtmlParseBegin(const char *html, int len, void **doc, void **ctx, bool* stop);
+    // format: break lines as the html is dumped by FormatHtml and its "<br>" are replaced by "\n", but parse only once
+    int HtmlParseBegin(const char *html, int len, void **doc, void **ctx, bool* stop, bool format = false);
     int HtmlParseByXpath(void *doc, void *ctx, const std::string &xpath, std::vector<std::string> &value, bool* stop, bool clear = false);
     int HtmlParseEnd(void *doc, void *ctx);
 
+    // content page, same text as HtmlParseBegin with format. simple xpath is matched by sax without building the tree.
+    int HtmlParseContent(const char *html, int len, const std::string &xpath, std::vector<std::string> &value, bool *stop);
+
     int FormatHtml(char *html, int len, char **htmlfmt, int *fmtlen);
     void FreeFormat(char *htmlfmt);
 
 private:
     char * CreateContent(const char* xml);
     void ReleaseContent(char *content);
+    void *GetXpath(const std::string &xpath);
+
+private:
+    std::map<std::string, void*> m_Xpaths; // compiled xpath of book sources, shared by all requests
+    HANDLE m_hMutex;
 };
 
 #endif // !__CHTML_PARSER_H__
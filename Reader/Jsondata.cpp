@@ -427,6 +427,8 @@ class json_header_t
     cJSON* line_indent;
     cJSON* ingore_version;
     cJSON* checkver_time;
+    cJSON* prefetch_ahead;
+    cJSON* prefetch_behind;
     cJSON* keyset;
     cJSON* cust_colors;
     json_rect_t* rect;
@@ -470,6 +472,8 @@ public:
         line_indent = cJSON_AddNumberToObject(parent, "line_indent", data->line_indent);
         ingore_version = cJSON_AddStringToObject(parent, "ingore_version", Utils::Utf16ToUtf8(data->ingore_version));
         checkver_time = cJSON_AddULongToObject(parent, "checkver_time", data->checkver_time);
+        prefetch_ahead = cJSON_AddNumberToObject(parent, "prefetch_ahead", data->prefetch_ahead);
+        prefetch_behind = cJSON_AddNumberToObject(parent, "prefetch_behind", data->prefetch_behind);
 
         keyset = cJSON_AddArrayToObject(parent, "keyset");
         for (i = KI_HIDE; i < KI_MAXCOUNT; i++)
@@ -566,6 +570,8 @@ public:
         line_indent = cJSON_GetObjectItem(parent, "line_indent");
         ingore_version = cJSON_GetObjectItem(parent, "ingore_version");
         checkver_time = cJSON_GetObjectItem(parent, "checkver_time");
+        prefetch_ahead = cJSON_GetObjectItem(parent, "prefetch_ahead");
+        prefetch_behind = cJSON_GetObjectItem(parent, "prefetch_behind");
 
         keyset = cJSON_GetObjectItem(parent, "keyset");
         cust_colors = cJSON_GetObjectItem(parent, "cust_colors");
@@ -701,6 +707,10 @@ public:
             wcscpy(data->ingore_version, Utils::Utf8ToUtf16(ingore_version->valuestring));
         if (checkver_time)
             data->checkver_time = *((u32*)&checkver_time->valueint);
+        if (prefetch_ahead)
+            data->prefetch_ahead = prefetch_ahead->valueint;
+        if (prefetch_behind)
+            data->prefetch_behind = prefetch_behind->valueint;
 
         if (keyset)
         {
@@ -0,0 +1,743 @@
+#include "stdafx.h"
+#include "LineRegex.h"
+
+
+LineRegex::LineRegex()
+    : m_Pattern(NULL)
+    , m_Pos(0)
+    , m_Error(FALSE)
+    , m_Required(0)
+    , m_Gen(0)
+{
+}
+
+LineRegex::~LineRegex()
+{
+}
+
+BOOL LineRegex::Compile(const wchar_t *pattern)
+{
+    int root;
+
+    m_Nodes.clear();
+    m_Classes.clear();
+    m_Program.clear();
+    m_First.clear();
+    m_Required = 0;
+    m_Pattern = pattern;
+    m_Pos = 0;
+    m_Error = FALSE;
+    if (!pattern)
+        return FALSE;
+
+    root = ParseAlt();
+    if (m_Error || root < 0 || m_Pattern[m_Pos]) // unbalanced ')'
+        return FALSE;
+    if (!Emit(root) || AddInst(OP_MATCH, 0, 0) < 0)
+        return FALSE;
+
+    m_Required = Required(root);
+    m_First.clear();
+    if (IsNullable(root) || !First(root))
+        m_First.clear();
+    m_List[0].reserve(m_Program.size());
+    m_List[1].reserve(m_Program.size());
+    m_Mark.assign(m_Program.size(), 0);
+    m_Gen = 0;
+    return TRUE;
+}
+
+// leftmost match from line[from], the same one as backtracking would find
+BOOL LineRegex::Search(const wchar_t *line, int len, int from, int *start, int *end)
+{
+    std::vector<thread_t> *clist = &m_List[0];
+    std::vector<thread_t> *nlist = &m_List[1];
+    std::vector<thread_t> *temp;
+    const inst_t *inst;
+    BOOL matched = FALSE;
+    BOOL pass;
+    int cgen, ngen;
+    int pos, skip;
+    size_t i;
+
+    if (m_Program.empty() || from < 0 || from > len)
+        return FALSE;
+
+    clist->clear();
+    cgen = ++m_Gen;
+    for (pos = from; pos <= len; pos++)
+    {
+        // skip to the char a match can start with
+        if (!matched && clist->empty() && !m_First.empty())
+        {
+            for (skip = pos; pos < len && !IsFirst(line[pos]); pos++)
+                ;
+            if (pos == len)
+                break;
+            // marks of the last position are not valid here, e.g. a failed \b
+            if (pos != skip)
+                cgen = ++m_Gen;
+        }
+
+        // a new thread for each start position, it has the lowest priority
+        if (!matched)
+            AddThread(clist, cgen, 0, pos, line, len, pos);
+        if (clist->empty())
+        {
+            if (matched)
+                break;
+            cgen = ++m_Gen;
+            continue;
+        }
+
+        nlist->clear();
+        ngen = ++m_Gen;
+        for (i = 0; i < clist->size(); i++)
+        {
+            inst = &m_Program[(*clist)[i].pc];
+            if (inst->op == OP_MATCH)
+            {
+                // threads after this one have lower priority
+                matched = TRUE;
+                *start = (*clist)[i].start;
+                *end = pos;
+                break;
+            }
+            if (pos == len)
+                continue;
+
+            switch (inst->op)
+            {
+            case OP_CHAR:
+                pass = line[pos] == inst->x;
+                break;
+            case OP_ANY:
+                pass = line[pos] != 0x0A && line[pos] != 0x0D && line[pos] != 0x2028 && line[pos] != 0x2029;
+                break;
+            case OP_CLASS:
+                pass = IsMatchClass(inst->x, line[pos]);
+                break;
+            default:
+                pass = FALSE;
+                break;
+            }
+            if (pass)
+                AddThread(nlist, ngen, (*clist)[i].pc + 1, (*clist)[i].start, line, len, pos + 1);
+        }
+
+        temp = clist;
+        clist = nlist;
+        nlist = temp;
+        cgen = ngen;
+    }
+    return matched;
+}
+
+// a char which every match contains, lines without it can be skipped
+wchar_t LineRegex::GetRequiredChar(void)
+{
+    return m_Required;
+}
+
+int LineRegex::ParseAlt(void)
+{
+    int left, right;
+
+    left = ParseCat();
+    while (!m_Error && m_Pattern[m_Pos] == _T('|'))
+    {
+        m_Pos++;
+        right = ParseCat();
+        left = AddNode(NODE_ALT, 0, left, right);
+    }
+    return m_Error ? -1 : left;
+}
+
+int LineRegex::ParseCat(void)
+{
+    int left = -1, right;
+
+    while (!m_Error && m_Pattern[m_Pos] && m_Pattern[m_Pos] != _T('|') && m_Pattern[m_Pos] != _T(')'))
+    {
+        right = ParseRepeat();
+        left = left < 0 ? right : AddNode(NODE_CAT, 0, left, right);
+    }
+    if (left < 0)
+        left = AddNode(NODE_EMPTY, 0, -1, -1);
+    return m_Error ? -1 : left;
+}
+
+int LineRegex::ParseRepeat(void)
+{
+    int atom, node;
+    int min, max;
+
+    atom = ParseAtom();
+    if (m_Error)
+        return -1;
+
+    while (TRUE)
+    {
+        switch (m_Pattern[m_Pos])
+        {
+        case _T('*'):
+            min = 0;
+            max = -1;
+            m_Pos++;
+            break;
+        case _T('+'):
+            min = 1;
+            max = -1;
+            m_Pos++;
+            break;
+        case _T('?'):
+            min = 0;
+            max = 1;
+            m_Pos++;
+            break;
+        case _T('{'):
+            m_Pos++;
+            if (!ParseNumber(&min))
+                goto error;
+            max = min;
+            if (m_Pattern[m_Pos] == _T(','))
+            {
+                m_Pos++;
+                max = -1;
+                if (m_Pattern[m_Pos] != _T('}') && !ParseNumber(&max))
+                    goto error;
+            }
+            if (m_Pattern[m_Pos] != _T('}') || (max >= 0 && max < min) || min > MAX_REPEAT || max > MAX_REPEAT)
+                goto error;
+            m_Pos++;
+            break;
+        default:
+            return atom;
+        }
+
+        // assertions can't be repeated
+        if (m_Nodes[atom].type == NODE_BOL || m_Nodes[atom].type == NODE_EOL
+            || m_Nodes[atom].type == NODE_WORDB || m_Nodes[atom].type == NODE_NWORDB)
+            goto error;
+
+        node = AddNode(NODE_REPEAT, 0, atom, -1);
+        m_Nodes[node].min = min;
+        m_Nodes[node].max = max;
+        m_Nodes[node].greedy = TRUE;
+        if (m_Pattern[m_Pos] == _T('?'))
+        {
+            m_Nodes[node].greedy = FALSE;
+            m_Pos++;
+        }
+        atom = node;
+
+        // a{2}{3} is invalid
+        if (m_Pattern[m_Pos] == _T('*') || m_Pattern[m_Pos] == _T('+') || m_Pattern[m_Pos] == _T('?') || m_Pattern[m_Pos] == _T('{'))
+            goto error;
+    }
+
+error:
+    m_Error = TRUE;
+    return -1;
+}
+
+int LineRegex::ParseAtom(void)
+{
+    wchar_t c = m_Pattern[m_Pos];
+    int node, cls;
+
+    switch (c)
+    {
+    case _T('('):
+        m_Pos++;
+        if (m_Pattern[m_Pos] == _T('?'))
+        {
+            // only non-capturing group, no lookahead
+            if (m_Pattern[m_Pos + 1] != _T(':'))
+                goto error;
+            m_Pos += 2;
+        }
+        node = ParseAlt();
+        if (m_Error || m_Pattern[m_Pos] != _T(')'))
+            goto error;
+        m_Pos++;
+        return node;
+    case _T('['):
+        m_Pos++;
+        return ParseClass();
+    case _T('.'):
+        m_Pos++;
+        return AddNode(NODE_ANY, 0, -1, -1);
+    case _T('^'):
+        m_Pos++;
+        return AddNode(NODE_BOL, 0, -1, -1);
+    case _T('$'):
+        m_Pos++;
+        return AddNode(NODE_EOL, 0, -1, -1);
+    case _T('\\'):
+        m_Pos++;
+        if (m_Pattern[m_Pos] == _T('b') || m_Pattern[m_Pos] == _T('B'))
+        {
+            return AddNode(m_Pattern[m_Pos++] == _T('b') ? NODE_WORDB : NODE_NWORDB, 0, -1, -1);
+        }
+        if (!ParseEscape(&c, &cls))
+            goto error;
+        if (cls >= 0)
+            return AddNode(NODE_CLASS, cls, -1, -1);
+        return AddNode(NODE_CHAR, c, -1, -1);
+    case _T('*'):
+    case _T('+'):
+    case _T('?'):
+    case _T('{'):
+    case _T('}'):
+    case _T(']'):
+        goto error; // nothing to repeat
+    default:
+        m_Pos++;
+        return AddNode(NODE_CHAR, c, -1, -1);
+    }
+
+error:
+    m_Error = TRUE;
+    return -1;
+}
+
+int LineRegex::ParseClass(void)
+{
+    std::vector<range_t> ranges;
+    range_t range;
+    BOOL negate = FALSE;
+    wchar_t c;
+    int cls;
+    size_t i;
+
+    if (m_Pattern[m_Pos] == _T('^'))
+    {
+        negate = TRUE;
+        m_Pos++;
+    }
+    while (m_Pattern[m_Pos] != _T(']'))
+    {
+        if (!m_Pattern[m_Pos])
+            goto error;
+
+        c = m_Pattern[m_Pos++];
+        cls = -1;
+        if (c == _T('\\'))
+        {
+            if (m_Pattern[m_Pos] == _T('b'))
+            {
+                c = 0x08;
+                m_Pos++;
+            }
+            else if (!ParseEscape(&c, &cls))
+            {
+                goto error;
+            }
+        }
+        if (cls >= 0)
+        {
+            // \D, \S and \W can't be merged into ranges
+            if (m_Classes[cls].negate)
+                goto error;
+            for (i = 0; i < m_Classes[cls].ranges.size(); i++)
+            {
+                ranges.push_back(m_Classes[cls].ranges[i]);
+            }
+            continue;
+        }
+
+        range.first = c;
+        range.last = c;
+        if (m_Pattern[m_Pos] == _T('-') && m_Pattern[m_Pos + 1] && m_Pattern[m_Pos + 1] != _T(']'))
+        {
+            m_Pos++;
+            c = m_Pattern[m_Pos++];
+            if (c == _T('\\'))
+            {
+                if (!ParseEscape(&c, &cls) || cls >= 0)
+                    goto error;
+            }
+            if (c < range.first)
+                goto error;
+            range.last = c;
+        }
+        ranges.push_back(range);
+    }
+    m_Pos++;
+    return AddNode(NODE_CLASS, AddClass(ranges.empty() ? NULL : &ranges[0], (int)ranges.size(), negate), -1, -1);
+
+error:
+    m_Error = TRUE;
+    return -1;
+}
+
+// escape after '\', it is a char or a class (\d \s \w)
+BOOL LineRegex::ParseEscape(wchar_t *c, int *cls)
+{
+    static const range_t digit[] = { { _T('0'), _T('9') } };
+    static const range_t word[] = { { _T('0'), _T('9') }, { _T('A'), _T('Z') }, { _T('_'), _T('_') }, { _T('a'), _T('z') } };
+    static const range_t space[] = {
+        { 0x09, 0x0D }, { 0x20, 0x20 }, { 0xA0, 0xA0 }, { 0x1680, 0x1680 }, { 0x2000, 0x200A },
+        { 0x2028, 0x2029 }, { 0x202F, 0x202F }, { 0x205F, 0x205F }, { 0x3000, 0x3000 }, { 0xFEFF, 0xFEFF }
+    };
+    wchar_t e = m_Pattern[m_Pos];
+
+    *cls = -1;
+    if (!e)
+        return FALSE;
+    m_Pos++;
+
+    switch (e)
+    {
+    case _T('d'):
+    case _T('D'):
+        *cls = AddClass(digit, sizeof(digit) / sizeof(digit[0]), e == _T('D'));
+        return TRUE;
+    case _T('w'):
+    case _T('W'):
+        *cls = AddClass(word, sizeof(word) / sizeof(word[0]), e == _T('W'));
+        return TRUE;
+    case _T('s'):
+    case _T('S'):
+        *cls = AddClass(space, sizeof(space) / sizeof(space[0]), e == _T('S'));
+        return TRUE;
+    case _T('n'):
+        *c = 0x0A;
+        return TRUE;
+    case _T('r'):
+        *c = 0x0D;
+        return TRUE;
+    case _T('t'):
+        *c = 0x09;
+        return TRUE;
+    case _T('f'):
+        *c = 0x0C;
+        return TRUE;
+    case _T('v'):
+        *c = 0x0B;
+        return TRUE;
+    case _T('0'):
+        if (m_Pattern[m_Pos] >= _T('0') && m_Pattern[m_Pos] <= _T('9'))
+            return FALSE; // octal
+        *c = 0;
+        return TRUE;
+    case _T('x'):
+        return ParseHex(2, c);
+    case _T('u'):
+        return ParseHex(4, c);
+    default:
+        // backreference and control escape are not supported
+        if ((e >= _T('1') && e <= _T('9')) || e == _T('c') || e == _T('k'))
+            return FALSE;
+        *c = e;
+        return TRUE;
+    }
+}
+
+BOOL LineRegex::ParseHex(int digits, wchar_t *c)
+{
+    int value = 0;
+    int i;
+    wchar_t h;
+
+    for (i = 0; i < digits; i++)
+    {
+        h = m_Pattern[m_Pos + i];
+        if (h >= _T('0') && h <= _T('9'))
+            value = value * 16 + h - _T('0');
+        else if (h >= _T('a') && h <= _T('f'))
+            value = value * 16 + h - _T('a') + 10;
+        else if (h >= _T('A') && h <= _T('F'))
+            value = value * 16 + h - _T('A') + 10;
+        else
+            return FALSE;
+    }
+    m_Pos += digits;
+    *c = (wchar_t)value;
+    return TRUE;
+}
+
+BOOL LineRegex::ParseNumber(int *n)
+{
+    int value = 0;
+    int begin = m_Pos;
+
+    while (m_Pattern[m_Pos] >= _T('0') && m_Pattern[m_Pos] <= _T('9'))
+    {
+        if (value <= MAX_REPEAT)
+            value = value * 10 + m_Pattern[m_Pos] - _T('0');
+        m_Pos++;
+    }
+    *n = value;
+    return m_Pos > begin;
+}
+
+int LineRegex::AddNode(int type, int value, int left, int right)
+{
+    node_t node;
+
+    node.type = type;
+    node.value = value;
+    node.min = 0;
+    node.max = 0;
+    node.greedy = TRUE;
+    node.left = left;
+    node.right = right;
+    m_Nodes.push_back(node);
+    return (int)m_Nodes.size() - 1;
+}
+
+int LineRegex::AddClass(const range_t *ranges, int count, BOOL negate)
+{
+    class_t cls;
+
+    cls.negate = negate;
+    cls.ranges.assign(ranges, ranges + count);
+    m_Classes.push_back(cls);
+    return (int)m_Classes.size() - 1;
+}
+
+BOOL LineRegex::Emit(int node)
+{
+    const node_t n = m_Nodes[node];
+    int split, jmp, loop;
+    int i;
+    std::vector<int> splits;
+
+    switch (n.type)
+    {
+    case NODE_EMPTY:
+        return TRUE;
+    case NODE_CHAR:
+        return AddInst(OP_CHAR, n.value, 0) >= 0;
+    case NODE_ANY:
+        return AddInst(OP_ANY, 0, 0) >= 0;
+    case NODE_CLASS:
+        return AddInst(OP_CLASS, n.value, 0) >= 0;
+    case NODE_BOL:
+        return AddInst(OP_BOL, 0, 0) >= 0;
+    case NODE_EOL:
+        return AddInst(OP_EOL, 0, 0) >= 0;
+    case NODE_WORDB:
+        return AddInst(OP_WORDB, 0, 0) >= 0;
+    case NODE_NWORDB:
+        return AddInst(OP_NWORDB, 0, 0) >= 0;
+    case NODE_CAT:
+        return Emit(n.left) && Emit(n.right);
+    case NODE_ALT:
+        // split L1, L2; L1: left; jmp end; L2: right; end:
+        split = AddInst(OP_SPLIT, 0, 0);
+        if (split < 0 || !Emit(n.left))
+            return FALSE;
+        jmp = AddInst(OP_JMP, 0, 0);
+        if (jmp < 0)
+            return FALSE;
+        m_Program[split].x = split + 1;
+        m_Program[split].y = jmp + 1;
+        if (!Emit(n.right))
+            return FALSE;
+        m_Program[jmp].x = (int)m_Program.size();
+        return TRUE;
+    case NODE_REPEAT:
+        // ecmascript stops a loop on empty iteration, the vm doesn't, let std::wregex do it
+        if ((n.max < 0 || n.max - n.min > 1) && IsNullable(n.left))
+            return FALSE;
+        for (i = 0; i < n.min; i++)
+        {
+            if (!Emit(n.left))
+                return FALSE;
+        }
+        if (n.max < 0)
+        {
+            // loop: split body, end; body: left; jmp loop; end:
+            loop = AddInst(OP_SPLIT, 0, 0);
+            if (loop < 0 || !Emit(n.left) || AddInst(OP_JMP, loop, 0) < 0)
+                return FALSE;
+            m_Program[loop].x = n.greedy ? loop + 1 : (int)m_Program.size();
+            m_Program[loop].y = n.greedy ? (int)m_Program.size() : loop + 1;
+            return TRUE;
+        }
+        // optional copies, a failed one skips the rest
+        for (i = n.min; i < n.max; i++)
+        {
+            split = AddInst(OP_SPLIT, 0, 0);
+            if (split < 0 || !Emit(n.left))
+                return FALSE;
+            splits.push_back(split);
+        }
+        for (i = 0; i < (int)splits.size(); i++)
+        {
+            m_Program[splits[i]].x = n.greedy ? splits[i] + 1 : (int)m_Program.size();
+            m_Program[splits[i]].y = n.greedy ? (int)m_Program.size() : splits[i] + 1;
+        }
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+int LineRegex::AddInst(int op, int x, int y)
+{
+    inst_t inst;
+
+    if (m_Program.size() >= MAX_PROGRAM)
+        return -1;
+
+    inst.op = op;
+    inst.x = x;
+    inst.y = y;
+    m_Program.push_back(inst);
+    return (int)m_Program.size() - 1;
+}
+
+BOOL LineRegex::IsNullable(int node)
+{
+    const node_t *n = &m_Nodes[node];
+
+    switch (n->type)
+    {
+    case NODE_CHAR:
+    case NODE_ANY:
+    case NODE_CLASS:
+        return FALSE;
+    case NODE_CAT:
+        return IsNullable(n->left) && IsNullable(n->right);
+    case NODE_ALT:
+        return IsNullable(n->left) || IsNullable(n->right);
+    case NODE_REPEAT:
+        return n->min == 0 || IsNullable(n->left);
+    default:
+        return TRUE;
+    }
+}
+
+// chars a match can start with, FALSE if there are too many
+BOOL LineRegex::First(int node)
+{
+    const node_t *n = &m_Nodes[node];
+    size_t i;
+
+    switch (n->type)
+    {
+    case NODE_CHAR:
+        for (i = 0; i < m_First.size(); i++)
+        {
+            if (m_First[i] == (wchar_t)n->value)
+                return TRUE;
+        }
+        if (m_First.size() >= MAX_FIRST)
+            return FALSE;
+        m_First.push_back((wchar_t)n->value);
+        return TRUE;
+    case NODE_ANY:
+    case NODE_CLASS:
+        return FALSE;
+    case NODE_CAT:
+        if (!First(n->left))
+            return FALSE;
+        return IsNullable(n->left) ? First(n->right) : TRUE;
+    case NODE_ALT:
+        return First(n->left) && First(n->right);
+    case NODE_REPEAT:
+        return First(n->left);
+    default:
+        return TRUE;
+    }
+}
+
+BOOL LineRegex::IsFirst(wchar_t c)
+{
+    size_t i;
+
+    for (i = 0; i < m_First.size(); i++)
+    {
+        if (m_First[i] == c)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+wchar_t LineRegex::Required(int node)
+{
+    const node_t *n = &m_Nodes[node];
+    wchar_t c;
+
+    switch (n->type)
+    {
+    case NODE_CHAR:
+        return (wchar_t)n->value;
+    case NODE_CAT:
+        c = Required(n->left);
+        return c ? c : Required(n->right);
+    case NODE_ALT:
+        c = Required(n->left);
+        return c == Required(n->right) ? c : 0;
+    case NODE_REPEAT:
+        return n->min > 0 ? Required(n->left) : 0;
+    default:
+        return 0;
+    }
+}
+
+// follow jumps and assertions at pos, in priority order
+void LineRegex::AddThread(std::vector<thread_t> *list, int gen, int pc, int start, const wchar_t *line, int len, int pos)
+{
+    const inst_t *inst;
+    thread_t thread;
+    BOOL prev, next;
+
+    if (m_Mark[pc] == gen)
+        return;
+    m_Mark[pc] = gen;
+
+    inst = &m_Program[pc];
+    switch (inst->op)
+    {
+    case OP_JMP:
+        AddThread(list, gen, inst->x, start, line, len, pos);
+        break;
+    case OP_SPLIT:
+        AddThread(list, gen, inst->x, start, line, len, pos);
+        AddThread(list, gen, inst->y, start, line, len, pos);
+        break;
+    case OP_BOL:
+        if (pos == 0)
+            AddThread(list, gen, pc + 1, start, line, len, pos);
+        break;
+    case OP_EOL:
+        if (pos == len)
+            AddThread(list, gen, pc + 1, start, line, len, pos);
+        break;
+    case OP_WORDB:
+    case OP_NWORDB:
+        prev = pos > 0 && IsWord(line[pos - 1]);
+        next = pos < len && IsWord(line[pos]);
+        if ((prev != next) == (inst->op == OP_WORDB))
+            AddThread(list, gen, pc + 1, start, line, len, pos);
+        break;
+    default:
+        thread.pc = pc;
+        thread.start = start;
+        list->push_back(thread);
+        break;
+    }
+}
+
+BOOL LineRegex::IsMatchClass(int cls, wchar_t c)
+{
+    const class_t *p = &m_Classes[cls];
+    size_t i;
+
+    for (i = 0; i < p->ranges.size(); i++)
+    {
+        if (c >= p->ranges[i].first && c <= p->ranges[i].last)
+            return !p->negate;
+    }
+    return p->negate;
+}
+
+BOOL LineRegex::IsWord(wchar_t c)
+{
+    return (c >= _T('0') && c <= _T('9')) || (c >= _T('A') && c <= _T('Z')) || (c >= _T('a') && c <= _T('z')) || c == _T('_');
+}
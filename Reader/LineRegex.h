@@ -0,0 +1,124 @@
+#ifndef __LINE_REGEX_H__
+#define __LINE_REGEX_H__
+
+#include "types.h"
+#include <vector>
+
+// ecmascript regex subset, matched inside one line by a pike vm in linear time.
+// ^ and $ are line start and end. backreference and lookaround are not supported, Compile fails for them.
+class LineRegex
+{
+public:
+    LineRegex();
+    virtual ~LineRegex();
+
+public:
+    BOOL Compile(const wchar_t *pattern);
+    BOOL Search(const wchar_t *line, int len, int from, int *start, int *end);
+    wchar_t GetRequiredChar(void);
+
+protected:
+    enum
+    {
+        NODE_EMPTY,
+        NODE_CHAR,
+        NODE_ANY,
+        NODE_CLASS,
+        NODE_BOL,
+        NODE_EOL,
+        NODE_WORDB,
+        NODE_NWORDB,
+        NODE_CAT,
+        NODE_ALT,
+        NODE_REPEAT
+    };
+
+    enum
+    {
+        OP_CHAR,
+        OP_ANY,
+        OP_CLASS,
+        OP_BOL,
+        OP_EOL,
+        OP_WORDB,
+        OP_NWORDB,
+        OP_SPLIT,
+        OP_JMP,
+        OP_MATCH
+    };
+
+    enum
+    {
+        MAX_PROGRAM = 2048,
+        MAX_REPEAT = 1000,
+        MAX_FIRST = 8
+    };
+
+    typedef struct node_t
+    {
+        int type;
+        int value; // char or class index
+        int min, max; // repeat, max -1: no limit
+        BOOL greedy;
+        int left, right;
+    } node_t;
+
+    typedef struct inst_t
+    {
+        int op;
+        int x, y;
+    } inst_t;
+
+    typedef struct range_t
+    {
+        wchar_t first, last;
+    } range_t;
+
+    typedef struct class_t
+    {
+        BOOL negate;
+        std::vector<range_t> ranges;
+    } class_t;
+
+    typedef struct thread_t
+    {
+        int pc;
+        int start;
+    } thread_t;
+
+protected:
+    int ParseAlt(void);
+    int ParseCat(void);
+    int ParseRepeat(void);
+    int ParseAtom(void);
+    int ParseClass(void);
+    BOOL ParseEscape(wchar_t *c, int *cls);
+    BOOL ParseHex(int digits, wchar_t *c);
+    BOOL ParseNumber(int *n);
+    int AddNode(int type, int value, int left, int right);
+    int AddClass(const range_t *ranges, int count, BOOL negate);
+    BOOL Emit(int node);
+    int AddInst(int op, int x, int y);
+    BOOL IsNullable(int node);
+    BOOL First(int node);
+    BOOL IsFirst(wchar_t c);
+    wchar_t Required(int node);
+    void AddThread(std::vector<thread_t> *list, int gen, int pc, int start, const wchar_t *line, int len, int pos);
+    BOOL IsMatchClass(int cls, wchar_t c);
+    static BOOL IsWord(wchar_t c);
+
+protected:
+    const wchar_t *m_Pattern;
+    int m_Pos;
+    BOOL m_Error;
+    std::vector<node_t> m_Nodes;
+    std::vector<class_t> m_Classes;
+    std::vector<inst_t> m_Program;
+    wchar_t m_Required;
+    std::vector<wchar_t> m_First; // empty: match can start with any char
+    std::vector<thread_t> m_List[2];
+    std::vector<int> m_Mark;
+    int m_Gen;
+};
+
+#endif
@@ -6,6 +6,8 @@
 #include <time.h>
 #include <regex>
 #include <shellapi.h>
+#include <stddef.h>
+#include "zlib.h"
 #if TEST_MODEL
 #include <assert.h>
 #endif
@@ -35,6 +37,9 @@ typedef struct req_content_param_t
     OnlineBook* _this;
     TCHAR *text;
     int textlen;
+    BOOL prefetch;
+    BOOL stale; // canceled by prefetch, in m_Canceled until the completer frees it
+    BOOL download; // requested by whole book download
 } req_content_param_t;
 
 typedef struct req_bookstatus_param_t
@@ -49,7 +54,9 @@ typedef enum book_event_t
     BE_UPATE_CONTENT,
     BE_PLAY_LOADING,
     BE_STOP_LOADING,
-    BE_SAVE_FILE
+    BE_SAVE_FILE,
+    BE_PREFETCH,
+    BE_DOWNLOAD
 } book_event_t;
 
 struct content_data_t : public book_event_data_t
@@ -71,6 +78,7 @@ struct content_data_t : public book_event_data_t
 struct chapter_data_t : public book_event_data_t
 {
     chapters_t chapters;
+    std::vector<u64> hashes; // HashChapter of each chapter
 
     chapter_data_t()
     {
@@ -92,12 +100,33 @@ OnlineBook::OnlineBook()
     : m_hEvent(NULL)
     , m_hMutex(NULL)
     , m_result(false)
+    , m_FoundTime(0)
     , m_IsLoading(FALSE)
     , m_TagetIndex(-1)
     , m_Booksrc(NULL)
     , m_cb(NULL)
     , m_arg(NULL)
     , m_IsCheck(TRUE)
+    , m_TableOffset(0)
+    , m_TableSize(0)
+    , m_TableChapters(0)
+    , m_TailOffset(0)
+    , m_TailChapters(0)
+    , m_TailSize(0)
+    , m_GarbageSize(0)
+    , m_PrefetchAhead(3)
+    , m_PrefetchBehind(1)
+    , m_Direction(1)
+    , m_IsFast(FALSE)
+    , m_LastChapter(-1)
+    , m_LastChapterTime(0)
+    , m_MissIndex(-1)
+    , m_PrefetchHit(0)
+    , m_PrefetchMiss(0)
+    , m_IsDownloading(FALSE)
+    , m_DownloadCursor(0)
+    , m_DownloadFailed(0)
+    , m_DownloadTime(0)
 {
     memset(m_MainPage, 0, sizeof(m_MainPage));
     memset(m_ChapterPage, 0, sizeof(m_ChapterPage));
@@ -108,13 +137,25 @@ OnlineBook::OnlineBook()
 
 OnlineBook::~OnlineBook()
 {
-    std::set<req_handler_t>::iterator it;
+    requests_t::iterator it;
+    std::set<void*>::iterator itor;
+    req_content_param_t* param;
 
     for (it = m_hRequestList.begin(); it != m_hRequestList.end(); it++)
     {
-        hapi_cancel(*it);
+        hapi_cancel(it->second.handler);
     }
 
+    // canceled prefetching which is never completed
+    for (itor = m_Canceled.begin(); itor != m_Canceled.end(); itor++)
+    {
+        param = (req_content_param_t*)(*itor);
+        if (param->text)
+            free(param->text);
+        free(param);
+    }
+    m_Canceled.clear();
+
     if (m_hEvent)
     {
         CloseHandle(m_hEvent);
@@ -124,6 +165,7 @@ OnlineBook::~OnlineBook()
     ForceKill();
 
     m_hRequestList.clear();
+    FreePieces();
     
     if (m_hMutex)
     {
@@ -160,6 +202,8 @@ void OnlineBook::JumpChapter(HWND hWnd, int index)
 
     if (m_Chapters[index].index == -1)
     {
+        // prefetching around the old position is useless now
+        CancelPrefetch(index, NULL);
         m_TagetIndex = index;
         ParserContent(hWnd, index, todo_jump);
         PlayLoading(hWnd);
@@ -185,6 +229,8 @@ void OnlineBook::JumpPrevChapter(HWND hWnd)
     {
         if (m_Chapters[prev].index == -1)
         {
+            m_MissIndex = prev;
+            m_PrefetchMiss++;
             m_TagetIndex = prev;
             ParserContent(hWnd, prev, todo_jump);
             PlayLoading(hWnd);
@@ -212,6 +258,8 @@ void OnlineBook::JumpNextChapter(HWND hWnd)
     {
         if (m_Chapters[next].index == -1)
         {
+            m_MissIndex = next;
+            m_PrefetchMiss++;
             m_TagetIndex = next;
             ParserContent(hWnd, next, todo_jump);
             PlayLoading(hWnd);
@@ -257,6 +305,8 @@ LRESULT OnlineBook::OnBookEvent(HWND hWnd, UINT message, WPARAM wParam, LPARAM l
     chapter_data_t* chapters = NULL;
     content_data_t* content = NULL;
     loading_data_t* loading = NULL;
+    text_piece_t piece;
+    chapters_t::iterator itor;
     size_t i;
     int offset = -1;
     int ret = 0;
@@ -270,6 +320,8 @@ LRESULT OnlineBook::OnBookEvent(HWND hWnd, UINT message, WPARAM wParam, LPARAM l
         if (m_Chapters.empty())
         {
             m_Chapters.insert(chapters->chapters.begin(), chapters->chapters.end());
+            m_ChapterHash = chapters->hashes;
+            WriteOlTable();
         }
         else
         {
@@ -279,7 +331,17 @@ LRESULT OnlineBook::OnBookEvent(HWND hWnd, UINT message, WPARAM wParam, LPARAM l
                 chapters->ret = 1;
                 break; // invalid data
             }
-            for (i = 0; i < m_Chapters.size(); i++)
+            if (m_ChapterHash.size() != m_Chapters.size())
+            {
+                m_ChapterHash.resize(m_Chapters.size());
+                for (itor = m_Chapters.begin(); itor != m_Chapters.end(); itor++)
+                    m_ChapterHash[itor->first] = HashChapter(&itor->second);
+            }
+            // chapters before the first changed one are the same, usually all of them
+            for (i = 0; i < m_Chapters.size() && m_ChapterHash[i] == chapters->hashes[i]; i++)
+                ;
+            offset = (int)i;
+            for (; i < m_Chapters.size(); i++)
             {
 #if TEST_MODEL
                 assert(m_Chapters[i].title == (chapters->chapters)[i].title);
@@ -297,8 +359,15 @@ LRESULT OnlineBook::OnBookEvent(HWND hWnd, UINT message, WPARAM wParam, LPARAM l
             {
                 m_Chapters.insert(std::make_pair(i, (chapters->chapters)[i]));
             }
+            m_FoundTime = (u32)time(NULL);
+            // new chapters at the end only, the table in file is still good
+            if (offset == (int)m_ChapterHash.size())
+                WriteOlTail();
+            else
+                WriteOlTable();
+            // the hash is of the list, a downloaded chapter keeps its old title
+            m_ChapterHash = chapters->hashes;
         }
-        WriteOlFile();
         break;
     case BE_UPATE_CONTENT:
         content = (content_data_t*)lParam;
@@ -323,37 +392,40 @@ LRESULT OnlineBook::OnBookEvent(HWND hWnd, UINT message, WPARAM wParam, LPARAM l
         }
         else // insert text
         {
+            m_PageIndex.Stop(); // paginating thread is reading text
             m_TextLength += content->len;
-            m_Text = (TCHAR*)realloc(m_Text, (m_TextLength + 1) * sizeof(TCHAR));
-            m_Text[m_TextLength] = 0;
 
-            for (i = content->index + 1; i < m_Chapters.size(); i++)
+            // walk the map instead of looking up every later chapter
+            for (itor = m_Chapters.upper_bound(content->index); itor != m_Chapters.end(); itor++)
             {
-                if (m_Chapters[i].index != -1)
+                if (itor->second.index != -1)
                 {
                     if (offset == -1)
                     {
-                        offset = m_Chapters[i].index;
+                        offset = itor->second.index;
                     }
-                    m_Chapters[i].index += content->len;
+                    itor->second.index += content->len;
                 }
             }
 
-            if (offset == -1) // append
+            m_Chapters[content->index].index = offset == -1 ? m_TextLength - content->len : offset;
+            m_Chapters[content->index].size = content->len;
+            if (offset == -1 && m_Pieces.empty()) // append
             {
-                m_Chapters[content->index].index = m_TextLength - content->len;
-                m_Chapters[content->index].size = content->len;
+                m_Text = (TCHAR*)realloc(m_Text, (m_TextLength + 1) * sizeof(TCHAR));
                 memcpy(m_Text + m_Chapters[content->index].index, content->text, sizeof(TCHAR) * content->len);
+                m_Text[m_TextLength] = 0;
             }
-            else // insert
+            else // insert, keep the chapter aside and merge all pieces in one pass when the text is read
             {
-                m_Chapters[content->index].index = offset;
-                m_Chapters[content->index].size = content->len;
-                memcpy(m_Text + offset + content->len, m_Text + offset, sizeof(TCHAR) * (m_TextLength - offset - content->len));
-                memcpy(m_Text + offset, content->text, sizeof(TCHAR) * content->len);
+                piece.len = content->len;
+                piece.text = (TCHAR*)malloc(sizeof(TCHAR) * content->len);
+                memcpy(piece.text, content->text, sizeof(TCHAR) * content->len);
+                m_Pieces[content->index] = piece;
 
                 // update book mark
-                UpdateBookMark(hWnd, offset, content->len);
+                if (offset != -1)
+                    UpdateBookMark(hWnd, offset, content->len);
             }
 
             // update current pos
@@ -405,7 +477,7 @@ LRESULT OnlineBook::OnBookEvent(HWND hWnd, UINT message, WPARAM wParam, LPARAM l
             }
 #endif
         }
-        WriteOlFile();
+        AppendOlChapter(content->index, content->text, content->len);
         break;
     case BE_PLAY_LOADING:
         loading = (loading_data_t*)lParam;
@@ -424,7 +496,28 @@ LRESULT OnlineBook::OnBookEvent(HWND hWnd, UINT message, WPARAM wParam, LPARAM l
             delete loading;
         break;
     case BE_SAVE_FILE:
-        WriteOlFile();
+        UpdateOlHeader();
+        break;
+    case BE_PREFETCH:
+        loading = (loading_data_t*)lParam;
+        Prefetch(hWnd);
+        if (loading)
+            delete loading;
+        break;
+    case BE_DOWNLOAD:
+        loading = (loading_data_t*)lParam;
+        if (loading && loading->idx >= 0 && loading->idx < (int)m_Chapters.size())
+        {
+            // host is down or blocks us, pause until the book is opened again
+            if (m_Chapters[loading->idx].index == -1)
+                m_DownloadFailed++;
+            else
+                m_DownloadFailed = 0;
+        }
+        Download(hWnd);
+        PostMessage(hWnd, WM_UPDATE_PAGES, 0, NULL);
+        if (loading)
+            delete loading;
         break;
     default:
         break;
@@ -435,6 +528,10 @@ LRESULT OnlineBook::OnBookEvent(HWND hWnd, UINT message, WPARAM wParam, LPARAM l
 
 bool OnlineBook::ParserBook(HWND hWnd)
 {
+#if TEST_MODEL
+    UnitTest8();
+#endif
+
     m_IsCheck = FALSE;
     if (m_hEvent)
     {
@@ -462,6 +559,7 @@ bool OnlineBook::ParserBook(HWND hWnd)
         if (!m_Text) // fixed bug
         {
             m_Chapters.clear();
+            m_Entries.clear();
             m_result = false;
             m_hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
             ParserChapters(hWnd, 0);
@@ -478,8 +576,6 @@ bool OnlineBook::ParserChapterPage(HWND hWnd, int idx)
     request_t req;
     req_chapter_param_t* param = NULL;
     req_handler_t hReq;
-    std::set<req_handler_t>::iterator it;
-    request_t* preq;
 #if TEST_MODEL
     char msg[1024];
 #endif
@@ -495,17 +591,8 @@ bool OnlineBook::ParserChapterPage(HWND hWnd, int idx)
     memset(m_ChapterPage, 0, sizeof(m_ChapterPage));
 
     // check it's requesting
-    WaitForSingleObject(m_hMutex, INFINITE);
-    for (it = m_hRequestList.begin(); it != m_hRequestList.end(); it++)
-    {
-        preq = hapi_get_request_info(*it);
-        if (preq->completer == GetChapterPageCompleter)
-        {
-            ReleaseMutex(m_hMutex);
-            return true;
-        }
-    }
-    ReleaseMutex(m_hMutex);
+    if (FindRequest(REQUEST_KEY(rk_chapter_page, 0)))
+        return true;
 
     param = (req_chapter_param_t*)malloc(sizeof(req_chapter_param_t));
 
@@ -525,13 +612,12 @@ bool OnlineBook::ParserChapterPage(HWND hWnd, int idx)
     OutputDebugStringA(msg);
 #endif
 
+    // a request failing fast may complete at once, its entry must be added before the completer erases it
+    WaitForSingleObject(m_hMutex, INFINITE);
     hReq = hapi_request(&req);
     if (hReq)
-    {
-        WaitForSingleObject(m_hMutex, INFINITE);
-        m_hRequestList.insert(hReq);
-        ReleaseMutex(m_hMutex);
-    }
+        AddRequest(REQUEST_KEY(rk_chapter_page, 0), hReq, param);
+    ReleaseMutex(m_hMutex);
     return true;
 }
 
@@ -540,8 +626,6 @@ bool OnlineBook::ParserChapters(HWND hWnd, int idx)
     request_t req;
     req_chapter_param_t* param = NULL;
     req_handler_t hReq;
-    std::set<req_handler_t>::iterator it;
-    request_t* preq;
 #if TEST_MODEL
     char msg[1024];
 #endif
@@ -554,18 +638,8 @@ bool OnlineBook::ParserChapters(HWND hWnd, int idx)
     }
 
     // check it's requesting
-    WaitForSingleObject(m_hMutex, INFINITE);
-    for (it = m_hRequestList.begin(); it != m_hRequestList.end(); it++)
-    {
-        preq = hapi_get_request_info(*it);
-        if (preq->completer == GetChaptersCompleter
-            /*|| preq->completer == GetChapterPageCompleter*/)
-        {
-            ReleaseMutex(m_hMutex);
-            return true;
-        }
-    }
-    ReleaseMutex(m_hMutex);
+    if (FindRequest(REQUEST_KEY(rk_chapters, 0)))
+        return true;
 
     param = (req_chapter_param_t*)malloc(sizeof(req_chapter_param_t));
 
@@ -585,23 +659,20 @@ bool OnlineBook::ParserChapters(HWND hWnd, int idx)
     OutputDebugStringA(msg);
 #endif
     
+    // a request failing fast may complete at once, its entry must be added before the completer erases it
+    WaitForSingleObject(m_hMutex, INFINITE);
     hReq = hapi_request(&req);
     if (hReq)
-    {
-        WaitForSingleObject(m_hMutex, INFINITE);
-        m_hRequestList.insert(hReq);
-        ReleaseMutex(m_hMutex);
-    }
+        AddRequest(REQUEST_KEY(rk_chapters, 0), hReq, param);
+    ReleaseMutex(m_hMutex);
     return true;
 }
 
-bool OnlineBook::ParserContent(HWND hWnd, int idx, u32 todo)
+bool OnlineBook::ParserContent(HWND hWnd, int idx, u32 todo, BOOL prefetch, BOOL download)
 {
     request_t req;
     req_content_param_t* param = NULL;
     req_handler_t hReq;
-    std::set<req_handler_t>::iterator it;
-    request_t* preq;
     char url[1024] = { 0 };
 #if TEST_MODEL
     char msg[1024];
@@ -610,20 +681,12 @@ bool OnlineBook::ParserContent(HWND hWnd, int idx, u32 todo)
     if (idx == -1 || (int)m_Chapters.size() <= idx)
         return false;
 
-    // check it's requesting
+    // check it's requesting, all callers share the request on the way
     WaitForSingleObject(m_hMutex, INFINITE);
-    for (it = m_hRequestList.begin(); it != m_hRequestList.end(); it++)
+    if (JoinContentRequest(idx, todo, prefetch, download))
     {
-        preq = hapi_get_request_info(*it);
-        param = (req_content_param_t*)preq->param1;
-        if (preq->completer == GetContentCompleter && param->index == idx)
-        {
-            // update
-            if (param->todo != todo)
-                param->todo = todo;
-            ReleaseMutex(m_hMutex);
-            return true;
-        }
+        ReleaseMutex(m_hMutex);
+        return true;
     }
     ReleaseMutex(m_hMutex);
 
@@ -635,6 +698,9 @@ bool OnlineBook::ParserContent(HWND hWnd, int idx, u32 todo)
     param->_this = this;
     param->text = NULL;
     param->textlen = 0;
+    param->prefetch = prefetch;
+    param->stale = FALSE;
+    param->download = download;
 
     // check URL
     CombineUrl(m_Chapters[idx].url.c_str(), m_MainPage, url);
@@ -651,13 +717,12 @@ bool OnlineBook::ParserContent(HWND hWnd, int idx, u32 todo)
     OutputDebugStringA(msg);
 #endif
 
+    // a request failing fast may complete at once, its entry must be added before the completer erases it
+    WaitForSingleObject(m_hMutex, INFINITE);
     hReq = hapi_request(&req);
     if (hReq)
-    {
-        WaitForSingleObject(m_hMutex, INFINITE);
-        m_hRequestList.insert(hReq);
-        ReleaseMutex(m_hMutex);
-    }
+        AddRequest(REQUEST_KEY(rk_content, idx), hReq, param);
+    ReleaseMutex(m_hMutex);
     return true;
 }
 
@@ -666,8 +731,6 @@ bool OnlineBook::ParserBookStatus(HWND hWnd)
     request_t req;
     req_bookstatus_param_t* param = NULL;
     req_handler_t hReq;
-    std::set<req_handler_t>::iterator it;
-    request_t* preq;
     char url[1024] = { 0 };
     char* encode;
 #if TEST_MODEL
@@ -675,17 +738,8 @@ bool OnlineBook::ParserBookStatus(HWND hWnd)
 #endif
 
     // check it's requesting
-    WaitForSingleObject(m_hMutex, INFINITE);
-    for (it = m_hRequestList.begin(); it != m_hRequestList.end(); it++)
-    {
-        preq = hapi_get_request_info(*it);
-        if (preq->completer == GetBookStatusCompleter)
-        {
-            ReleaseMutex(m_hMutex);
-            return true;
-        }
-    }
-    ReleaseMutex(m_hMutex);
+    if (FindRequest(REQUEST_KEY(rk_book_status, 0)))
+        return true;
 
     param = (req_bookstatus_param_t*)malloc(sizeof(req_bookstatus_param_t));
 
@@ -708,13 +762,12 @@ bool OnlineBook::ParserBookStatus(HWND hWnd)
     OutputDebugStringA(msg);
 #endif
 
+    // a request failing fast may complete at once, its entry must be added before the completer erases it
+    WaitForSingleObject(m_hMutex, INFINITE);
     hReq = hapi_request(&req);
     if (hReq)
-    {
-        WaitForSingleObject(m_hMutex, INFINITE);
-        m_hRequestList.insert(hReq);
-        ReleaseMutex(m_hMutex);
-    }
+        AddRequest(REQUEST_KEY(rk_book_status, 0), hReq, param);
+    ReleaseMutex(m_hMutex);
     return true;
 }
 
@@ -725,6 +778,7 @@ bool _check_olfile(const TCHAR *filename)
     int len = 0;
     int basesize = 0;
     ol_header_t* header = NULL;
+    ol_file_header_t* fheader = NULL;
     char host[1024] = {0};
 
     // read file to memory
@@ -747,6 +801,15 @@ bool _check_olfile(const TCHAR *filename)
     fclose(fp);
     fp = NULL;
 
+    fheader = (ol_file_header_t*)buf;
+    if (fheader->magic == OL_FILE_MAGIC)
+    {
+        if (fheader->table_offset > (u32)len || fheader->table_size > (u32)len - fheader->table_offset)
+            goto fail;
+        free(buf);
+        return true;
+    }
+
     header = (ol_header_t*)buf;
     if (len < (int)header->header_size)
     {
@@ -772,17 +835,19 @@ fail:
     return false;
 }
 
-bool OnlineBook::ReadOlFile(BOOL fast)
+bool OnlineBook::ReadOlFile(BOOL fast, BOOL loadtext)
 {
     FILE* fp = NULL;
     char* buf = NULL;
     int len = 0;
-    bool result = false;
-    char mainpage[1024] = { 0 };
     ol_header_t *header = NULL;
+    ol_file_header_t *fheader = NULL;
+    ol_chapter_entry_t *entry = NULL;
     int basesize = 0;
+    u32 next = 0;
+    int i;
 
-    // read file to memory
+    // read file header
     fp = _tfopen(m_fileName, _T("rb"));
     if (!fp)
         goto fail;
@@ -790,48 +855,162 @@ bool OnlineBook::ReadOlFile(BOOL fast)
     len = ftell(fp);
     fseek(fp, 0, SEEK_SET);
 
-    if (fast)
+    basesize = sizeof(ol_header_t) - sizeof(ol_chapter_info_t);
+    if (basesize < (int)sizeof(ol_file_header_t))
+        basesize = sizeof(ol_file_header_t);
+    if (basesize > len)
+        goto fail;
+
+    buf = (char*)malloc(basesize);
+    if (!buf)
+        goto fail;
+
+    fread(buf, 1, basesize, fp);
+
+    fheader = (ol_file_header_t*)buf;
+    if (fheader->magic == OL_FILE_MAGIC)
     {
-        basesize = sizeof(ol_header_t) - sizeof(ol_chapter_info_t);
-        if (basesize > len)
+        if (fheader->table_offset > (u32)len || fheader->table_size > (u32)len - fheader->table_offset)
             goto fail;
+        m_UpdateTime = fheader->update_time;
+        m_FoundTime = fheader->found_time;
+        m_IsFinished = fheader->is_finished;
+        m_IsDownloading = fheader->is_downloading;
+        if (fast)
+        {
+            fclose(fp);
+            free(buf);
+            return true;
+        }
+        m_TableOffset = fheader->table_offset;
+        m_TableSize = fheader->table_size;
+        m_TailOffset = fheader->tail_offset;
+        m_TailSize = fheader->tail_size;
+        m_GarbageSize = fheader->garbage_size;
+        free(buf);
+        buf = NULL;
 
-        buf = (char*)malloc(basesize);
+        // read chapter table only, chapter texts are read one by one
+        buf = (char*)malloc(m_TableSize);
         if (!buf)
             goto fail;
+        fseek(fp, m_TableOffset, SEEK_SET);
+        if (fread(buf, 1, m_TableSize, fp) != m_TableSize)
+            goto fail;
+        if (!ParseOlTable((ol_table_t*)buf, m_TableSize))
+            goto fail;
+        free(buf);
+        buf = NULL;
+        m_TableChapters = (int)m_Entries.size();
+        m_TailChapters = m_TableChapters;
 
-        fread(buf, 1, basesize, fp);
-        fclose(fp);
-        fp = NULL;
-
-        header = (ol_header_t*)buf;
-        if (len < (int)header->header_size)
+        // chapters added after the table
+        if (m_TailOffset)
         {
-            // invalid file
+            if (m_TailOffset < sizeof(ol_file_header_t) || m_TailOffset > (u32)len || m_TailSize > (u32)len - m_TailOffset)
+                goto fail;
+            buf = (char*)malloc(m_TailSize);
+            if (!buf)
+                goto fail;
+            fseek(fp, m_TailOffset, SEEK_SET);
+            if (fread(buf, 1, m_TailSize, fp) != m_TailSize)
+                goto fail;
+            if (!ParseOlTable((ol_table_t*)buf, m_TailSize, m_TableChapters))
+                goto fail;
+            free(buf);
+            buf = NULL;
+            m_TailChapters = (int)m_Entries.size();
+        }
+
+        // parse book source
+        m_Booksrc = FindBookSource(m_Host);
+        if (!m_Booksrc)
             goto fail;
+
+        m_TextLength = 0;
+        for (i = 0; i < (int)m_Entries.size(); i++)
+        {
+            entry = &m_Entries[i];
+            if (entry->offset == 0)
+                continue;
+            if (entry->offset < sizeof(ol_file_header_t) || entry->offset > (u32)len
+                || entry->size > ((u32)len - entry->offset) / sizeof(TCHAR))
+            {
+                memset(entry, 0, sizeof(ol_chapter_entry_t));
+                continue;
+            }
+            if (!loadtext)
+            {
+                // chapter offsets only, for checking update
+                m_Chapters[i].index = m_TextLength;
+                m_Chapters[i].size = entry->size;
+            }
+            m_TextLength += entry->size;
+        }
+
+        // parse text, read each chapter straight into its place, the broken ones are dropped and downloaded again
+        if (loadtext && m_TextLength > 0)
+        {
+            m_Text = (TCHAR*)malloc((m_TextLength + 1) * sizeof(TCHAR));
+            if (m_Text == NULL)
+                goto fail;
+            m_TextLength = 0;
+            for (i = 0; i < (int)m_Entries.size(); i++)
+            {
+                entry = &m_Entries[i];
+                if (entry->offset == 0)
+                    continue;
+                // chapters downloaded in order are contiguous in the log
+                if (entry->offset != next)
+                    fseek(fp, entry->offset, SEEK_SET);
+                next = entry->offset + entry->size * sizeof(TCHAR);
+                if (fread(m_Text + m_TextLength, sizeof(TCHAR), entry->size, fp) != entry->size
+                    || entry->crc != crc32(0L, (const Bytef*)(m_Text + m_TextLength), entry->size * sizeof(TCHAR)))
+                {
+                    memset(entry, 0, sizeof(ol_chapter_entry_t));
+                    next = 0;
+                    continue;
+                }
+                m_Chapters[i].index = m_TextLength;
+                m_Chapters[i].size = entry->size;
+                m_TextLength += entry->size;
+            }
+            m_Text[m_TextLength] = 0;
         }
+        fclose(fp);
+        return true;
+    }
 
+    header = (ol_header_t*)buf;
+    if (len < (int)header->header_size)
+    {
+        // invalid file
+        goto fail;
+    }
+
+    if (fast)
+    {
+        fclose(fp);
+        fp = NULL;
         m_IsFinished = header->is_finished;
         m_UpdateTime = header->update_time;
         free(buf);
         return true;
     }
 
+    // legacy file, read it to memory
+    free(buf);
     buf = (char*)malloc(len);
     if (!buf)
         goto fail;
 
+    fseek(fp, 0, SEEK_SET);
     fread(buf, 1, len, fp);
     fclose(fp);
     fp = NULL;
 
-    // parse ol header
+    // parse legacy ol header
     header = (ol_header_t*)buf;
-    if (len < (int)header->header_size)
-    {
-        // invalid file
-        goto fail;
-    }
     ParseOlHeader(header);
 
     // parse book source
@@ -850,76 +1029,612 @@ bool OnlineBook::ReadOlFile(BOOL fast)
         m_Text[m_TextLength] = 0;
 
     }
-    free(buf);
-    return true;
+    free(buf);
+    buf = NULL;
+
+    // convert to the current format
+    m_Entries.clear();
+    m_Entries.resize(m_Chapters.size());
+    for (i = 0; i < (int)m_Chapters.size(); i++)
+    {
+        if (m_Chapters[i].index == -1 || !m_Text)
+            continue;
+        m_Entries[i].size = m_Chapters[i].size;
+        m_Entries[i].crc = crc32(0L, (const Bytef*)(m_Text + m_Chapters[i].index), m_Chapters[i].size * sizeof(TCHAR));
+    }
+    WriteOlFile();
+    return true;
+
+fail:
+    if (fp)
+        fclose(fp);
+    if (buf)
+        free(buf);
+    return false;
+}
+
+bool OnlineBook::WriteOlFile()
+{
+    FILE* fp = NULL;
+    ol_table_t* table = NULL;
+    TCHAR tmpname[MAX_PATH + 8] = { 0 };
+    chapters_t::iterator itor;
+    u32 size = 0;
+
+    // text is not loaded when checking update, it can not be rewritten
+    if (!m_Text && m_TextLength > 0)
+        return false;
+
+    // chapters are written in chapter order, the same layout as m_Text
+    m_Entries.resize(m_Chapters.size());
+    for (itor = m_Chapters.begin(); itor != m_Chapters.end(); itor++)
+    {
+        if (itor->second.index == -1)
+            memset(&m_Entries[itor->first], 0, sizeof(ol_chapter_entry_t));
+        else
+            m_Entries[itor->first].offset = sizeof(ol_file_header_t) + itor->second.index * sizeof(TCHAR);
+    }
+
+    if (!GenerateOlTable(&table, &size))
+        goto fail;
+
+    // write to a temp file, the old file is kept if writing fails
+    _stprintf(tmpname, _T("%s.tmp"), m_fileName);
+    fp = _tfopen(tmpname, _T("wb"));
+    if (!fp)
+        goto fail;
+    m_TableOffset = sizeof(ol_file_header_t) + (m_Text ? m_TextLength : 0) * sizeof(TCHAR);
+    m_TableSize = size;
+    m_TableChapters = (int)m_Chapters.size();
+    m_TailOffset = 0;
+    m_TailChapters = m_TableChapters;
+    m_TailSize = 0;
+    m_GarbageSize = 0;
+    // write header
+    WriteOlHeader(fp);
+    // write text
+    if (m_Text && m_TextLength > 0)
+        WriteText(fp);
+    // write chapter table
+    fwrite(table, 1, size, fp);
+    if (ferror(fp))
+        goto fail;
+    fclose(fp);
+    fp = NULL;
+    free(table);
+    table = NULL;
+
+    if (!MoveFileEx(tmpname, m_fileName, MOVEFILE_REPLACE_EXISTING))
+        goto fail;
+    return true;
+
+fail:
+    if (fp)
+        fclose(fp);
+    if (table)
+        free(table);
+    if (tmpname[0])
+        DeleteFile(tmpname);
+    return false;
+}
+
+bool OnlineBook::WriteOlTable()
+{
+    FILE* fp = NULL;
+    ol_table_t* table = NULL;
+    u32 size = 0;
+    u32 offset = 0;
+
+    if (m_TableOffset == 0)
+        return WriteOlFile();
+
+    m_Entries.resize(m_Chapters.size());
+    if (!GenerateOlTable(&table, &size))
+        goto fail;
+
+    fp = _tfopen(m_fileName, _T("r+b"));
+    if (!fp)
+        goto fail;
+    fseek(fp, 0, SEEK_END);
+    offset = ftell(fp);
+
+    // compact the file when most of it is garbage
+    if ((m_Text || m_TextLength == 0)
+        && (u64)(m_GarbageSize + m_TableSize + m_TailSize) * 100 > (u64)(offset + size) * OL_COMPACT_PERCENT)
+    {
+        fclose(fp);
+        free(table);
+        return WriteOlFile();
+    }
+
+    // append the new table, then switch to it
+    if (fwrite(table, 1, size, fp) != size)
+        goto fail;
+    fflush(fp);
+    m_GarbageSize += m_TableSize + m_TailSize;
+    m_TableOffset = offset;
+    m_TableSize = size;
+    m_TableChapters = (int)m_Chapters.size();
+    m_TailOffset = 0;
+    m_TailChapters = m_TableChapters;
+    m_TailSize = 0;
+    if (!WriteOlHeader(fp))
+        goto fail;
+    fclose(fp);
+    free(table);
+    return true;
+
+fail:
+    if (fp)
+        fclose(fp);
+    if (table)
+        free(table);
+    return false;
+}
+
+bool OnlineBook::WriteOlTail()
+{
+    FILE* fp = NULL;
+    ol_table_t* table = NULL;
+    u32 size = 0;
+    u32 offset = 0;
+
+    if (m_TableOffset == 0)
+        return WriteOlFile();
+
+    m_Entries.resize(m_Chapters.size());
+    if (!GenerateOlTable(&table, &size, m_TableChapters))
+        goto fail;
+
+    // the table is rewritten when the tail grows large
+    if ((u64)size * 100 > (u64)m_TableSize * OL_TAIL_PERCENT)
+    {
+        free(table);
+        return WriteOlTable();
+    }
+
+    fp = _tfopen(m_fileName, _T("r+b"));
+    if (!fp)
+        goto fail;
+    fseek(fp, 0, SEEK_END);
+    offset = ftell(fp);
+
+    // append the new tail, then switch to it
+    if (fwrite(table, 1, size, fp) != size)
+        goto fail;
+    fflush(fp);
+    m_GarbageSize += m_TailSize;
+    m_TailOffset = offset;
+    m_TailSize = size;
+    m_TailChapters = (int)m_Chapters.size();
+    if (!WriteOlHeader(fp))
+        goto fail;
+    fclose(fp);
+    free(table);
+    return true;
+
+fail:
+    if (fp)
+        fclose(fp);
+    if (table)
+        free(table);
+    return false;
+}
+
+bool OnlineBook::WriteOlHeader(FILE *fp)
+{
+    ol_file_header_t header = { 0 };
+
+    header.magic = OL_FILE_MAGIC;
+    header.version = OL_FILE_VERSION;
+    header.update_time = m_UpdateTime;
+    header.found_time = m_FoundTime;
+    header.is_finished = m_IsFinished;
+    header.table_offset = m_TableOffset;
+    header.table_size = m_TableSize;
+    header.garbage_size = m_GarbageSize;
+    header.is_downloading = m_IsDownloading;
+    header.tail_offset = m_TailOffset;
+    header.tail_size = m_TailSize;
+
+    fseek(fp, 0, SEEK_SET);
+    return fwrite(&header, 1, sizeof(header), fp) == sizeof(header);
+}
+
+bool OnlineBook::UpdateOlHeader()
+{
+    FILE* fp = NULL;
+    bool ret;
+
+    if (m_TableOffset == 0)
+        return WriteOlFile();
+
+    fp = _tfopen(m_fileName, _T("r+b"));
+    if (!fp)
+        return false;
+    ret = WriteOlHeader(fp);
+    fclose(fp);
+    return ret;
+}
+
+bool OnlineBook::AppendOlChapter(int idx, const TCHAR *text, int len)
+{
+    FILE* fp = NULL;
+    ol_chapter_entry_t* entry = NULL;
+    u32 offset = 0;
+
+    if (idx < 0 || idx >= (int)m_Chapters.size())
+        return false;
+
+    m_Entries.resize(m_Chapters.size());
+    entry = &m_Entries[idx];
+    entry->size = len;
+    entry->crc = crc32(0L, (const Bytef*)text, len * sizeof(TCHAR));
+
+    if (m_TableOffset == 0)
+        return WriteOlFile();
+
+    fp = _tfopen(m_fileName, _T("r+b"));
+    if (!fp)
+        goto fail;
+    fseek(fp, 0, SEEK_END);
+    offset = ftell(fp);
+
+    // append the text, then point the table entry to it
+    if (fwrite(text, sizeof(TCHAR), len, fp) != (size_t)len)
+        goto fail;
+    fflush(fp);
+    entry->offset = offset;
+    if (idx >= m_TailChapters)
+    {
+        // the chapter is not in file yet, or the tail was not written when it was found
+        fclose(fp);
+        return WriteOlTail();
+    }
+    if (idx < m_TableChapters)
+        fseek(fp, m_TableOffset + offsetof(ol_table_t, chapter_list) + idx * sizeof(ol_chapter_entry_t), SEEK_SET);
+    else
+        fseek(fp, m_TailOffset + offsetof(ol_table_t, chapter_list) + (idx - m_TableChapters) * sizeof(ol_chapter_entry_t), SEEK_SET);
+    if (fwrite(entry, 1, offsetof(ol_chapter_entry_t, title_offset), fp) != offsetof(ol_chapter_entry_t, title_offset))
+        goto fail;
+    fclose(fp);
+    return true;
+
+fail:
+    if (fp)
+        fclose(fp);
+    return false;
+}
+
+bool OnlineBook::WriteText(FILE *fp)
+{
+    pieces_t::iterator itor;
+    int pos = 0; // position in m_Text
+    int len = 0; // length written
+    int n;
+
+    // same order as MergeText, without merging
+    for (itor = m_Pieces.begin(); itor != m_Pieces.end(); itor++)
+    {
+        n = m_Chapters[itor->first].index - len;
+        fwrite(m_Text + pos, sizeof(TCHAR), n, fp);
+        fwrite(itor->second.text, sizeof(TCHAR), itor->second.len, fp);
+        pos += n;
+        len += n + itor->second.len;
+    }
+    fwrite(m_Text + pos, sizeof(TCHAR), m_TextLength - len, fp);
+    return true;
+}
+
+void OnlineBook::MergeText(void)
+{
+    pieces_t::iterator itor;
+    TCHAR *text = NULL;
+    int pos = 0; // position in m_Text
+    int len = 0; // length merged
+    int n;
+
+    if (m_Pieces.empty())
+        return;
+
+    text = (TCHAR*)malloc((m_TextLength + 1) * sizeof(TCHAR));
+    if (!text)
+        return;
+
+    // pieces are sorted by chapter, so by their offset in the merged text too
+    for (itor = m_Pieces.begin(); itor != m_Pieces.end(); itor++)
+    {
+        n = m_Chapters[itor->first].index - len;
+        memcpy(text + len, m_Text + pos, sizeof(TCHAR) * n);
+        memcpy(text + len + n, itor->second.text, sizeof(TCHAR) * itor->second.len);
+        pos += n;
+        len += n + itor->second.len;
+    }
+    memcpy(text + len, m_Text + pos, sizeof(TCHAR) * (m_TextLength - len));
+    text[m_TextLength] = 0;
+
+    m_PageIndex.Stop(); // paginating thread is reading text
+    free(m_Text);
+    m_Text = text;
+    FreePieces();
+}
+
+void OnlineBook::FreePieces(void)
+{
+    pieces_t::iterator itor;
+
+    for (itor = m_Pieces.begin(); itor != m_Pieces.end(); itor++)
+    {
+        free(itor->second.text);
+    }
+    m_Pieces.clear();
+}
+
+bool OnlineBook::Prefetch(HWND hWnd)
+{
+    std::set<int> requesting;
+    int cur = GetCurChapterIndex();
+    int ahead, behind;
+    int count;
+    int i, idx;
+    DWORD now;
+
+    if (cur == -1)
+        return false;
+
+    if (m_Chapters.size() == 0)
+        return false;
+
+    if (cur < 0 || cur >= (int)m_Chapters.size())
+        return false;
+
+    // reading direction and speed
+    if (cur != m_LastChapter)
+    {
+        now = GetTickCount();
+        if (cur == m_LastChapter + 1 || cur == m_LastChapter - 1)
+        {
+            if (cur != m_MissIndex)
+                m_PrefetchHit++;
+            m_Direction = cur > m_LastChapter ? 1 : -1;
+            m_IsFast = now - m_LastChapterTime < PREFETCH_FAST_TIME;
+        }
+        else
+        {
+            m_IsFast = FALSE;
+        }
+        m_LastChapter = cur;
+        m_LastChapterTime = now;
+    }
+
+    count = CancelPrefetch(cur, &requesting);
+
+    // nearest chapters first, reading direction first
+    GetPrefetchWindow(&ahead, &behind);
+    for (i = 1; (i <= ahead || i <= behind) && count < PREFETCH_MAX_REQUEST; i++)
+    {
+        idx = cur + i * m_Direction;
+        if (i <= ahead && idx >= 0 && idx < (int)m_Chapters.size()
+            && m_Chapters[idx].index == -1 && requesting.find(idx) == requesting.end())
+        {
+            ParserContent(hWnd, idx, todo_nothing, TRUE);
+            count++;
+        }
+        idx = cur - i * m_Direction;
+        if (i <= behind && count < PREFETCH_MAX_REQUEST && idx >= 0 && idx < (int)m_Chapters.size()
+            && m_Chapters[idx].index == -1 && requesting.find(idx) == requesting.end())
+        {
+            ParserContent(hWnd, idx, todo_nothing, TRUE);
+            count++;
+        }
+    }
+
+    return true;
+}
+
+// cancel prefetching out of the window around cur, return count of content requests left
+int OnlineBook::CancelPrefetch(int cur, std::set<int> *requesting)
+{
+    requests_t::iterator it;
+    requests_t::iterator end;
+    req_content_param_t* param;
+    std::vector<req_handler_t> handlers;
+    int ahead, behind;
+    int first, last;
+    int count = 0;
+    size_t i;
+
+    GetPrefetchWindow(&ahead, &behind);
+    first = cur - (m_Direction > 0 ? behind : ahead);
+    last = cur + (m_Direction > 0 ? ahead : behind);
+
+    // content requests are sorted by chapter index
+    WaitForSingleObject(m_hMutex, INFINITE);
+    end = m_hRequestList.lower_bound(REQUEST_KEY(rk_content + 1, 0));
+    for (it = m_hRequestList.lower_bound(REQUEST_KEY(rk_content, 0)); it != end; )
+    {
+        param = (req_content_param_t*)it->second.param;
+        if (param->prefetch && (param->index < first || param->index > last))
+        {
+            // completer is blocked on m_hMutex before it frees param, so param is valid here
+            param->stale = TRUE;
+            m_Canceled.insert(param);
+            handlers.push_back(it->second.handler);
+            m_hRequestList.erase(it++);
+            continue;
+        }
+        if (requesting)
+            requesting->insert(param->index);
+        count++;
+        it++;
+    }
+    ReleaseMutex(m_hMutex);
+
+    // the completer takes m_hMutex, don't cancel with it held
+    for (i = 0; i < handlers.size(); i++)
+    {
+        hapi_cancel(handlers[i]);
+    }
+    return count;
+}
 
-fail:
-    if (fp)
-        fclose(fp);
-    if (buf)
-        free(buf);
-    return false;
+void OnlineBook::GetPrefetchWindow(int *ahead, int *behind)
+{
+    *ahead = m_PrefetchAhead;
+    *behind = m_PrefetchBehind;
+    if (m_IsFast)
+        *ahead *= 2;
+    if (*ahead > PREFETCH_MAX_WINDOW)
+        *ahead = PREFETCH_MAX_WINDOW;
+    if (*behind > PREFETCH_MAX_WINDOW)
+        *behind = PREFETCH_MAX_WINDOW;
 }
 
-bool OnlineBook::WriteOlFile()
+void OnlineBook::SetPrefetch(int ahead, int behind)
 {
-    FILE* fp = NULL;
-    ol_header_t* header = NULL;
+    m_PrefetchAhead = ahead < 0 ? 0 : ahead;
+    m_PrefetchBehind = behind < 0 ? 0 : behind;
+}
 
-    GenerateOlHeader(&header);
-    if (!header)
-        goto fail;
+void OnlineBook::GetPrefetchStat(u32 *hit, u32 *miss)
+{
+    *hit = m_PrefetchHit;
+    *miss = m_PrefetchMiss;
+}
 
-    fp = _tfopen(m_fileName, _T("wb"));
-    if (!fp)
-        goto fail;
-    // write header
-    fwrite(header, 1, header->header_size, fp);
-    // write text
-    if (m_Text && m_TextLength > 0)
-        fwrite(m_Text, sizeof(TCHAR), m_TextLength, fp);
-    fclose(fp);
-    free(header);
-    return true;
+// count of content requests, they share the host with prefetching and reading
+int OnlineBook::GetContentRequestCount(std::set<int> *requesting, int *downloading)
+{
+    requests_t::iterator it;
+    requests_t::iterator end;
+    req_content_param_t* param;
+    int count = 0;
 
-fail:
-    if (fp)
-        fclose(fp);
-    if (header)
-        free(header);
-    return false;
+    WaitForSingleObject(m_hMutex, INFINITE);
+    end = m_hRequestList.lower_bound(REQUEST_KEY(rk_content + 1, 0));
+    for (it = m_hRequestList.lower_bound(REQUEST_KEY(rk_content, 0)); it != end; it++)
+    {
+        param = (req_content_param_t*)it->second.param;
+        if (requesting)
+            requesting->insert(param->index);
+        if (downloading && param->download)
+            (*downloading)++;
+        count++;
+    }
+    ReleaseMutex(m_hMutex);
+    return count;
 }
 
-bool OnlineBook::DownloadPrevNext(HWND hWnd)
+bool OnlineBook::StartDownload(HWND hWnd)
 {
-    int cur = GetCurChapterIndex();
-    int prev = cur - 1;
-    int next = cur + 1;
-
-    if (cur == -1)
+    if (m_Chapters.size() == 0)
         return false;
 
-    if (m_Chapters.size() == 0)
+    m_IsDownloading = TRUE;
+    m_DownloadCursor = 0;
+    m_DownloadFailed = 0;
+    m_DownloadTime = GetTickCount() - DOWNLOAD_DELAY;
+    UpdateOlHeader();
+    PostMessage(hWnd, WM_UPDATE_PAGES, 0, NULL);
+    return Download(hWnd);
+}
+
+void OnlineBook::StopDownload(HWND hWnd)
+{
+    // requests on the way still save their chapters
+    m_IsDownloading = FALSE;
+    KillTimer(hWnd, IDT_TIMER_DOWNLOAD);
+    UpdateOlHeader();
+    PostMessage(hWnd, WM_UPDATE_PAGES, 0, NULL);
+}
+
+// walk the missing chapters in order, one request every DOWNLOAD_DELAY and at most DOWNLOAD_MAX_REQUEST on the way.
+// every chapter is appended to .ol file when it comes, see BE_UPATE_CONTENT.
+bool OnlineBook::Download(HWND hWnd)
+{
+    std::set<int> requesting;
+    int count;
+    int downloading = 0;
+    DWORD now;
+
+    if (!IsDownloading())
         return false;
 
-    if (cur < 0 || cur >= (int)m_Chapters.size())
+    // resumed before chapters are loaded, try again on next draw
+    if (m_Chapters.size() == 0)
         return false;
 
-    if (next >= 0 && next < (int)m_Chapters.size())
+    count = GetContentRequestCount(&requesting, &downloading);
+    while (m_DownloadCursor < (int)m_Chapters.size())
     {
-        if (m_Chapters[next].index == -1)
-            ParserContent(hWnd, next);
-    }
+        if (m_Chapters[m_DownloadCursor].index != -1)
+        {
+            m_DownloadCursor++;
+            continue;
+        }
+        if (requesting.find(m_DownloadCursor) != requesting.end())
+        {
+            // take over the prefetch, so it is not canceled
+            ParserContent(hWnd, m_DownloadCursor, todo_nothing, FALSE, TRUE);
+            m_DownloadCursor++;
+            downloading++;
+            continue;
+        }
+        if (count >= DOWNLOAD_MAX_REQUEST)
+        {
+            // continue on BE_DOWNLOAD, or poll when the host is busy with reading
+            if (downloading == 0)
+                SetTimer(hWnd, IDT_TIMER_DOWNLOAD, DOWNLOAD_DELAY, NULL);
+            return true;
+        }
 
-    if (prev >= 0 && prev < (int)m_Chapters.size())
-    {
-        if (m_Chapters[prev].index == -1)
-            ParserContent(hWnd, prev);
+        now = GetTickCount();
+        if (now - m_DownloadTime < DOWNLOAD_DELAY)
+        {
+            SetTimer(hWnd, IDT_TIMER_DOWNLOAD, DOWNLOAD_DELAY - (now - m_DownloadTime), NULL);
+            return true;
+        }
+
+        ParserContent(hWnd, m_DownloadCursor, todo_nothing, FALSE, TRUE);
+        m_DownloadTime = now;
+        m_DownloadCursor++;
+        count++;
+        downloading++;
+        if (count < DOWNLOAD_MAX_REQUEST)
+        {
+            SetTimer(hWnd, IDT_TIMER_DOWNLOAD, DOWNLOAD_DELAY, NULL);
+            return true;
+        }
     }
 
+    if (downloading > 0)
+        return true;
+
+    // all chapters are requested and come back, failed ones are left for next download
+    m_IsDownloading = FALSE;
+    UpdateOlHeader();
+    PostMessage(hWnd, WM_UPDATE_PAGES, 0, NULL);
     return true;
 }
 
+BOOL OnlineBook::IsDownloading(void)
+{
+    return m_IsDownloading && m_DownloadFailed < DOWNLOAD_MAX_FAILED;
+}
+
+void OnlineBook::GetDownloadProgress(int *done, int *total)
+{
+    chapters_t::iterator itor;
+
+    *done = 0;
+    *total = (int)m_Chapters.size();
+    for (itor = m_Chapters.begin(); itor != m_Chapters.end(); itor++)
+    {
+        if (itor->second.index != -1)
+            (*done)++;
+    }
+}
+
 bool OnlineBook::OnDrawPageEvent(HWND hWnd)
 {
 #if TEST_MODEL
@@ -948,7 +1663,10 @@ bool OnlineBook::OnDrawPageEvent(HWND hWnd)
     }
     assert(len == m_TextLength);
 #endif
-    return DownloadPrevNext(hWnd);
+    // resume the download saved in .ol file
+    if (m_IsDownloading)
+        Download(hWnd);
+    return Prefetch(hWnd);
 }
 
 bool OnlineBook::OnLineUpDownEvent(HWND hWnd, BOOL up, int n)
@@ -973,6 +1691,8 @@ bool OnlineBook::OnLineUpDownEvent(HWND hWnd, BOOL up, int n)
             if (m_Chapters[cur].index == *m_CurrentPos
                 && m_Chapters[prev].index == -1)
             {
+                m_MissIndex = prev;
+                m_PrefetchMiss++;
                 m_TagetIndex = prev;
                 ParserContent(hWnd, prev, n << 16 | todo_lineup);
                 PlayLoading(hWnd);
@@ -993,6 +1713,8 @@ bool OnlineBook::OnLineUpDownEvent(HWND hWnd, BOOL up, int n)
             if ((*m_CurrentPos) + m_CurPageSize == m_TextLength
                 && m_Chapters[next].index == -1)
             {
+                m_MissIndex = next;
+                m_PrefetchMiss++;
                 m_TagetIndex = next;
                 ParserContent(hWnd, next, n << 16 | todo_linedown);
                 PlayLoading(hWnd);
@@ -1010,63 +1732,6 @@ bool OnlineBook::OnLineUpDownEvent(HWND hWnd, BOOL up, int n)
     return true;
 }
 
-void OnlineBook::TidyHtml(char* html, int* len)
-{
-    char* buf = NULL;
-    int index = 0;
-    int i;
-
-    buf = (char*)malloc((*len)+1);
-    if (!buf)
-        return;
-    for (i = 0; i < *len; i++)
-    {
-        // replace "<br><br>"
-        if (i < (*len - 8) && strncmp(html+i, "<br><br>", 8) == 0)
-        {
-            buf[index++] = '\n';
-            i += 7;
-        }
-        else if (i < (*len - 4) && strncmp(html+i, "<br>", 4) == 0)
-        {
-            buf[index++] = '\n';
-            i += 3;
-        }
-        else
-        {
-            buf[index++] = html[i];
-        }
-    }
-    if (index < *len)
-    {
-        *len = index;
-        buf[index] = 0;
-        memcpy(html, buf, index + 1);
-    }
-    free(buf);
-}
-
-void OnlineBook::FormatHtml(char** html, int* len, int *needfree)
-{
-    char *htmlfmt = NULL;
-    int lenfmt = 0;
-
-    if (*html && (*len) > 0)
-    {
-        HtmlParser::Instance()->FormatHtml(*html, *len, &htmlfmt, &lenfmt);
-        if (htmlfmt && lenfmt > 0)
-        {
-            if ((*needfree) == 1)
-                free(*html);
-            *html = htmlfmt;
-            *len = lenfmt;
-            *needfree = 2;
-            //HtmlParser::Instance()->FreeFormat(htmlfmt);
-            TidyHtml(*html, len);
-        }
-    }
-}
-
 void OnlineBook::TidyUrl(char* html, int* len)
 {
     char* buf = NULL;
@@ -1140,29 +1805,199 @@ void OnlineBook::StopLoading(HWND hWnd, int idx)
 BOOL OnlineBook::Redirect(OnlineBook *_this, request_t *r, const char *url, req_handler_t hOld)
 {
     req_handler_t hReq = NULL;
+    requests_t::iterator it;
     BOOL ret;
 
     ret = ::Redirect(r, url, &hReq);
 
     if (ret && hReq && m_hMutex)
     {
+        // same key, the new request takes the place unless the old one is canceled
         WaitForSingleObject(m_hMutex, INFINITE);
-        m_hRequestList.erase(hOld);
-        m_hRequestList.insert(hReq);
+        it = m_hRequestList.find(GetRequestKey(r));
+        if (it != m_hRequestList.end() && it->second.handler == hOld)
+            it->second.handler = hReq;
         ReleaseMutex(m_hMutex);
     }
     return ret;
 }
 
-bool OnlineBook::GenerateOlHeader(ol_header_t** header)
+BOOL OnlineBook::FindRequest(u64 key)
+{
+    BOOL ret;
+
+    WaitForSingleObject(m_hMutex, INFINITE);
+    ret = m_hRequestList.find(key) != m_hRequestList.end();
+    ReleaseMutex(m_hMutex);
+    return ret;
+}
+
+// m_hMutex is held by caller while the request is issued
+void OnlineBook::AddRequest(u64 key, req_handler_t hReq, void *param)
+{
+    req_entry_t entry;
+
+    entry.handler = hReq;
+    entry.param = param;
+    m_hRequestList[key] = entry;
+}
+
+// m_hMutex is held by caller. the content request of the chapter on the way takes over the new caller.
+BOOL OnlineBook::JoinContentRequest(int idx, u32 todo, BOOL prefetch, BOOL download)
+{
+    requests_t::iterator it;
+    req_content_param_t* param;
+
+    it = m_hRequestList.find(REQUEST_KEY(rk_content, idx));
+    if (it == m_hRequestList.end())
+        return FALSE;
+
+    param = (req_content_param_t*)it->second.param;
+    // update
+    if (param->todo != todo)
+        param->todo = todo;
+    // the reader is waiting for it now
+    if (!prefetch)
+        param->prefetch = FALSE;
+    if (download)
+        param->download = TRUE;
+    return TRUE;
+}
+
+// m_hMutex is held by caller. the key may be taken by a new request after the old one is canceled.
+void OnlineBook::EraseRequest(u64 key, req_handler_t hReq)
+{
+    requests_t::iterator it;
+
+    it = m_hRequestList.find(key);
+    if (it != m_hRequestList.end() && it->second.handler == hReq)
+        m_hRequestList.erase(it);
+}
+
+u64 OnlineBook::GetRequestKey(request_t *r)
+{
+    if (r->completer == GetContentCompleter)
+        return REQUEST_KEY(rk_content, ((req_content_param_t*)r->param1)->index);
+    if (r->completer == GetChaptersCompleter)
+        return REQUEST_KEY(rk_chapters, 0);
+    if (r->completer == GetChapterPageCompleter)
+        return REQUEST_KEY(rk_chapter_page, 0);
+    return REQUEST_KEY(rk_book_status, 0);
+}
+
+// request registry with fake entries, nothing is sent
+void OnlineBook::UnitTest8(void)
+{
+#if TEST_MODEL
+    static const int indexes[] = { 300, 2, 0x7FFFFFFF, 0 };
+    req_content_param_t params[4];
+    requests_t saved;
+    requests_t::iterator it;
+    requests_t::iterator end;
+    request_t r;
+    std::set<int> requesting;
+    int i, last, downloading;
+
+    // keys of a kind are sorted by chapter index, between the keys of the kinds around it
+    assert(REQUEST_KEY(rk_chapter_page, 0) < REQUEST_KEY(rk_chapters, 0));
+    assert(REQUEST_KEY(rk_chapters, 0x7FFFFFFF) < REQUEST_KEY(rk_content, 0));
+    assert(REQUEST_KEY(rk_content, 1) < REQUEST_KEY(rk_content, 2));
+    assert(REQUEST_KEY(rk_content, 0x7FFFFFFF) < REQUEST_KEY(rk_content + 1, 0));
+    assert(REQUEST_KEY(rk_content + 1, 0) == REQUEST_KEY(rk_book_status, 0));
+
+    WaitForSingleObject(m_hMutex, INFINITE);
+    saved.swap(m_hRequestList);
+
+    AddRequest(REQUEST_KEY(rk_chapter_page, 0), (req_handler_t)1, NULL);
+    AddRequest(REQUEST_KEY(rk_chapters, 0), (req_handler_t)2, NULL);
+    AddRequest(REQUEST_KEY(rk_book_status, 0), (req_handler_t)3, NULL);
+    memset(params, 0, sizeof(params));
+    memset(&r, 0, sizeof(request_t));
+    for (i = 0; i < sizeof(indexes) / sizeof(indexes[0]); i++)
+    {
+        params[i].index = indexes[i];
+        params[i].todo = todo_nothing;
+        params[i].prefetch = TRUE;
+        AddRequest(REQUEST_KEY(rk_content, indexes[i]), (req_handler_t)(size_t)(i + 16), &params[i]);
+
+        // the completer finds its entry
+        r.completer = GetContentCompleter;
+        r.param1 = &params[i];
+        it = m_hRequestList.find(GetRequestKey(&r));
+        assert(it != m_hRequestList.end() && it->second.param == &params[i]);
+    }
+    r.completer = GetChaptersCompleter;
+    assert(GetRequestKey(&r) == REQUEST_KEY(rk_chapters, 0));
+
+    // content range holds content requests only, by chapter index
+    last = -1;
+    end = m_hRequestList.lower_bound(REQUEST_KEY(rk_content + 1, 0));
+    for (it = m_hRequestList.lower_bound(REQUEST_KEY(rk_content, 0)); it != end; it++)
+    {
+        assert(it->second.param);
+        assert(((req_content_param_t*)it->second.param)->index > last);
+        last = ((req_content_param_t*)it->second.param)->index;
+    }
+    assert(last == 0x7FFFFFFF);
+
+    // a chapter on the way is joined, not requested again
+    assert(JoinContentRequest(2, todo_jump, TRUE, FALSE));
+    assert(params[1].todo == todo_jump && params[1].prefetch && !params[1].download);
+    assert(JoinContentRequest(2, todo_nothing, FALSE, FALSE));
+    assert(params[1].todo == todo_nothing && !params[1].prefetch);
+    // prefetching again doesn't make the reader's request cancelable
+    assert(JoinContentRequest(2, todo_nothing, TRUE, TRUE));
+    assert(!params[1].prefetch && params[1].download);
+    assert(JoinContentRequest(2, todo_nothing, TRUE, FALSE));
+    assert(params[1].download);
+    assert(!JoinContentRequest(3, todo_jump, TRUE, FALSE));
+    assert(m_hRequestList.size() == 7);
+
+    downloading = 0;
+    assert(GetContentRequestCount(&requesting, &downloading) == 4);
+    assert(requesting.size() == 4 && requesting.count(300) && downloading == 1);
+
+    // the key of a canceled request may be taken by a new one already
+    EraseRequest(REQUEST_KEY(rk_content, 300), (req_handler_t)1);
+    assert(m_hRequestList.size() == 7);
+    EraseRequest(REQUEST_KEY(rk_content, 300), (req_handler_t)16);
+    assert(m_hRequestList.size() == 6 && !JoinContentRequest(300, todo_nothing, FALSE, FALSE));
+
+    m_hRequestList.swap(saved);
+    ReleaseMutex(m_hMutex);
+#endif
+}
+
+// fnv-1a of title and url
+u64 OnlineBook::HashChapter(const chapter_item_t *item)
+{
+    u64 hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < item->title.size(); i++)
+    {
+        hash ^= (u64)item->title[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= 0xFFFF; // not a char of title
+    hash *= 1099511628211ULL;
+    for (i = 0; i < item->url.size(); i++)
+    {
+        hash ^= (unsigned char)item->url[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool OnlineBook::GenerateOlTable(ol_table_t** table, u32* size, int first)
 {
     int buf_size = 0;
     int offset = 0;
     int i;
-    ol_header_t* header_ = NULL;
+    ol_table_t* table_ = NULL;
     char* buf = NULL;
 
-    int base_size = sizeof(ol_header_t) + (sizeof(ol_chapter_info_t) * ((int)m_Chapters.size() - 1));
+    int base_size = offsetof(ol_table_t, chapter_list) + sizeof(ol_chapter_entry_t) * ((int)m_Chapters.size() - first);
     int bookname_size = (_tcslen(m_BookName) + 1) * sizeof(TCHAR);
     int mainpage_size = (strlen(m_MainPage) + 1) * sizeof(char);
     int host_size = (strlen(m_Host) + 1) * sizeof(char);
@@ -1172,49 +2007,46 @@ bool OnlineBook::GenerateOlHeader(ol_header_t** header)
     buf_size += bookname_size;
     buf_size += mainpage_size;
     buf_size += host_size;
-    for (i = 0; i < (int)m_Chapters.size(); i++)
+    for (i = first; i < (int)m_Chapters.size(); i++)
     {
         buf_size += (m_Chapters[i].title.size() + 1) * sizeof(TCHAR);
         buf_size += (m_Chapters[i].url.size() + 1) * sizeof(char);
     }
 
     // set offset
-    header_ = (ol_header_t*)malloc(buf_size);
-    if (!header_)
+    table_ = (ol_table_t*)malloc(buf_size);
+    if (!table_)
         return false;
-    header_->header_size = buf_size;
     offset = base_size;
-    header_->book_name_offset = offset;
+    table_->book_name_offset = offset;
     offset += bookname_size;
-    header_->main_page_offset = offset;
+    table_->main_page_offset = offset;
     offset += mainpage_size;
-    header_->host_offset = offset;
+    table_->host_offset = offset;
     offset += host_size;
-    header_->update_time = m_UpdateTime;
-    header_->is_finished = m_IsFinished;
-    header_->chapter_size = m_Chapters.size();
-    for (i = 0; i < (int)m_Chapters.size(); i++)
+    table_->chapter_size = m_Chapters.size() - first;
+    for (i = first; i < (int)m_Chapters.size(); i++)
     {
-        header_->chapter_info_list[i].index = m_Chapters[i].index;
-        header_->chapter_info_list[i].size = m_Chapters[i].size;
-        header_->chapter_info_list[i].title_offset = offset;
+        table_->chapter_list[i - first] = m_Entries[i];
+        table_->chapter_list[i - first].title_offset = offset;
         offset += (m_Chapters[i].title.size() + 1) * sizeof(TCHAR);
-        header_->chapter_info_list[i].url_offset = offset;
+        table_->chapter_list[i - first].url_offset = offset;
         offset += (m_Chapters[i].url.size() + 1) * sizeof(char);
     }
 
     // set data
-    buf = (char*)header_;
-    memcpy(buf + header_->book_name_offset, m_BookName, bookname_size);
-    memcpy(buf + header_->main_page_offset, m_MainPage, mainpage_size);
-    memcpy(buf + header_->host_offset, m_Host, host_size);
-    for (i = 0; i < (int)m_Chapters.size(); i++)
+    buf = (char*)table_;
+    memcpy(buf + table_->book_name_offset, m_BookName, bookname_size);
+    memcpy(buf + table_->main_page_offset, m_MainPage, mainpage_size);
+    memcpy(buf + table_->host_offset, m_Host, host_size);
+    for (i = first; i < (int)m_Chapters.size(); i++)
     {
-        memcpy(buf + header_->chapter_info_list[i].title_offset, m_Chapters[i].title.c_str(), (m_Chapters[i].title.size() + 1) * sizeof(TCHAR));
-        memcpy(buf + header_->chapter_info_list[i].url_offset, m_Chapters[i].url.c_str(), (m_Chapters[i].url.size() + 1) * sizeof(char));
+        memcpy(buf + table_->chapter_list[i - first].title_offset, m_Chapters[i].title.c_str(), (m_Chapters[i].title.size() + 1) * sizeof(TCHAR));
+        memcpy(buf + table_->chapter_list[i - first].url_offset, m_Chapters[i].url.c_str(), (m_Chapters[i].url.size() + 1) * sizeof(char));
     }
 
-    *header = header_;
+    *table = table_;
+    *size = buf_size;
     return true;
 }
 
@@ -1244,6 +2076,65 @@ bool OnlineBook::ParseOlHeader(ol_header_t* header)
     return true;
 }
 
+bool OnlineBook::ParseOlTable(ol_table_t* table, u32 size, int first)
+{
+    int chapter_size;
+    chapter_item_t item;
+    char* buf = (char*)table;
+    u32 offset;
+    int i;
+
+    if (size < offsetof(ol_table_t, chapter_list)
+        || table->chapter_size > (size - offsetof(ol_table_t, chapter_list)) / sizeof(ol_chapter_entry_t))
+        return false;
+    chapter_size = (int)table->chapter_size;
+
+    // every string must end within the table, nothing is taken from a broken table
+    offset = table->book_name_offset;
+    if (offset >= size || wcsnlen((TCHAR*)(buf + offset), (size - offset) / sizeof(TCHAR)) == (size - offset) / sizeof(TCHAR))
+        return false;
+    offset = table->main_page_offset;
+    if (offset >= size || strnlen(buf + offset, size - offset) == size - offset)
+        return false;
+    offset = table->host_offset;
+    if (offset >= size || strnlen(buf + offset, size - offset) == size - offset)
+        return false;
+    for (i = 0; i < chapter_size; i++)
+    {
+        offset = table->chapter_list[i].title_offset;
+        if (offset >= size || wcsnlen((TCHAR*)(buf + offset), (size - offset) / sizeof(TCHAR)) == (size - offset) / sizeof(TCHAR))
+            return false;
+        offset = table->chapter_list[i].url_offset;
+        if (offset >= size || strnlen(buf + offset, size - offset) == size - offset)
+            return false;
+    }
+
+    // names of the tail are the same as the table
+    if (first == 0)
+    {
+        _tcsncpy(m_BookName, (TCHAR*)(buf + table->book_name_offset), sizeof(m_BookName) / sizeof(TCHAR) - 1);
+        m_BookName[sizeof(m_BookName) / sizeof(TCHAR) - 1] = 0;
+        strncpy(m_MainPage, buf + table->main_page_offset, sizeof(m_MainPage) - 1);
+        m_MainPage[sizeof(m_MainPage) - 1] = 0;
+        strncpy(m_Host, buf + table->host_offset, sizeof(m_Host) - 1);
+        m_Host[sizeof(m_Host) - 1] = 0;
+    }
+
+    m_Entries.resize(first + chapter_size);
+    for (i = 0; i < chapter_size; i++)
+    {
+        ol_chapter_entry_t* entry = &(table->chapter_list[i]);
+        item.index = -1;
+        item.size = 0;
+        item.title = (TCHAR*)(buf + entry->title_offset);
+        item.url = buf + entry->url_offset;
+        m_Chapters.insert(std::make_pair(first + i, item));
+        m_Entries[first + i] = *entry;
+    }
+
+    return true;
+}
+
 unsigned int OnlineBook::GetChapterPageCompleter(request_result_t *result)
 {
     req_chapter_param_t* param = (req_chapter_param_t*)result->param1;
@@ -1299,14 +2190,10 @@ unsigned int OnlineBook::GetChapterPageCompleter(request_result_t *result)
 #endif
     {
         // conver to gbk
-        wchar_t* tempbuf = NULL;
-        int templen = 0;
         char* utf8buf = NULL;
         int utf8len = 0;
         // convert 'gbk' to 'utf-8'
-        tempbuf = Utils::ansi_to_utf16_ex(html, htmllen, &templen);
-        utf8buf = Utils::utf16_to_utf8_ex(tempbuf, templen, &utf8len);
-        free(tempbuf);
+        utf8buf = Utils::ansi_to_utf8_ex(html, htmllen, &utf8len);
         if (needfree)
         {
             free(html);
@@ -1366,16 +2253,12 @@ end:
         if (_this->m_hMutex)
         {
             WaitForSingleObject(_this->m_hMutex, INFINITE);
-            if (_this->m_hRequestList.find(result->handler) != _this->m_hRequestList.end())
-                _this->m_hRequestList.erase(result->handler);
+            _this->EraseRequest(GetRequestKey(result->req), result->handler);
             ReleaseMutex(_this->m_hMutex);
         }
     }
     if (ret == 1 || chapters.ret != 0)
-    {
-        if (_this->m_cb)
-            _this->m_cb(FALSE, ret, _this->m_arg);
-    }
+        _this->CheckUpdateDone(FALSE, ret);
     return ret;
 }
 
@@ -1397,6 +2280,7 @@ unsigned int OnlineBook::GetChaptersCompleter(request_result_t *result)
     int dstlen;
     int needfree = 0;
     int ret = 1;
+    BOOL status = FALSE; // book status is requested, it reports the check
     char dsturl[1024];
 
 
@@ -1451,14 +2335,10 @@ unsigned int OnlineBook::GetChaptersCompleter(request_result_t *result)
 #endif
     {
         // conver to gbk
-        wchar_t* tempbuf = NULL;
-        int templen = 0;
         char* utf8buf = NULL;
         int utf8len = 0;
         // convert 'gbk' to 'utf-8'
-        tempbuf = Utils::ansi_to_utf16_ex(html, htmllen, &templen);
-        utf8buf = Utils::utf16_to_utf8_ex(tempbuf, templen, &utf8len);
-        free(tempbuf);
+        utf8buf = Utils::ansi_to_utf8_ex(html, htmllen, &utf8len);
         if (needfree)
         {
             free(html);
@@ -1520,6 +2400,7 @@ unsigned int OnlineBook::GetChaptersCompleter(request_result_t *result)
         item.title = dst;
         item.url = dsturl;
         chapters.chapters.insert(std::make_pair(i, item));
+        chapters.hashes.push_back(HashChapter(&item));
     }
     _this->m_UpdateTime = time(NULL);
     SendMessage(param->hWnd, WM_BOOK_EVENT, BE_UPATE_CHAPTER, (LPARAM)&chapters);
@@ -1530,13 +2411,9 @@ unsigned int OnlineBook::GetChaptersCompleter(request_result_t *result)
     // parser content
     if (param->index == -1)
     {
-        if (chapters.ret == 0 && !_this->m_IsFinished)
-        {
-            if (_this->m_Booksrc->book_status_pos == 1)
-                _this->ParserBookStatus(param->hWnd);
-            else
-                chapters.ret = 1;
-        }
+        // chapters.ret is 0 when new chapters are found
+        if (chapters.ret == 0 && !_this->m_IsFinished && _this->m_Booksrc->book_status_pos == 1)
+            status = _this->ParserBookStatus(param->hWnd);
     }
     else
     {
@@ -1556,16 +2433,12 @@ end:
         if (_this->m_hMutex)
         {
             WaitForSingleObject(_this->m_hMutex, INFINITE);
-            if (_this->m_hRequestList.find(result->handler) != _this->m_hRequestList.end())
-                _this->m_hRequestList.erase(result->handler);
+            _this->EraseRequest(GetRequestKey(result->req), result->handler);
             ReleaseMutex(_this->m_hMutex);
         }
     }
-    if (ret == 1 || chapters.ret != 0)
-    {
-        if (_this->m_cb)
-            _this->m_cb(FALSE, ret, _this->m_arg);
-    }
+    if (!status)
+        _this->CheckUpdateDone(ret == 0 && chapters.ret == 0, ret);
     return ret;
 }
 
@@ -1585,6 +2458,7 @@ unsigned int OnlineBook::GetContentCompleter(request_result_t *result)
     int dstlen;
     int needfree = 0;
     int ret = 1;
+    loading_data_t* ld = NULL;
 
     if (result->cancel)
         goto end;
@@ -1622,14 +2496,10 @@ unsigned int OnlineBook::GetContentCompleter(request_result_t *result)
 #endif
     {
         // conver to gbk
-        wchar_t* tempbuf = NULL;
-        int templen = 0;
         char* utf8buf = NULL;
         int utf8len = 0;
         // convert 'gbk' to 'utf-8'
-        tempbuf = Utils::ansi_to_utf16_ex(html, htmllen, &templen);
-        utf8buf = Utils::utf16_to_utf8_ex(tempbuf, templen, &utf8len);
-        free(tempbuf);
+        utf8buf = Utils::ansi_to_utf8_ex(html, htmllen, &utf8len);
         if (needfree)
         {
             free(html);
@@ -1642,19 +2512,20 @@ unsigned int OnlineBook::GetContentCompleter(request_result_t *result)
     if (_this->m_bForceKill)
         goto end;
 
-    _this->FormatHtml(&html, &htmllen, &needfree);
-
-    if (_this->m_bForceKill)
-        goto end;
-
-    HtmlParser::Instance()->HtmlParseBegin(html, htmllen, &doc, &ctx, &_this->m_bForceKill);
-    HtmlParser::Instance()->HtmlParseByXpath(doc, ctx, _this->m_Booksrc->content_xpath, content_list, &_this->m_bForceKill);
+    // lines of content are broken while parsing
     if (_this->m_Booksrc->enable_content_next)
     {
+        HtmlParser::Instance()->HtmlParseBegin(html, htmllen, &doc, &ctx, &_this->m_bForceKill, true);
+        HtmlParser::Instance()->HtmlParseByXpath(doc, ctx, _this->m_Booksrc->content_xpath, content_list, &_this->m_bForceKill);
         HtmlParser::Instance()->HtmlParseByXpath(doc, ctx, _this->m_Booksrc->content_next_url_xpath, url_xpath, &_this->m_bForceKill, true);
         HtmlParser::Instance()->HtmlParseByXpath(doc, ctx, _this->m_Booksrc->content_next_keyword_xpath, keyword_xpath, &_this->m_bForceKill, true);
+        HtmlParser::Instance()->HtmlParseEnd(doc, ctx);
+    }
+    else
+    {
+        // only one xpath, no tree is needed
+        HtmlParser::Instance()->HtmlParseContent(html, htmllen, _this->m_Booksrc->content_xpath, content_list, &_this->m_bForceKill);
     }
-    HtmlParser::Instance()->HtmlParseEnd(doc, ctx);
     
     if (_this->m_bForceKill)
         goto end;
@@ -1750,11 +2621,8 @@ unsigned int OnlineBook::GetContentCompleter(request_result_t *result)
     ret = 0;
 
 end:
-    if (html)
-        if (needfree == 1)
-            free(html);
-        else if (needfree == 2)
-            HtmlParser::Instance()->FreeFormat(html);
+    if (needfree && html)
+        free(html);
     if (dst)
         free(dst);
     if (!result->cancel)
@@ -1764,26 +2632,51 @@ end:
         if (_this->m_hMutex)
         {
             WaitForSingleObject(_this->m_hMutex, INFINITE);
-            if (_this->m_hRequestList.find(result->handler) != _this->m_hRequestList.end())
-                _this->m_hRequestList.erase(result->handler);
+            _this->EraseRequest(GetRequestKey(result->req), result->handler);
+            // completed before the cancel takes effect
+            if (param && param->stale)
+                _this->m_Canceled.erase(param);
             ReleaseMutex(_this->m_hMutex);
         }
         if (param)
         {
             _this->StopLoading(param->hWnd, param->index);
+            // fill the prefetch window
+            if (param->prefetch && ret == 0)
+            {
+                ld = new loading_data_t;
+                ld->_this = _this;
+                ld->idx = param->index;
+                PostMessage(param->hWnd, WM_BOOK_EVENT, BE_PREFETCH, (LPARAM)ld);
+            }
+            // next chapter of the download, failed or not
+            if (param->download)
+            {
+                ld = new loading_data_t;
+                ld->_this = _this;
+                ld->idx = param->index;
+                PostMessage(param->hWnd, WM_BOOK_EVENT, BE_DOWNLOAD, (LPARAM)ld);
+            }
             if (param->text)
                 free(param->text);
             free(param);
         }
     }
+    else if (param && param->stale)
+    {
+        // removed from request list by CancelPrefetch
+        WaitForSingleObject(_this->m_hMutex, INFINITE);
+        _this->m_Canceled.erase(param);
+        ReleaseMutex(_this->m_hMutex);
+        if (param->text)
+            free(param->text);
+        free(param);
+    }
     return ret;
 
 _next:
-    if (html)
-        if (needfree == 1)
-            free(html);
-        else if (needfree == 2)
-            HtmlParser::Instance()->FreeFormat(html);
+    if (needfree && html)
+        free(html);
     if (dst)
         free(dst);
     return 1;    
@@ -1843,14 +2736,10 @@ unsigned int OnlineBook::GetBookStatusCompleter(request_result_t *result)
 #endif
     {
         // conver to gbk
-        wchar_t* tempbuf = NULL;
-        int templen = 0;
         char* utf8buf = NULL;
         int utf8len = 0;
         // convert 'gbk' to 'utf-8'
-        tempbuf = Utils::ansi_to_utf16_ex(html, htmllen, &templen);
-        utf8buf = Utils::utf16_to_utf8_ex(tempbuf, templen, &utf8len);
-        free(tempbuf);
+        utf8buf = Utils::ansi_to_utf8_ex(html, htmllen, &utf8len);
         if (needfree)
         {
             free(html);
@@ -1908,13 +2797,11 @@ end:
         if (_this->m_hMutex)
         {
             WaitForSingleObject(_this->m_hMutex, INFINITE);
-            if (_this->m_hRequestList.find(result->handler) != _this->m_hRequestList.end())
-                _this->m_hRequestList.erase(result->handler);
+            _this->EraseRequest(GetRequestKey(result->req), result->handler);
             ReleaseMutex(_this->m_hMutex);
         }
     }
-    if (_this->m_cb)
-        _this->m_cb(TRUE, 0, _this->m_arg);
+    _this->CheckUpdateDone(TRUE, 0);
     return ret;
 }
 
@@ -1952,7 +2839,8 @@ int OnlineBook::CheckUpdate(HWND hWnd, olbook_checkupdate_callback cb, void* arg
 
     if (m_IsCheck)
     {
-        if (!ReadOlFile())
+        // only chapter list is compared, text is not needed
+        if (!ReadOlFile(FALSE, FALSE))
             return 1; // fail
     }
     
@@ -1965,4 +2853,77 @@ int OnlineBook::CheckUpdate(HWND hWnd, olbook_checkupdate_callback cb, void* arg
     return 2; // do check
 }
 
+// the checker gives up, the result is not reported
+void OnlineBook::CancelCheckUpdate(void)
+{
+    m_cb = NULL;
+    m_arg = NULL;
+}
+
+void OnlineBook::CheckUpdateDone(int is_update, int err)
+{
+    olbook_checkupdate_callback cb = m_cb;
+
+    // once for each check, later requests of the opened book don't report
+    m_cb = NULL;
+    if (cb)
+        cb(is_update, err, m_arg);
+}
+
+// for scheduling update checks, the chapter table is not read
+bool OnlineBook::ReadOlInfo(const TCHAR *filename, ol_book_info_t *info)
+{
+    FILE* fp = NULL;
+    ol_file_header_t fheader = { 0 };
+    ol_header_t *header = (ol_header_t*)&fheader;
+    ol_table_t table = { 0 };
+    u32 offset;
+    int len;
+
+    memset(info, 0, sizeof(ol_book_info_t));
+    fp = _tfopen(filename, _T("rb"));
+    if (!fp)
+        return false;
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (fread(&fheader, 1, sizeof(fheader), fp) != sizeof(fheader))
+        goto fail;
+
+    if (fheader.magic == OL_FILE_MAGIC)
+    {
+        info->update_time = fheader.update_time;
+        info->found_time = fheader.found_time;
+        info->is_finished = fheader.is_finished;
+        if (fheader.table_offset > (u32)len || fheader.table_size > (u32)len - fheader.table_offset
+            || fheader.table_size < offsetof(ol_table_t, chapter_list))
+            goto fail;
+        fseek(fp, fheader.table_offset, SEEK_SET);
+        if (fread(&table, 1, offsetof(ol_table_t, chapter_list), fp) != offsetof(ol_table_t, chapter_list))
+            goto fail;
+        if (table.host_offset >= fheader.table_size)
+            goto fail;
+        offset = fheader.table_offset + table.host_offset;
+    }
+    else
+    {
+        // legacy file, header is followed by chapters
+        info->update_time = header->update_time;
+        info->is_finished = header->is_finished;
+        if (header->host_offset >= (u32)len)
+            goto fail;
+        offset = header->host_offset;
+    }
+
+    fseek(fp, offset, SEEK_SET);
+    if (!fgets(info->host, sizeof(info->host), fp))
+        goto fail;
+    fclose(fp);
+    return true;
+
+fail:
+    fclose(fp);
+    return false;
+}
+
 #endif
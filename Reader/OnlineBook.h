@@ -6,6 +6,7 @@
 #include "httpclient.h"
 #include "HtmlParser.h"
 #include <set>
+#include <vector>
 
 typedef enum comp_todo_t
 {
@@ -17,7 +18,47 @@ typedef enum comp_todo_t
     todo_linedown
 } comp_todo_t;
 
-typedef void (*olbook_checkupdate_callback)(int is_update, int err, void *param);
+typedef struct text_piece_t
+{
+    TCHAR *text;
+    int len;
+} text_piece_t;
+
+typedef std::map<int, text_piece_t> pieces_t; // key: chapter index
+
+typedef enum req_kind_t
+{
+    rk_chapter_page,
+    rk_chapters,
+    rk_content,
+    rk_book_status
+} req_kind_t;
+
+typedef struct req_entry_t
+{
+    req_handler_t handler;
+    void *param; // param1 of request
+} req_entry_t;
+
+#define REQUEST_KEY(kind, idx)      (((u64)(kind) << 32) | (u32)(idx))
+typedef std::map<u64, req_entry_t> requests_t; // key: REQUEST_KEY(kind, chapter index), one request for each
+
+typedef void (*olbook_checkupdate_callback)(int is_update, int err, void *param); // called once for a CheckUpdate which returns 2
+
+typedef struct ol_book_info_t
+{
+    u64 update_time; // last check
+    u32 found_time; // last time new chapters were found
+    u32 is_finished;
+    char host[1024];
+} ol_book_info_t;
+
+#define PREFETCH_MAX_REQUEST        2 // content requests of one book at the same time, they are all sent to the same host
+#define PREFETCH_MAX_WINDOW         16
+#define PREFETCH_FAST_TIME          (60 * 1000) // a chapter read faster than this doubles the window ahead
+#define DOWNLOAD_MAX_REQUEST        2 // content requests to the host at the same time while downloading whole book
+#define DOWNLOAD_DELAY              500 // ms between two download requests, don't hammer the host
+#define DOWNLOAD_MAX_FAILED         5 // failed in a row
 
 class OnlineBook : public Book
 {
@@ -40,25 +81,52 @@ protected:
     virtual bool ParserBook(HWND hWnd);
     bool ParserChapterPage(HWND hWnd, int idx); // chapter index
     bool ParserChapters(HWND hWnd, int idx); // chapter index
-    bool ParserContent(HWND hWnd, int idx, u32 todo = todo_nothing); // chapter index
+    bool ParserContent(HWND hWnd, int idx, u32 todo = todo_nothing, BOOL prefetch = FALSE, BOOL download = FALSE); // chapter index
     bool ParserBookStatus(HWND hWnd);
-    bool ReadOlFile(BOOL fast=FALSE);
+    bool ReadOlFile(BOOL fast=FALSE, BOOL loadtext=TRUE);
     bool WriteOlFile();
-    bool GenerateOlHeader(ol_header_t **header);
+    bool WriteOlTable();
+    bool WriteOlTail();
+    bool WriteOlHeader(FILE *fp);
+    bool UpdateOlHeader();
+    bool AppendOlChapter(int idx, const TCHAR *text, int len); // chapter index
+    bool WriteText(FILE *fp);
+    virtual void MergeText(void);
+    void FreePieces(void);
+    bool GenerateOlTable(ol_table_t **table, u32 *size, int first = 0); // chapters from first
+    bool ParseOlTable(ol_table_t *table, u32 size, int first = 0);
     bool ParseOlHeader(ol_header_t *header);
-    bool DownloadPrevNext(HWND hWnd);
+    bool Prefetch(HWND hWnd);
+    int CancelPrefetch(int cur, std::set<int> *requesting);
+    void GetPrefetchWindow(int *ahead, int *behind);
+    int GetContentRequestCount(std::set<int> *requesting, int *downloading);
     virtual bool OnDrawPageEvent(HWND hWnd);
     virtual bool OnLineUpDownEvent(HWND hWnd, BOOL up, int n);
-    void FormatHtml(char **html, int *len, int *needfree);
-    void TidyHtml(char* html, int* len);
     void TidyUrl(char* html, int* len);
     void PlayLoading(HWND hWnd);
     void StopLoading(HWND hWnd, int idx);
     BOOL Redirect(OnlineBook* _this, request_t *r, const char *url, req_handler_t hOld);
+    BOOL FindRequest(u64 key);
+    void AddRequest(u64 key, req_handler_t hReq, void *param);
+    BOOL JoinContentRequest(int idx, u32 todo, BOOL prefetch, BOOL download);
+    void EraseRequest(u64 key, req_handler_t hReq);
+    static u64 GetRequestKey(request_t *r);
+    static u64 HashChapter(const chapter_item_t *item);
+    void CheckUpdateDone(int is_update, int err);
+    void UnitTest8(void);
 
 public:
     void UpdateBookSource(void);
+    void SetPrefetch(int ahead, int behind);
+    void GetPrefetchStat(u32 *hit, u32 *miss);
+    bool StartDownload(HWND hWnd);
+    void StopDownload(HWND hWnd);
+    bool Download(HWND hWnd);
+    BOOL IsDownloading(void);
+    void GetDownloadProgress(int *done, int *total);
     int CheckUpdate(HWND hWnd, olbook_checkupdate_callback cb, void* arg);
+    void CancelCheckUpdate(void);
+    static bool ReadOlInfo(const TCHAR *filename, ol_book_info_t *info);
 
 private:
     static unsigned int GetChapterPageCompleter(request_result_t *result);
@@ -69,13 +137,15 @@ private:
 protected:
     HANDLE m_hEvent;
     HANDLE m_hMutex;
-    std::set<req_handler_t> m_hRequestList;
+    requests_t m_hRequestList;
+    std::set<void*> m_Canceled; // params of canceled prefetching, freed here if the completer never comes
     bool m_result;
     char m_MainPage[1024];
     char m_ChapterPage[1024];
     TCHAR m_BookName[256];
     char m_Host[1024];
     u64 m_UpdateTime;
+    u32 m_FoundTime;
     u32 m_IsFinished;
     BOOL m_IsLoading;
     int m_TagetIndex;
@@ -83,6 +153,29 @@ protected:
     olbook_checkupdate_callback m_cb;
     void* m_arg;
     BOOL m_IsCheck;
+    pieces_t m_Pieces; // downloaded chapters not merged into m_Text yet
+    std::vector<ol_chapter_entry_t> m_Entries; // chapter table of .ol file, same order as m_Chapters
+    u32 m_TableOffset; // 0: file is not in current format
+    u32 m_TableSize;
+    int m_TableChapters; // chapters in the table, the others are in the tail
+    u32 m_TailOffset; // 0: no tail
+    int m_TailChapters; // chapters in the table and the tail, the entries of others are not in file
+    u32 m_TailSize;
+    u32 m_GarbageSize;
+    std::vector<u64> m_ChapterHash; // title and url of the last chapter list, same order as m_Chapters
+    int m_PrefetchAhead; // in reading direction
+    int m_PrefetchBehind;
+    int m_Direction; // 1: forward, -1: backward
+    BOOL m_IsFast;
+    int m_LastChapter;
+    DWORD m_LastChapterTime;
+    int m_MissIndex; // last chapter the reader had to wait for
+    u32 m_PrefetchHit;
+    u32 m_PrefetchMiss;
+    BOOL m_IsDownloading; // saved in .ol header
+    int m_DownloadCursor; // next chapter to check
+    int m_DownloadFailed;
+    DWORD m_DownloadTime; // last download request
 };
 
 #endif
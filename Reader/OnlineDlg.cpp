@@ -277,14 +277,10 @@ static unsigned int RequestQueryCompleter(request_result_t *result)
     if (!Utils::is_utf8(html, htmllen)) // fixed bug, focus check encode
 #endif
     {
-        wchar_t* tempbuf = NULL;
-        int templen = 0;
         char* utf8buf = NULL;
         int utf8len = 0;
         // convert 'gbk' to 'utf-8'
-        tempbuf = Utils::ansi_to_utf16_ex(html, htmllen, &templen);
-        utf8buf = Utils::utf16_to_utf8_ex(tempbuf, templen, &utf8len);
-        free(tempbuf);
+        utf8buf = Utils::ansi_to_utf8_ex(html, htmllen, &utf8len);
         if (needfree)
         {
             free(html);
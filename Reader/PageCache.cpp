@@ -10,14 +10,18 @@ PageCache::PageCache()
     : m_Text(NULL)
     , m_TextLength(0)
     , m_OnePageLineCount(0)
+    , m_PageLineCount(0)
     , m_CurPageSize(0)
     , m_CurrentLine(0)
     , m_CurrentPos(NULL)
+    , m_charGap(NULL)
     , m_lineGap(NULL)
     , m_InternalBorder(NULL)
     , m_LeftLineCount(NULL)
     , m_WordWrap(NULL)
     , m_LineIndent(NULL)
+    , m_Advances(NULL)
+    , m_AdvanceSize(0)
 #if ENABLE_TAG
     , m_tags(NULL)
 #endif
@@ -30,6 +34,11 @@ PageCache::PageCache()
 PageCache::~PageCache()
 {
     RemoveAllLine(TRUE);
+    if (m_Advances)
+    {
+        free(m_Advances);
+        m_Advances = NULL;
+    }
 }
 
 #if ENABLE_TAG
@@ -152,9 +161,20 @@ Bitmap * PageCache::GetCover(void)
     return epub->GetCoverImage();
 }
 
+Bitmap * PageCache::GetCover(INT w, INT h)
+{
+    EpubBook *epub = NULL;
+
+    if (!GetCover())
+        return NULL;
+    epub = dynamic_cast<EpubBook *>(this);
+    return epub->GetCoverImage(w, h);
+}
+
 BOOL PageCache::DrawCover(HDC hdc)
 {
     Gdiplus::Bitmap *cover = NULL;
+    Gdiplus::Bitmap *scaled = NULL;
     Gdiplus::Graphics *g = NULL;
     int w,h,bw,bh;
     double d,bd;
@@ -200,30 +220,63 @@ BOOL PageCache::DrawCover(HDC hdc)
     dst.Width = bw;
     dst.Height = bh;
     g = new Gdiplus::Graphics(hdc);
-    g->SetInterpolationMode(InterpolationModeHighQualityBicubic);
-    g->DrawImage(cover, dst, src.X, src.Y, src.Width, src.Height, UnitPixel);
+    // scaled once for this size, no resampling when the page is drawn
+    scaled = GetCover(bw, bh);
+    if (scaled)
+    {
+        g->SetInterpolationMode(InterpolationModeNearestNeighbor);
+        g->DrawImage(scaled, dst.X, dst.Y, dst.Width, dst.Height);
+    }
+    else
+    {
+        g->SetInterpolationMode(InterpolationModeHighQualityBicubic);
+        g->DrawImage(cover, dst, src.X, src.Y, src.Width, src.Height, UnitPixel);
+    }
     delete g;
     return TRUE;
 }
 
 void PageCache::DrawPage(HWND hWnd, HDC hdc)
+{
+    GdiTextSink sink(hdc);
+#if TEST_MODEL
+    RecordTextSink record(&sink);
+
+    DrawPage(hWnd, hdc, &record);
+    UnitTest4(hdc, &record);
+#else
+    DrawPage(hWnd, hdc, &sink);
+#endif
+}
+
+void PageCache::DrawPage(HWND hWnd, HDC hdc, TextSink *sink)
 {
     int i;
     int h;
     line_info_t *line;
     RECT rect;
-    int j;
-    SIZE sz = { 0 };
+    INT *dx;
+    INT maxw;
+#if !ENABLE_TAG
+    page_layout_t layout;
+#endif
 #if ENABLE_TAG
+    int j, k, n;
+    GdiCharMetrics tagmetrics;
 	HFONT tagfonts[MAX_TAG_COUNT] = {0};
 #endif	
 
+    MergeText();
+
     if (!IsValid())
         return;
 
     if (!OnDrawPageEvent(hWnd))
         return;
 
+    // glyph widths of current font, rebuild when font or char gap changed
+    m_GlyphCache.Bind(hdc, m_charGap ? *m_charGap : 0);
+
 #if ENABLE_TAG
     for (i=0; i<MAX_TAG_COUNT; i++)
     {
@@ -237,14 +290,27 @@ void PageCache::DrawPage(HWND hWnd, HDC hdc)
     h = GetLineHeight(hdc);
 #endif
     m_OnePageLineCount = (m_Rect.bottom - m_Rect.top + (*m_lineGap) - (m_InternalBorder->top + m_InternalBorder->bottom)) / h;
+    m_PageLineCount = m_OnePageLineCount;
+    maxw = m_Rect.right - m_Rect.left - (m_InternalBorder->left + m_InternalBorder->right);
+
+#if !ENABLE_TAG
+    // paginate whole book in background, restart when text, font or layout changed
+    memset(&layout, 0, sizeof(layout));
+    memcpy(&layout.font, m_GlyphCache.GetFont(), sizeof(LOGFONT));
+    layout.max_width = maxw;
+    layout.char_gap = m_charGap ? *m_charGap : 0;
+    layout.word_wrap = *m_WordWrap;
+    layout.line_indent = m_LineIndent ? *m_LineIndent : 0;
+    m_PageIndex.Start(hWnd, m_Text, m_TextLength, &layout);
+#endif
 
     if (m_PageInfo.line_size == 0 || m_CurrentLine < 0 
         || (m_PageInfo.line_info[m_PageInfo.line_size - 1].start + m_PageInfo.line_info[m_PageInfo.line_size - 1].length != m_TextLength && m_CurrentLine + m_OnePageLineCount >= m_PageInfo.line_size))
     {
 #if ENABLE_TAG
-        LoadPageInfo(hdc, m_Rect.right - m_Rect.left - (m_InternalBorder->left + m_InternalBorder->right), m_OnePageLineCount, tagfonts);
+        LoadPageInfo(hdc, maxw, m_OnePageLineCount, tagfonts);
 #else
-        LoadPageInfo(hdc, m_Rect.right - m_Rect.left - (m_InternalBorder->left + m_InternalBorder->right), m_OnePageLineCount);
+        LoadPageInfo(hdc, maxw, m_OnePageLineCount);
 #endif
     }
     if (m_PageInfo.line_size == 0) // fixed bug
@@ -272,11 +338,15 @@ void PageCache::DrawPage(HWND hWnd, HDC hdc)
             rect.left = m_InternalBorder->left + GetIndentWidth(hdc);
         else
             rect.left = m_InternalBorder->left;
+        rect.left += (*m_charGap) / 2;
 #if ENABLE_TAG
-        for (j=0; j<line->length; j++)
+        // one run for each same-style chars
+        for (j = 0; j < line->length; j = k)
         {
             int tagid = IsTag(j+line->start);
-            rect.left += (*m_charGap) / 2;
+            for (k = j + 1; k < line->length && IsTag(k+line->start) == tagid; k++)
+                ;
+            dx = GetAdvances(m_Text + line->start + j, k - j);
             if (tagid >= 0 && tagid < MAX_TAG_COUNT)
             {
                 COLORREF oldcolor = SetBkColor(hdc, m_tags[tagid].bg_color);
@@ -284,8 +354,14 @@ void PageCache::DrawPage(HWND hWnd, HDC hdc)
                 HFONT oldfont = (HFONT)SelectObject(hdc, tagfonts[tagid]);
                 int oldmode = SetBkMode(hdc, OPAQUE);
 
-                TextOut(hdc, rect.left, rect.top, m_Text + j + line->start, 1);
-                GetTextExtentPoint32(hdc, m_Text+j+line->start, 1, &sz);
+                // tag font is not in glyph cache
+                tagmetrics.SetDC(hdc);
+                if (tagmetrics.GetCharWidths(m_Text + line->start + j, k - j, (LONG *)dx))
+                {
+                    for (n = 0; n < k - j; n++)
+                        dx[n] += (*m_charGap);
+                }
+                sink->DrawRun(rect.left, rect.top, m_Text + line->start + j, k - j, dx);
                 SetBkColor(hdc, oldcolor);
                 SetTextColor(hdc, oldfontcolor);
                 SelectObject(hdc, oldfont);
@@ -293,21 +369,16 @@ void PageCache::DrawPage(HWND hWnd, HDC hdc)
             }
             else
             {
-                TextOut(hdc, rect.left, rect.top, m_Text + j + line->start, 1);
-                GetTextExtentPoint32(hdc, m_Text+j+line->start, 1, &sz);
+                sink->DrawRun(rect.left, rect.top, m_Text + line->start + j, k - j, dx);
             }
-            rect.left += sz.cx;
-            rect.left += (*m_charGap) - ((*m_charGap) / 2);
+            for (n = 0; n < k - j; n++)
+                rect.left += dx[n];
         }
 #else
-        for (j = 0; j < line->length; j++)
-        {
-            GetTextExtentPoint32(hdc, m_Text + line->start + j, 1, &sz);
-            rect.left += (*m_charGap) / 2;
-            TextOut(hdc, rect.left, rect.top, m_Text + line->start + j, 1);
-            rect.left += sz.cx;
-            rect.left += (*m_charGap) - ((*m_charGap) / 2);
-        }
+        // one run for the whole line, char gap is in the advances
+        dx = GetAdvances(m_Text + line->start, line->length);
+        if (dx)
+            sink->DrawRun(rect.left, rect.top, m_Text + line->start, line->length, dx);
 #endif
         rect.top += h;
         m_CurPageSize += line->length;
@@ -363,15 +434,84 @@ double PageCache::GetProgress(void)
         return 0.0f;
     if (m_TextLength == 0)
         return 0.0f;
+    // line based when whole book is paginated
+    if (m_PageIndex.IsCompleted())
+    {
+        INT line = m_PageIndex.FindLine(*m_CurrentPos);
+        INT count = m_PageIndex.GetLineCount();
+        if (line >= 0 && count > 0)
+        {
+            if (IsLastPage() || line + m_OnePageLineCount >= count)
+                return 100.0;
+            return (double)(line + m_OnePageLineCount)*100.0/count;
+        }
+    }
     return (double)((*m_CurrentPos) + m_CurPageSize)*100.0/m_TextLength;
 }
 
+BOOL PageCache::GetPageNumber(INT *page, INT *total)
+{
+    INT line, count, step;
+
+    if (!m_CurrentPos || !m_PageIndex.IsCompleted() || m_PageLineCount <= 0)
+        return FALSE;
+
+    line = m_PageIndex.FindLine(*m_CurrentPos);
+    count = m_PageIndex.GetLineCount();
+    if (line < 0 || count <= 0)
+        return FALSE;
+
+    step = GetPageStep();
+    if (count <= m_PageLineCount)
+        *total = 1;
+    else
+        *total = 1 + (count - m_PageLineCount + step - 1) / step;
+    if (IsLastPage())
+        *page = *total;
+    else
+        *page = line / step + 1;
+    if (*page > *total)
+        *page = *total;
+    return TRUE;
+}
+
+void PageCache::JumpProgress(HWND hWnd, double progress)
+{
+    INT line, count;
+    INT start, length, indent;
+
+    if (!m_CurrentPos || m_TextLength <= 0)
+        return;
+
+    // jump to the start of line when whole book is paginated
+    count = m_PageIndex.GetLineCount();
+    if (m_PageIndex.IsCompleted() && count > 0)
+    {
+        line = (INT)(progress * count / 100);
+        if (line >= count)
+            line = count - 1;
+        if (m_PageIndex.GetLine(line, &start, &length, &indent))
+        {
+            (*m_CurrentPos) = start;
+            Reset(hWnd);
+            return;
+        }
+    }
+
+    (*m_CurrentPos) = (INT)(progress * m_TextLength / 100);
+    if ((*m_CurrentPos) >= m_TextLength)
+        (*m_CurrentPos) = m_TextLength - 1;
+    Reset(hWnd);
+}
+
 BOOL PageCache::GetCurPageText(TCHAR **text)
 {
     int newlinecount = 0;
     TCHAR *c = NULL;
     int i,j;
 
+    MergeText();
+
     if (m_CurPageSize > 0)
     {
         for (i=0; i<m_CurPageSize; i++)
@@ -433,6 +573,7 @@ BOOL PageCache::SetCurPageText(HWND hWnd, TCHAR *dst_text)
             memcpy(text, m_Text, sizeof(TCHAR) * (*m_CurrentPos));
         memcpy(text+(*m_CurrentPos), dst_text, sizeof(TCHAR) * dst_len);
         memcpy(text+(*m_CurrentPos)+dst_len, m_Text+(*m_CurrentPos)+m_CurPageSize, sizeof(TCHAR) * (m_TextLength-(*m_CurrentPos)-m_CurPageSize));
+        m_PageIndex.Stop();
         free(m_Text);
         m_Text = text;
         m_TextLength = len;
@@ -506,20 +647,46 @@ INT PageCache::GetCahceUnitSize(HDC hdc, INT hcnt)
 {
     SIZE sz = { 0 };
     INT wcnt;
-    GetTextExtentPoint32(hdc, _T("."), 1, &sz);
+    sz.cx = m_GlyphCache.GetWidth(_T('.'));
     if (sz.cx == 0)
         sz.cx = 1;
     wcnt = (m_Rect.right - m_Rect.left) / (sz.cx + (*m_charGap));
     return wcnt * hcnt;
 }
 
+INT * PageCache::GetAdvances(const wchar_t *text, INT len)
+{
+    INT i;
+
+    if (len <= 0)
+        return NULL;
+
+    if (m_AdvanceSize < len)
+    {
+        m_AdvanceSize = len;
+        m_Advances = (INT *)realloc(m_Advances, m_AdvanceSize * sizeof(INT));
+    }
+    for (i = 0; i < len; i++)
+    {
+        m_Advances[i] = m_GlyphCache.GetAdvance(text[i]);
+    }
+    return m_Advances;
+}
+
+INT PageCache::GetPageStep(void)
+{
+    INT step = m_PageLineCount;
+
+    if (m_LeftLineCount)
+        step -= (*m_LeftLineCount);
+    return step > 0 ? step : 1;
+}
+
 LONG PageCache::GetIndentWidth(HDC hdc)
 {
-    SIZE sz = { 0 };
     TCHAR buf[3] = { 0x3000, 0x3000, 0 };
 
-    GetTextExtentPoint32(hdc, buf, 2, &sz);
-    return sz.cx;
+    return m_GlyphCache.GetTextWidth(buf, 2);
 }
 
 #define is_space_indent(c) (c == 0x20 || c == 0x3000 || c == 0xA0 || c == 0x09 || c == 0x0A || c == 0x0B || c == 0x0C /*|| c == 0x0D*/)
@@ -563,6 +730,11 @@ void PageCache::LoadPageInfo(HDC hdc, INT maxw, INT hcnt)
     int word_width;
     BOOL indent = FALSE;
 
+#if !ENABLE_TAG
+    if (LoadPageInfoFromIndex(hcnt))
+        return;
+#endif
+
     // pageup/lineup:         [pos1, pos2)
     // already in cache page: [pos2, pos3)
     // pagedown/linedown:     [pos3, pos4)
@@ -636,10 +808,10 @@ void PageCache::LoadPageInfo(HDC hdc, INT maxw, INT hcnt)
             }
             else
             {
-                GetTextExtentPoint32(hdc, &m_Text[i], 1, &sz);
+                sz.cx = m_GlyphCache.GetWidth(m_Text[i]);
             }
 #else
-            GetTextExtentPoint32(hdc, &m_Text[i], 1, &sz);
+            sz.cx = m_GlyphCache.GetWidth(m_Text[i]);
 #endif
 
             if (*m_WordWrap)
@@ -676,7 +848,7 @@ void PageCache::LoadPageInfo(HDC hdc, INT maxw, INT hcnt)
                                 i++;
                                 continue;
                             }
-                            GetTextExtentPoint32(hdc, &m_Text[i], 1, &sz);
+                            sz.cx = m_GlyphCache.GetWidth(m_Text[i]);
                             break;
                         }
 
@@ -823,10 +995,10 @@ void PageCache::LoadPageInfo(HDC hdc, INT maxw, INT hcnt)
             }
             else
             {
-                GetTextExtentPoint32(hdc, &m_Text[i], 1, &sz);
+                sz.cx = m_GlyphCache.GetWidth(m_Text[i]);
             }
 #else
-            GetTextExtentPoint32(hdc, &m_Text[i], 1, &sz);
+            sz.cx = m_GlyphCache.GetWidth(m_Text[i]);
 #endif
 
             if (*m_WordWrap)
@@ -863,7 +1035,7 @@ void PageCache::LoadPageInfo(HDC hdc, INT maxw, INT hcnt)
                                 i++;
                                 continue;
                             }
-                            GetTextExtentPoint32(hdc, &m_Text[i], 1, &sz);
+                            sz.cx = m_GlyphCache.GetWidth(m_Text[i]);
                             break;
                         }
 
@@ -955,6 +1127,75 @@ void PageCache::LoadPageInfo(HDC hdc, INT maxw, INT hcnt)
     }
 }
 
+BOOL PageCache::LoadPageInfoFromIndex(INT hcnt)
+{
+    INT count, anchor, target, begin, end, i;
+    INT start, length, indent;
+
+    count = m_PageIndex.GetLineCount();
+    if (count <= 0 || hcnt <= 0)
+        return FALSE;
+
+    // find target line in index, cached lines may not be loaded from index
+    if (m_PageInfo.line_size > 0)
+    {
+        anchor = m_CurrentLine < 0 ? 0 : m_CurrentLine;
+        if (anchor >= m_PageInfo.line_size)
+            anchor = m_PageInfo.line_size - 1;
+        target = m_PageIndex.FindLine(m_PageInfo.line_info[anchor].start);
+        if (target < 0)
+            return FALSE;
+        target += m_CurrentLine - anchor;
+    }
+    else
+    {
+        target = m_PageIndex.FindLine(*m_CurrentPos);
+        if (target < 0)
+            return FALSE;
+    }
+
+    // same as lineup in cache
+    if (m_CurrentLine < 0)
+    {
+        if (GetCover())
+        {
+            if (target < 1)
+                target = (*m_CurrentPos) == 1 ? 0 : 1;
+        }
+        else
+        {
+            if (target < 0)
+                target = 0;
+        }
+    }
+    if (target >= count)
+    {
+        if (!m_PageIndex.IsCompleted())
+            return FALSE;
+        target = count - 1;
+    }
+
+    // [target - hcnt, target + 2 * hcnt)
+    begin = target > hcnt ? target - hcnt : 0;
+    end = target + 2 * hcnt;
+    if (end > count)
+    {
+        if (!m_PageIndex.IsCompleted())
+            return FALSE;
+        end = count;
+    }
+
+    RemoveAllLine();
+    for (i = begin; i < end; i++)
+    {
+        if (!m_PageIndex.GetLine(i, &start, &length, &indent))
+            break;
+        AddLine(start, length, indent);
+    }
+    m_CurrentLine = target - begin;
+    return TRUE;
+}
+
 void PageCache::AddLine(INT start, INT length, BOOL indent, INT pos)
 {
     const int UNIT_SIZE = 1024;
@@ -1022,6 +1263,11 @@ BOOL PageCache::IsValid(void)
     return TRUE;
 }
 
+void PageCache::MergeText(void)
+{
+    // m_Text is always contiguous here, OnlineBook keeps inserted chapters aside until the text is read
+}
+
 bool PageCache::OnDrawPageEvent(HWND hWnd)
 {
     return true;
@@ -1088,4 +1334,67 @@ void PageCache::UnitTest2(void)
         }
     }
 #endif
+}
+
+// runs must put every char where the per-char layout did: gap/2 offset, then width + gap
+void PageCache::UnitTest4(HDC hdc, RecordTextSink *record)
+{
+#if TEST_MODEL
+    const std::vector<RecordTextSink::run_t> &runs = record->GetRuns();
+    line_info_t *line;
+    SIZE sz = { 0 };
+    int i, j, r = 0, n = 0;
+    LONG x, y = 0, h = 0;
+    INT gap = m_charGap ? *m_charGap : 0;
+
+    if (runs.empty()) // cover page or nothing is drawn
+        return;
+    for (i = 0; i < m_OnePageLineCount && m_CurrentLine + i < m_PageInfo.line_size; i++)
+    {
+        line = &m_PageInfo.line_info[m_CurrentLine + i];
+        if (line->length == 0)
+            continue;
+        x = m_InternalBorder->left + (line->indent ? GetIndentWidth(hdc) : 0) + gap / 2;
+        for (j = 0; j < line->length; j++)
+        {
+            if (n == (int)runs[r].dx.size())
+            {
+                r++;
+                n = 0;
+            }
+            assert(r < (int)runs.size());
+            if (j == 0)
+            {
+                // lines are evenly spaced from the top border
+                y = runs[r].y;
+                if (i == 0)
+                {
+                    assert(y == m_InternalBorder->top);
+                }
+                else if (h == 0)
+                {
+                    assert((y - m_InternalBorder->top) % i == 0);
+                    h = (y - m_InternalBorder->top) / i;
+                }
+                assert(y == m_InternalBorder->top + i * h);
+            }
+            if (n == 0)
+            {
+                assert(runs[r].x == x);
+            }
+            assert(runs[r].y == y);
+            assert(runs[r].text + n == m_Text + line->start + j);
+            GetTextExtentPoint32(hdc, m_Text + line->start + j, 1, &sz);
+#if ENABLE_TAG
+            // tag font is not selected now
+            if (IsTag(line->start + j) >= 0)
+                sz.cx = runs[r].dx[n] - gap;
+#endif
+            assert(runs[r].dx[n] == sz.cx + gap);
+            x += sz.cx + gap;
+            n++;
+        }
+    }
+    assert(r == (int)runs.size() - 1 && n == (int)runs[r].dx.size());
+#endif
 }
\ No newline at end of file
@@ -2,6 +2,9 @@
 #define __PAGE_CACHE_H__
 
 #include "types.h"
+#include "GlyphCache.h"
+#include "TextSink.h"
+#include "PageIndex.h"
 
 typedef struct line_info_t
 {
@@ -38,12 +41,15 @@ public:
     void LineUp(HWND hWnd, INT n);
     void LineDown(HWND hWnd, INT n);
     void DrawPage(HWND hWnd, HDC hdc);
+    void DrawPage(HWND hWnd, HDC hdc, TextSink *sink);
     INT GetCurPageSize(void);
     INT GetTextLength(void);
     BOOL IsFirstPage(void);
     BOOL IsLastPage(void);
     BOOL IsCoverPage(void);
     double GetProgress(void);
+    BOOL GetPageNumber(INT *page, INT *total);
+    void JumpProgress(HWND hWnd, double progress);
     BOOL GetCurPageText(TCHAR **text);
     BOOL SetCurPageText(HWND hWnd, TCHAR *text);
 
@@ -54,6 +60,7 @@ protected:
     LONG GetLineHeight(HDC hdc);
 #endif
     INT GetCahceUnitSize(HDC hdc, INT hcnt);
+    INT *GetAdvances(const wchar_t *text, INT len);
     LONG GetIndentWidth(HDC hdc);
     VOID SetIndent(HDC hdc, INT index, BOOL *indent, LONG* width);
 #if ENABLE_TAG
@@ -61,26 +68,32 @@ protected:
 #else
     void LoadPageInfo(HDC hdc, INT maxw, INT hcnt);
 #endif
+    BOOL LoadPageInfoFromIndex(INT hcnt);
+    INT GetPageStep(void);
     void AddLine(INT start, INT length, BOOL indent, INT pos = -1);
     void RemoveAllLine(BOOL freemem = FALSE);
     BOOL IsValid(void);
     Bitmap * GetCover(void);
+    Bitmap * GetCover(INT w, INT h);
     BOOL DrawCover(HDC hdc);
 #if ENABLE_TAG
     int IsTag(int index);
 #endif
+    virtual void MergeText(void);
     virtual bool OnDrawPageEvent(HWND hWnd);
     virtual bool OnLineUpDownEvent(HWND hWnd, BOOL up, int n);
 
 protected:
     void UnitTest1(void);
     void UnitTest2(void);
+    void UnitTest4(HDC hdc, RecordTextSink *record);
 
 protected:
     wchar_t * m_Text;
     INT m_TextLength;
     RECT m_Rect;
     INT m_OnePageLineCount;
+    INT m_PageLineCount; // m_OnePageLineCount is 1 for cover page
     INT m_CurPageSize;
     INT m_CurrentLine;
     INT *m_CurrentPos;
@@ -91,6 +104,10 @@ protected:
     INT *m_WordWrap;
     INT *m_LineIndent;
     page_info_t m_PageInfo;
+    GlyphCache m_GlyphCache;
+    INT *m_Advances;
+    INT m_AdvanceSize;
+    PageIndex m_PageIndex;
 #if ENABLE_TAG
     tagitem_t *m_tags;
 #endif
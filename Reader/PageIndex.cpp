@@ -0,0 +1,356 @@
+#include "stdafx.h"
+#include "PageIndex.h"
+#include <process.h>
+
+
+PageIndex::PageIndex()
+    : m_hWnd(NULL)
+    , m_hThread(NULL)
+    , m_bCancel(FALSE)
+    , m_Completed(0)
+    , m_ReadyCount(0)
+    , m_LineCount(0)
+    , m_Blocks(NULL)
+    , m_BlockCount(0)
+    , m_Text(NULL)
+    , m_TextLength(0)
+{
+    memset(&m_Layout, 0, sizeof(m_Layout));
+}
+
+PageIndex::~PageIndex()
+{
+    Stop();
+}
+
+BOOL PageIndex::Start(HWND hWnd, const wchar_t *text, INT len, const page_layout_t *layout)
+{
+    // already paginating or paginated with the same text and layout
+    if (m_hThread && m_Text == text && m_TextLength == len && 0 == memcmp(&m_Layout, layout, sizeof(page_layout_t)))
+        return TRUE;
+
+    Stop();
+    if (!text || len <= 0 || layout->max_width <= 0)
+        return FALSE;
+
+    // every line has one char at least
+    m_BlockCount = (len >> BLOCK_BITS) + 2;
+    m_Blocks = (UINT **)malloc(m_BlockCount * sizeof(UINT *));
+    if (!m_Blocks)
+    {
+        m_BlockCount = 0;
+        return FALSE;
+    }
+    memset(m_Blocks, 0, m_BlockCount * sizeof(UINT *));
+
+    m_hWnd = hWnd;
+    m_Text = text;
+    m_TextLength = len;
+    memcpy(&m_Layout, layout, sizeof(page_layout_t));
+    m_bCancel = FALSE;
+    m_hThread = (HANDLE)_beginthreadex(NULL, 0, PaginateThread, this, 0, NULL);
+    if (!m_hThread)
+    {
+        Stop();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void PageIndex::Stop(void)
+{
+    INT i;
+
+    if (m_hThread)
+    {
+        m_bCancel = TRUE;
+        WaitForSingleObject(m_hThread, INFINITE);
+        CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+    if (m_Blocks)
+    {
+        for (i = 0; i < m_BlockCount; i++)
+        {
+            if (m_Blocks[i])
+                free(m_Blocks[i]);
+        }
+        free(m_Blocks);
+        m_Blocks = NULL;
+    }
+    m_BlockCount = 0;
+    m_LineCount = 0;
+    m_ReadyCount = 0;
+    m_Completed = 0;
+    m_bCancel = FALSE;
+    m_Text = NULL;
+    m_TextLength = 0;
+    memset(&m_Layout, 0, sizeof(m_Layout));
+}
+
+BOOL PageIndex::IsCompleted(void)
+{
+    return m_Completed ? TRUE : FALSE;
+}
+
+INT PageIndex::GetLineCount(void)
+{
+    return m_ReadyCount;
+}
+
+BOOL PageIndex::GetLine(INT index, INT *start, INT *length, INT *indent)
+{
+    BOOL completed = IsCompleted();
+    INT count = m_ReadyCount;
+    UINT entry;
+    INT end;
+
+    if (index < 0 || index >= count)
+        return FALSE;
+
+    entry = GetEntry(index);
+    if (index + 1 < count || !completed)
+        end = (INT)(GetEntry(index + 1) & ~INDENT_FLAG);
+    else
+        end = m_TextLength;
+
+    *start = (INT)(entry & ~INDENT_FLAG);
+    *length = end - *start;
+    *indent = (entry & INDENT_FLAG) ? TRUE : FALSE;
+    return TRUE;
+}
+
+INT PageIndex::FindLine(INT pos)
+{
+    INT count = m_ReadyCount;
+    INT low, high, mid;
+    INT start, length, indent;
+
+    if (count <= 0 || pos < 0)
+        return -1;
+
+    // not paginated yet
+    if (!GetLine(count - 1, &start, &length, &indent) || pos >= start + length)
+        return -1;
+
+    // the last line which start <= pos
+    low = 0;
+    high = count - 1;
+    while (low < high)
+    {
+        mid = low + (high - low + 1) / 2;
+        if ((INT)(GetEntry(mid) & ~INDENT_FLAG) <= pos)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+unsigned __stdcall PageIndex::PaginateThread(void* pArguments)
+{
+    PageIndex *_this = (PageIndex *)pArguments;
+    GdiCharMetrics metrics;
+    GlyphCache cache;
+    HDC hdc = NULL;
+    HFONT hFont = NULL;
+    HFONT hOldFont = NULL;
+
+    // gdi objects of ui thread can't be used here, measure with own dc
+    hdc = CreateCompatibleDC(NULL);
+    if (!hdc)
+        return 0;
+    hFont = CreateFontIndirect(&_this->m_Layout.font);
+    if (!hFont)
+        goto end;
+    hOldFont = (HFONT)SelectObject(hdc, hFont);
+
+    metrics.SetDC(hdc);
+    cache.Bind(&_this->m_Layout.font, _this->m_Layout.char_gap, &metrics);
+    if (_this->Paginate(&cache))
+    {
+        InterlockedExchange(&_this->m_ReadyCount, _this->m_LineCount);
+        InterlockedExchange(&_this->m_Completed, 1);
+        PostMessage(_this->m_hWnd, WM_UPDATE_PAGES, 0, NULL);
+    }
+
+end:
+    if (hOldFont)
+        SelectObject(hdc, hOldFont);
+    if (hFont)
+        DeleteObject(hFont);
+    DeleteDC(hdc);
+    return 0;
+}
+
+#define is_space_indent(c) (c == 0x20 || c == 0x3000 || c == 0xA0 || c == 0x09 || c == 0x0A || c == 0x0B || c == 0x0C /*|| c == 0x0D*/)
+#define is_space(c) (c == 0x20 || c == 0x09 /*|| c == 0x0A*/ || c == 0x0B || c == 0x0C /*|| c == 0x0D*/)
+#define is_minus(c) (c == 0x2D /* - */)
+
+// same line breaking as PageCache::LoadPageInfo, from the beginning of text
+BOOL PageIndex::Paginate(GlyphCache *cache)
+{
+    const wchar_t *text = m_Text;
+    INT len = m_TextLength;
+    INT maxw = m_Layout.max_width;
+    INT gap = m_Layout.char_gap;
+    TCHAR buf[3] = { 0x3000, 0x3000, 0 };
+    LONG indent_width;
+    INT i;
+    INT start;
+    LONG width;
+    LONG cx = 0;
+    int word_start_pos;
+    int word_width;
+    BOOL indent = FALSE;
+
+    indent_width = cache->GetTextWidth(buf, 2);
+    start = 0;
+    width = 0;
+    word_start_pos = start;
+    word_width = 0;
+    SetIndent(-1, &indent, &width, indent_width);
+    for (i = 0; i < len; i++)
+    {
+        if (m_bCancel)
+            return FALSE;
+
+        if (text[i] == 0x0A)
+        {
+            if (!AddLine(start, indent))
+                return FALSE;
+            start = i + 1;
+            width = 0;
+            SetIndent(i, &indent, &width, indent_width);
+            word_start_pos = start;
+            word_width = 0;
+            continue;
+        }
+
+        cx = cache->GetWidth(text[i]);
+        if (m_Layout.word_wrap)
+        {
+            if (is_space(text[i]) || is_minus(text[i]))
+            {
+                word_start_pos = i + 1;
+                word_width = 0;
+            }
+            else
+            {
+                word_width += cx + gap;
+            }
+        }
+
+        width += cx + gap;
+        if (width > maxw)
+        {
+            if (m_Layout.word_wrap)
+            {
+                if (is_space(text[i])) // add left space
+                {
+                    cx = 0;
+                    for (; i < len; i++)
+                    {
+                        if (is_space(text[i]))
+                            continue;
+                        cx = cache->GetWidth(text[i]);
+                        break;
+                    }
+
+                    if (!AddLine(start, indent))
+                        return FALSE;
+                    start = i;
+                    width = i == len ? 0 : cx + gap;
+                    word_start_pos = start;
+                    word_width = width;
+                    SetIndent(i, &indent, &width, indent_width);
+                }
+                else if (word_start_pos == start) // too long word
+                {
+                    if (!AddLine(start, indent))
+                        return FALSE;
+                    start = i;
+                    width = cx + gap;
+                    word_start_pos = start;
+                    word_width = width;
+                    SetIndent(i, &indent, &width, indent_width);
+                }
+                else
+                {
+                    // move current word to next line
+                    if (!AddLine(start, indent))
+                        return FALSE;
+                    start = word_start_pos;
+                    width = word_width;
+                    word_start_pos = start;
+                    word_width = width;
+                    SetIndent(i, &indent, &width, indent_width);
+
+                    if (width > maxw) // goto -> [too long word]
+                    {
+                        if (!AddLine(start, indent))
+                            return FALSE;
+                        start = i;
+                        width = cx + gap;
+                        word_start_pos = start;
+                        word_width = width;
+                        SetIndent(i, &indent, &width, indent_width);
+                    }
+                }
+            }
+            else
+            {
+                if (!AddLine(start, indent))
+                    return FALSE;
+                start = i;
+                width = cx + gap;
+                SetIndent(i, &indent, &width, indent_width);
+            }
+        }
+    }
+    if (start < len)
+    {
+        if (!AddLine(start, indent))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+void PageIndex::SetIndent(INT index, BOOL *indent, LONG *width, LONG indent_width)
+{
+    *indent = FALSE;
+    if (m_Layout.line_indent && index >= 0 && index < m_TextLength)
+    {
+        if (m_Text[index] == 0x0A
+            && (index < m_TextLength - 1 && !is_space_indent(m_Text[index + 1])))
+        {
+            *indent = TRUE;
+            *width += indent_width;
+        }
+    }
+}
+
+BOOL PageIndex::AddLine(INT start, BOOL indent)
+{
+    INT block = m_LineCount >> BLOCK_BITS;
+
+    if (block >= m_BlockCount)
+        return FALSE;
+    if (!m_Blocks[block])
+    {
+        m_Blocks[block] = (UINT *)malloc(BLOCK_SIZE * sizeof(UINT));
+        if (!m_Blocks[block])
+            return FALSE;
+    }
+    m_Blocks[block][m_LineCount & (BLOCK_SIZE - 1)] = (UINT)start | (indent ? INDENT_FLAG : 0);
+    m_LineCount++;
+
+    // the end of previous line is known now
+    InterlockedExchange(&m_ReadyCount, m_LineCount - 1);
+    return TRUE;
+}
+
+UINT PageIndex::GetEntry(INT index)
+{
+    return m_Blocks[index >> BLOCK_BITS][index & (BLOCK_SIZE - 1)];
+}
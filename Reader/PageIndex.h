@@ -0,0 +1,60 @@
+#ifndef __PAGE_INDEX_H__
+#define __PAGE_INDEX_H__
+
+#include "types.h"
+#include "GlyphCache.h"
+
+typedef struct page_layout_t
+{
+    LOGFONT font;
+    INT max_width;
+    INT char_gap;
+    INT word_wrap;
+    INT line_indent;
+} page_layout_t;
+
+// line start offsets of the whole book, built by a background thread.
+// lines are appended in fixed size blocks, so published lines never move while paginating.
+class PageIndex
+{
+public:
+    PageIndex();
+    virtual ~PageIndex();
+
+public:
+    BOOL Start(HWND hWnd, const wchar_t *text, INT len, const page_layout_t *layout);
+    void Stop(void);
+    BOOL IsCompleted(void);
+    INT GetLineCount(void);
+    BOOL GetLine(INT index, INT *start, INT *length, INT *indent);
+    INT FindLine(INT pos);
+
+protected:
+    static unsigned __stdcall PaginateThread(void* pArguments);
+    BOOL Paginate(GlyphCache *cache);
+    void SetIndent(INT index, BOOL *indent, LONG *width, LONG indent_width);
+    BOOL AddLine(INT start, BOOL indent);
+    UINT GetEntry(INT index);
+
+protected:
+    enum
+    {
+        BLOCK_BITS = 16,
+        BLOCK_SIZE = 1 << BLOCK_BITS,
+        INDENT_FLAG = 0x80000000
+    };
+
+    HWND m_hWnd;
+    HANDLE m_hThread;
+    volatile BOOL m_bCancel;
+    volatile LONG m_Completed;
+    volatile LONG m_ReadyCount; // lines which end is known
+    INT m_LineCount;
+    UINT **m_Blocks;
+    INT m_BlockCount;
+    const wchar_t *m_Text;
+    INT m_TextLength;
+    page_layout_t m_Layout;
+};
+
+#endif
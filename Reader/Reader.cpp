@@ -20,9 +20,13 @@
 #include <CommDlg.h>
 #include <commctrl.h>
 #include <vector>
+#include <algorithm>
 #ifdef _DEBUG
 #include "dump.h"
 #endif
+#if TEST_MODEL
+#include <assert.h>
+#endif
 
 #pragma comment(lib, "shlwapi.lib")
 #pragma comment(lib, "Comctl32.lib")
@@ -340,6 +344,15 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         case IDM_ONLINE:
             OpenOnlineDlg();
             break;
+        case IDM_DOWNLOAD:
+            if (_Book && !_Book->IsLoading() && _Book->GetBookType() == book_online)
+            {
+                if (((OnlineBook*)_Book)->IsDownloading())
+                    ((OnlineBook*)_Book)->StopDownload(hWnd);
+                else
+                    ((OnlineBook*)_Book)->StartDownload(hWnd);
+            }
+            break;
 #endif
 #if ENABLE_TAG
         case IDM_TAGSET:
@@ -538,6 +551,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
                     {
                         if (_Book)
                         {
+#ifdef ENABLE_NETWORK
+                            DropCheckBook(_Book);
+#endif
                             delete _Book;
                             _Book = NULL;
                         }
@@ -636,6 +652,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         // close book
         if (_Book)
         {
+#ifdef ENABLE_NETWORK
+            DropCheckBook(_Book);
+#endif
             delete _Book;
             _Book = NULL;
         }
@@ -989,6 +1008,11 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         case IDT_TIMER_CHECKBOOK:
             OnCheckBookUpdate(hWnd);
             break;
+        case IDT_TIMER_DOWNLOAD:
+            KillTimer(hWnd, IDT_TIMER_DOWNLOAD);
+            if (_Book && _Book->GetBookType() == book_online)
+                ((OnlineBook*)_Book)->Download(hWnd);
+            break;
 #endif
         case IDT_TIMER_LOADING:
             {
@@ -1014,6 +1038,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
     case WM_NEW_VERSION:
         DialogBox(hInst, MAKEINTRESOURCE(IDD_UPGRADE), hWnd, UpgradeProc);
         break;
+    case WM_CHECK_BOOK:
+        OnCheckBookDone(hWnd, (int)wParam, (UINT)lParam);
+        break;
 #endif
     case WM_OPEN_BOOK:
         OnOpenBookResult(hWnd, wParam == 1);
@@ -1024,12 +1051,18 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             if (_Book && (!be || _Book == be->_this))
                 _Book->OnBookEvent(hWnd, message, wParam, lParam);
 #ifdef ENABLE_NETWORK
-            else
+            else if (be)
             {
                 chkbook_arg_t* arg = GetCheckBookArguments();
-                book_event_data_t* be = (book_event_data_t*)lParam;
-                if (arg && arg->book && be && arg->book == be->_this)
-                    arg->book->OnBookEvent(hWnd, message, wParam, lParam);
+                std::list<chkbook_task_t*>::iterator itor;
+                for (itor = arg->running.begin(); itor != arg->running.end(); itor++)
+                {
+                    if ((*itor)->book && (*itor)->book == be->_this)
+                    {
+                        (*itor)->book->OnBookEvent(hWnd, message, wParam, lParam);
+                        break;
+                    }
+                }
             }
 #endif
         }
@@ -1037,6 +1070,9 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
     case WM_SAVE_CACHE:
         OnSave(hWnd);
         break;
+    case WM_UPDATE_PAGES:
+        UpdateProgess();
+        break;
     case WM_SYSTRAY:
         switch(lParam)
         {
@@ -1991,10 +2027,7 @@ INT_PTR CALLBACK JumpProgress(HWND hDlg, UINT message, WPARAM wParam, LPARAM lPa
                     }
                     if (_Book)
                     {
-                        _item->index = (int)(progress * _Book->GetTextLength() / 100);
-                        if (_item->index == _Book->GetTextLength())
-                            _item->index--;
-                        _Book->Reset(GetParent(hDlg));
+                        _Book->JumpProgress(GetParent(hDlg), progress);
                         Save(GetParent(hDlg));
                     }
                 }
@@ -2206,6 +2239,9 @@ LRESULT OnClearFileList(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
 
     if (_Book)
     {
+#ifdef ENABLE_NETWORK
+        DropCheckBook(_Book);
+#endif
         delete _Book;
         _Book = NULL;
     }
@@ -2885,6 +2921,8 @@ LRESULT OnAddMark(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         ret = MessageBox_(hWnd, IDS_ADD_BOOKMARK_TIPS, IDS_BOOKMARK, MB_ICONINFORMATION|MB_YESNO);
         if (ret == IDYES)
         {
+            if (_Book->GetBookType() == book_epub)
+                ((EpubBook*)_Book)->WaitFill(); // text of chapters parsed in background
             if (_Cache.add_mark(_item, _item->index))
             {
                 OnUpdateBookMark(hWnd);
@@ -3161,6 +3199,8 @@ LRESULT OnFindText(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         // do search
         if (!_Book)
             return 0;
+        if (_Book->GetBookType() == book_epub)
+            ((EpubBook*)_Book)->WaitFill(); // text of chapters parsed in background
         int len = _tcslen(szFindWhat);
         if (fr.Flags & FR_DIALOGTERM)
         {
@@ -3297,6 +3337,9 @@ LRESULT OnOpenBookResult(HWND hWnd, BOOL result)
     {
         _tcscpy(fileName, _Book->GetFileName());
         type = _Book->GetBookType() == book_online ? MB_RETRYCANCEL : MB_OK;
+#ifdef ENABLE_NETWORK
+        DropCheckBook(_Book);
+#endif
         delete _Book;
         _Book = NULL;
         if (IDRETRY == MessageBox_(hWnd, IDS_OPEN_FILE_FAILED, IDS_ERROR, type | MB_ICONERROR))
@@ -3420,9 +3463,6 @@ void OnOpenBook(HWND hWnd, TCHAR *filename, BOOL forced)
 #endif
     int size = 0;
     TCHAR szFileName[MAX_PATH] = {0};
-#ifdef ENABLE_NETWORK
-    chkbook_arg_t* arg = NULL;
-#endif
 
     _tcscpy(szFileName, filename);
     ext = PathFindExtension(szFileName);
@@ -3496,6 +3536,9 @@ void OnOpenBook(HWND hWnd, TCHAR *filename, BOOL forced)
 
     if (_Book)
     {
+#ifdef ENABLE_NETWORK
+        DropCheckBook(_Book);
+#endif
         delete _Book;
         _Book = NULL;
     }
@@ -3525,20 +3568,16 @@ void OnOpenBook(HWND hWnd, TCHAR *filename, BOOL forced)
         _Book->SetMd5(&md5);
 #endif
         _Book->SetFileName(szFileName);
+        ((EpubBook*)_Book)->SetStartPos(item ? item->index : 0);
         _Book->OpenBook(hWnd);
     }
 #ifdef ENABLE_NETWORK
     else if (_tcscmp(ext, _T(".ol")) == 0)
     {
-        arg = GetCheckBookArguments();
-        if (arg && arg->book && arg->book->GetBookType() == book_online
-            && 0 == _tcscmp(arg->book->GetFileName(), szFileName))
-        {
-            delete arg->book;
-            arg->book = NULL;
-        }
+        CancelCheckBook(szFileName);
         _Book = new OnlineBook;
         _Book->SetFileName(szFileName);
+        ((OnlineBook*)_Book)->SetPrefetch(_header->prefetch_ahead, _header->prefetch_behind);
         _Book->OpenBook(NULL, size, hWnd);
     }
 #endif
@@ -3553,7 +3592,8 @@ void OnOpenOlBook(HWND hWnd, void* olparam)
     static TCHAR oldir[MAX_PATH] = { 0 };
     TCHAR savepath[MAX_PATH] = { 0 };
     ol_book_param_t* param = (ol_book_param_t*)olparam;
-    ol_header_t olheader = { 0 };
+    ol_file_header_t olheader = { 0 };
+    ol_table_t oltable = { 0 };
     FILE* fp = NULL;
     int i;
     int ret;
@@ -3614,24 +3654,27 @@ void OnOpenOlBook(HWND hWnd, void* olparam)
         }
     }
 
-    // generate ol_header_t
-    olheader.header_size = sizeof(ol_header_t) - sizeof(ol_chapter_info_t);
-    olheader.book_name_offset = olheader.header_size;
-    olheader.header_size += (_tcslen(param->book_name) + 1) * sizeof(TCHAR);
-    olheader.main_page_offset = olheader.header_size;
-    olheader.header_size += (strlen(param->main_page) + 1) * sizeof(char);
-    olheader.host_offset = olheader.header_size;
-    olheader.header_size += (strlen(param->host) + 1) * sizeof(char);
+    // generate ol_table_t without chapters
+    oltable.book_name_offset = offsetof(ol_table_t, chapter_list);
+    oltable.main_page_offset = oltable.book_name_offset + (_tcslen(param->book_name) + 1) * sizeof(TCHAR);
+    oltable.host_offset = oltable.main_page_offset + (strlen(param->main_page) + 1) * sizeof(char);
+    oltable.chapter_size = 0;
+
+    // generate ol_file_header_t
+    olheader.magic = OL_FILE_MAGIC;
+    olheader.version = OL_FILE_VERSION;
     olheader.update_time = 0;
     olheader.is_finished = param->is_finished;
-    olheader.chapter_size = 0;
+    olheader.table_offset = sizeof(ol_file_header_t);
+    olheader.table_size = oltable.host_offset + (strlen(param->host) + 1) * sizeof(char);
 
     // write file
     fp = _tfopen(savepath, _T("wb"));
-    fwrite(&olheader, 1, olheader.book_name_offset, fp);
-    fwrite(param->book_name, 1, olheader.main_page_offset - olheader.book_name_offset, fp);
-    fwrite(param->main_page, 1, olheader.host_offset - olheader.main_page_offset, fp);
-    fwrite(param->host, 1, olheader.header_size - olheader.host_offset, fp);
+    fwrite(&olheader, 1, sizeof(ol_file_header_t), fp);
+    fwrite(&oltable, 1, oltable.book_name_offset, fp);
+    fwrite(param->book_name, 1, oltable.main_page_offset - oltable.book_name_offset, fp);
+    fwrite(param->main_page, 1, oltable.host_offset - oltable.main_page_offset, fp);
+    fwrite(param->host, 1, olheader.table_size - oltable.host_offset, fp);
     fclose(fp);
 
     OnOpenBook(hWnd, savepath, FALSE);
@@ -3719,6 +3762,9 @@ void Exit(void)
 {
     if (_Book)
     {
+#ifdef ENABLE_NETWORK
+        DropCheckBook(_Book);
+#endif
         delete _Book;
         _Book = NULL;
     }
@@ -3795,6 +3841,10 @@ void UpdateProgess(void)
     TCHAR str[256] = { 0 };
     double dprog = 0.0;
     int nprog = 0;
+    int cur, total;
+#ifdef ENABLE_NETWORK
+    int done, count;
+#endif
 
     if (EC_IsEditMode())
     {
@@ -3808,15 +3858,29 @@ void UpdateProgess(void)
         dprog = (double)_Book->GetProgress();
         nprog = (int)(dprog * 100);
         dprog = (double)nprog / 100.0;
+        // page number when whole book is paginated, otherwise char position
+        if (!_Book->GetPageNumber(&cur, &total))
+        {
+            cur = _item->index + _Book->GetCurPageSize();
+            total = _Book->GetTextLength();
+        }
         if (!_IsAutoPage)
         {
-            _stprintf(progress, _T("  %.2f%%  ( %d / %d )"), dprog, _item->index + _Book->GetCurPageSize(), _Book->GetTextLength());
+            _stprintf(progress, _T("  %.2f%%  ( %d / %d )"), dprog, cur, total);
         }
         else
         {
             LoadString(hInst, IDS_AUTOPAGING, str, 256);
-            _stprintf(progress, _T("  %.2f%%  ( %d / %d )  [%s]"), dprog, _item->index + _Book->GetCurPageSize(), _Book->GetTextLength(), str);
+            _stprintf(progress, _T("  %.2f%%  ( %d / %d )  [%s]"), dprog, cur, total, str);
+        }
+#ifdef ENABLE_NETWORK
+        if (_Book->GetBookType() == book_online && ((OnlineBook*)_Book)->IsDownloading())
+        {
+            ((OnlineBook*)_Book)->GetDownloadProgress(&done, &count);
+            LoadString(hInst, IDS_DOWNLOADING, str, 256);
+            _stprintf(progress + _tcslen(progress), _T("  [%s %d / %d]"), str, done, count);
         }
+#endif
         SendMessage(_WndInfo.hStatusBar, SB_SETTEXT, (WPARAM)0, (LPARAM)progress);
     }
     else
@@ -3897,6 +3961,7 @@ void RemoveMenus(HWND hWnd, BOOL redraw)
 #ifndef ENABLE_NETWORK
     RemoveMenuById(hMenu, TRUE, IDM_PROXY);
     RemoveMenuById(hMenu, TRUE, IDM_ONLINE);
+    RemoveMenuById(hMenu, FALSE, IDM_DOWNLOAD);
 #endif
 
 #if !ENABLE_TAG
@@ -4136,28 +4201,114 @@ chkbook_arg_t* GetCheckBookArguments()
 
 void StartCheckBookUpdate(HWND hWnd)
 {
+#if TEST_MODEL
+    UnitTestCheckBook();
+#endif
     KillTimer(hWnd, IDT_TIMER_CHECKBOOK);
     SetTimer(hWnd, IDT_TIMER_CHECKBOOK, 60 * 1000 /*one minute*/, NULL);
 }
 
+// called by the request thread of the book
 void OnCheckBookUpdateCallback(int is_update, int err, void* param)
 {
-    chkbook_arg_t* arg = (chkbook_arg_t*)param;
+    chkbook_arg_t* arg = GetCheckBookArguments();
+
+    if (!arg || !param)
+        return;
+
+    // param is the task id
+    PostMessage(arg->hWnd, WM_CHECK_BOOK, is_update, (LPARAM)param);
+}
+
+static bool CompareCheckBook(const chkbook_item_t &a, const chkbook_item_t &b)
+{
+    // a book updated lately is likely updated again, then the one not checked for the longest time
+    if (a.info.found_time != b.info.found_time)
+        return a.info.found_time > b.info.found_time;
+    return a.info.update_time < b.info.update_time;
+}
+
+void OnCheckBookUpdate(HWND hWnd)
+{
+    chkbook_arg_t* arg = GetCheckBookArguments();
+    std::list<chkbook_task_t*>::iterator itor;
+    chkbook_item_t book;
+    item_t* item = NULL;
+    u64 current_time = 0;
+    int i;
+
+    if (!arg)
+        return;
+
+    if (!arg->sweeping)
+    {
+        // start a sweep, only headers of .ol files are read to pick the books
+        current_time = time(NULL);
+        arg->hWnd = hWnd;
+        arg->pending.clear();
+        for (i = 0; i < _header->item_count; i++)
+        {
+            item = _Cache.get_item(i);
+            if (0 != _tcscmp(PathFindExtension(item->file_name), _T(".ol")))
+                continue;
+            if (!OnlineBook::ReadOlInfo(item->file_name, &book.info))
+                continue;
+            if (book.info.is_finished)
+                continue;
+            if (current_time <= book.info.update_time || current_time - book.info.update_time < CHECKBOOK_DUE)
+                continue;
+            book.file_name = item->file_name;
+            arg->pending.push_back(book);
+        }
+        std::sort(arg->pending.begin(), arg->pending.end(), CompareCheckBook);
+        arg->sweeping = TRUE;
+        arg->sweep_start = GetTickCount();
+        arg->sweep_books = 0;
+        KillTimer(hWnd, IDT_TIMER_CHECKBOOK);
+        SetTimer(hWnd, IDT_TIMER_CHECKBOOK, CHECKBOOK_POLL, NULL);
+    }
+    else
+    {
+        // give up the checks without result
+        for (itor = arg->running.begin(); itor != arg->running.end(); )
+        {
+            if (GetTickCount() - (*itor)->start > CHECKBOOK_TIMEOUT)
+            {
+                StopCheckBook(*itor);
+                itor = arg->running.erase(itor);
+            }
+            else
+            {
+                itor++;
+            }
+        }
+    }
+
+    CheckBookNext(hWnd);
+}
+
+void OnCheckBookDone(HWND hWnd, int is_update, UINT id)
+{
+    chkbook_arg_t* arg = GetCheckBookArguments();
+    std::list<chkbook_task_t*>::iterator itor;
+    chkbook_task_t* task = NULL;
     int i;
 #if TEST_MODEL
     char msg[1024] = { 0 };
     char* ansi = NULL;
 #endif
 
-    if (!arg)
-        return;
-
-    if (!arg->book)
+    // the task may be given up already
+    for (itor = arg->running.begin(); itor != arg->running.end() && (*itor)->id != id; itor++)
+        ;
+    if (itor == arg->running.end())
         return;
+    task = *itor;
+    arg->running.erase(itor);
 
 #if TEST_MODEL
-    ansi = Utils::Utf16ToAnsi(arg->book->GetFileName());
-    sprintf(msg, "{%s:%d} file=%s\n", __FUNCTION__, __LINE__, ansi);
+    ansi = Utils::Utf16ToAnsi(task->file_name.c_str());
+    sprintf(msg, "{%s:%d} file=%s, update=%d\n", __FUNCTION__, __LINE__, ansi, is_update);
     OutputDebugStringA(msg);
 #endif
 
@@ -4166,104 +4317,244 @@ void OnCheckBookUpdateCallback(int is_update, int err, void* param)
         for (i = 0; i < _header->item_count; i++)
         {
             item_t* item = _Cache.get_item(i);
-            if (_tcscmp(item->file_name, arg->book->GetFileName()) == 0)
+            if (_tcscmp(item->file_name, task->file_name.c_str()) == 0)
             {
                 item->is_new = TRUE;
-                Save(arg->hWnd);
+                Save(hWnd);
                 break;
             }
         }
 
-        OnUpdateMenu(arg->hWnd);
+        OnUpdateMenu(hWnd);
     }
 
-    if (arg->book)
+    StopCheckBook(task);
+    if (arg->sweeping)
+        CheckBookNext(hWnd);
+}
+
+void CheckBookNext(HWND hWnd)
+{
+    chkbook_arg_t* arg = GetCheckBookArguments();
+    chkbook_task_t* task = NULL;
+#if TEST_MODEL
+    char msg[256] = { 0 };
+#endif
+
+    while ((task = PopCheckBook(arg)) != NULL)
     {
-        delete arg->book;
-        arg->book = NULL;
-    }   
+        if (_Book && _Book->GetBookType() == book_online && _tcscmp(_Book->GetFileName(), task->file_name.c_str()) == 0)
+        {
+            task->book = (OnlineBook*)_Book;
+            task->owned = FALSE;
+        }
+        else
+        {
+            task->book = new OnlineBook;
+            task->book->SetFileName(task->file_name.c_str());
+            task->owned = TRUE;
+        }
+
+        if (2 != task->book->CheckUpdate(hWnd, OnCheckBookUpdateCallback, (void*)(UINT_PTR)task->id))
+        {
+            // no need to check, or failed
+            if (task->owned)
+                delete task->book;
+            delete task;
+            continue;
+        }
+        RunCheckBook(arg, task);
+    }
 
-    // check next book
-    if (arg->hWnd)
+    if (arg->pending.empty() && arg->running.empty())
     {
-        KillTimer(arg->hWnd, IDT_TIMER_CHECKBOOK);
-        SetTimer(arg->hWnd, IDT_TIMER_CHECKBOOK, 60 * 1000 /*one minute*/, NULL);
+        // all books are checked
+        arg->sweeping = FALSE;
+        arg->sweep_time = GetTickCount() - arg->sweep_start;
+#if TEST_MODEL
+        sprintf(msg, "{%s:%d} sweep %d books in %lu ms\n", __FUNCTION__, __LINE__, arg->sweep_books, arg->sweep_time);
+        OutputDebugStringA(msg);
+#endif
+        KillTimer(hWnd, IDT_TIMER_CHECKBOOK);
+        SetTimer(hWnd, IDT_TIMER_CHECKBOOK, CHECKBOOK_INTERVAL, NULL);
     }
 }
 
-void OnCheckBookUpdate(HWND hWnd)
+// takes the first pending book allowed by the running and host limits, its book is not set yet
+chkbook_task_t* PopCheckBook(chkbook_arg_t* arg)
 {
-    chkbook_arg_t* arg = GetCheckBookArguments();
-    item_t* item = NULL;
-    int i;
-    int found = -1;
+    std::vector<chkbook_item_t>::iterator itor;
+    std::map<std::string, int>::iterator host;
+    chkbook_task_t* task = NULL;
 
-    if (!arg)
-        return;
+    if ((int)arg->running.size() >= CHECKBOOK_MAX_RUNNING)
+        return NULL;
 
-    if (arg->book)
+    for (itor = arg->pending.begin(); itor != arg->pending.end(); itor++)
     {
-        delete arg->book;
-        arg->book = NULL;
-    }   
+        // the other books of a busy host wait
+        host = arg->hosts.find(itor->info.host);
+        if (host != arg->hosts.end() && host->second >= CHECKBOOK_MAX_HOST)
+            continue;
 
-_check_next:
-    found = -1;
-    // find an online book
-    for (i = 0; i < _header->item_count; i++)
+        task = new chkbook_task_t;
+        task->id = ++arg->next_id;
+        if (task->id == 0) // wrapped, 0 is not a valid param
+            task->id = ++arg->next_id;
+        task->file_name = itor->file_name;
+        task->book = NULL;
+        task->owned = FALSE;
+        task->host = itor->info.host;
+        task->start = GetTickCount();
+        arg->pending.erase(itor);
+        arg->sweep_books++;
+        return task;
+    }
+    return NULL;
+}
+
+// the check of the task is on the way
+void RunCheckBook(chkbook_arg_t* arg, chkbook_task_t* task)
+{
+    arg->hosts[task->host]++;
+    arg->running.push_back(task);
+}
+
+void StopCheckBook(chkbook_task_t* task)
+{
+    chkbook_arg_t* arg = GetCheckBookArguments();
+    std::map<std::string, int>::iterator host;
+
+    host = arg->hosts.find(task->host);
+    if (host != arg->hosts.end() && --host->second <= 0)
+        arg->hosts.erase(host);
+    // a result posted later doesn't match any task
+    task->book->CancelCheckUpdate();
+    if (task->owned)
+        delete task->book;
+    delete task;
+}
+
+void CancelCheckBook(const TCHAR* file_name)
+{
+    chkbook_arg_t* arg = GetCheckBookArguments();
+    std::list<chkbook_task_t*>::iterator itor;
+
+    // the book is going to be opened, its checking instance is dropped
+    for (itor = arg->running.begin(); itor != arg->running.end(); itor++)
     {
-        item = _Cache.get_item(i);
-        if (0 == _tcscmp(PathFindExtension(item->file_name), _T(".ol")))
+        if ((*itor)->owned && 0 == _tcscmp((*itor)->file_name.c_str(), file_name))
         {
-            if (arg->checked_list.find(item->file_name) != arg->checked_list.end())
-            {
-                continue;
-            }
-            found = i;
+            StopCheckBook(*itor);
+            arg->running.erase(itor);
             break;
         }
     }
+}
+
+void DropCheckBook(Book* book)
+{
+    chkbook_arg_t* arg = GetCheckBookArguments();
+    std::list<chkbook_task_t*>::iterator itor;
 
-    if (found != -1)
+    // the opened book is going to be deleted, its events must not reach the task
+    for (itor = arg->running.begin(); itor != arg->running.end(); )
     {
-        item = _Cache.get_item(found);
-        if (_Book && _Book->GetBookType() == book_online && _tcscmp(_Book->GetFileName(), item->file_name) == 0)
+        if ((*itor)->book == book)
         {
-            arg->hWnd = hWnd;
-            arg->checked_list.insert(item->file_name);
-            if (2 != ((OnlineBook*)_Book)->CheckUpdate(hWnd, OnCheckBookUpdateCallback, arg))
-            {
-                found = -1;
-                goto _check_next;
-            }
+            StopCheckBook(*itor);
+            itor = arg->running.erase(itor);
         }
         else
         {
-            arg->hWnd = hWnd;
-            arg->checked_list.insert(item->file_name);
-            arg->book = new OnlineBook;
-            arg->book->SetFileName(item->file_name);
-            if (2 != arg->book->CheckUpdate(hWnd, OnCheckBookUpdateCallback, arg))
-            {
-                delete arg->book;
-                arg->book = NULL;
-
-                found = -1;
-                goto _check_next;
-            }
+            itor++;
         }
     }
-    else
-    {
-        if (arg->book)
-        {
-            delete arg->book;
-            arg->book = NULL;
-        }
-        arg->checked_list.clear();
-        KillTimer(hWnd, IDT_TIMER_CHECKBOOK);
-        SetTimer(hWnd, IDT_TIMER_CHECKBOOK, 60 * 60 * 1000 /*one hour*/, NULL);
-    }
+}
+
+// queue of the update checker with books which are never requested
+void UnitTestCheckBook(void)
+{
+#if TEST_MODEL
+    chkbook_arg_t* arg = GetCheckBookArguments();
+    chkbook_arg_t saved = *arg;
+    std::list<chkbook_task_t*>::iterator itor;
+    std::map<std::string, int>::iterator host;
+    chkbook_item_t item;
+    chkbook_task_t* task = NULL;
+    OnlineBook opened;
+    TCHAR name[32];
+    UINT id;
+    int i;
+
+    arg->pending.clear();
+    arg->running.clear();
+    arg->hosts.clear();
+    arg->sweeping = FALSE; // a finished check doesn't start the next one
+    memset(&item.info, 0, sizeof(item.info));
+    for (i = 0; i < 15; i++)
+    {
+        // 3 books on each of 5 hosts
+        _stprintf(name, _T("%d.ol"), i);
+        item.file_name = name;
+        sprintf(item.info.host, "host%d", i / 3);
+        arg->pending.push_back(item);
+    }
+
+    while ((task = PopCheckBook(arg)) != NULL)
+    {
+        assert(task->id == arg->next_id && task->id != 0);
+        task->book = new OnlineBook;
+        task->owned = TRUE;
+        RunCheckBook(arg, task);
+    }
+    // 2 books of hosts 0-3 are running, the last book of each and host4 wait
+    assert(arg->running.size() == CHECKBOOK_MAX_RUNNING && arg->pending.size() == 7);
+    for (host = arg->hosts.begin(); host != arg->hosts.end(); host++)
+        assert(host->second == CHECKBOOK_MAX_HOST);
+    assert(arg->hosts.size() == 4);
+
+    // the result of a given up task is dropped
+    id = arg->running.front()->id;
+    OnCheckBookDone(NULL, 0, id);
+    assert(arg->running.size() == CHECKBOOK_MAX_RUNNING - 1 && arg->hosts["host0"] == 1);
+    OnCheckBookDone(NULL, 0, id);
+    OnCheckBookDone(NULL, 0, 0);
+    assert(arg->running.size() == CHECKBOOK_MAX_RUNNING - 1);
+
+    // the host has room again, its last book goes before the other hosts
+    task = PopCheckBook(arg);
+    assert(task && task->file_name == _T("2.ol"));
+    task->book = &opened;
+    task->owned = FALSE;
+    RunCheckBook(arg, task);
+    assert(!PopCheckBook(arg));
+
+    // the opened book is not canceled by its file, it's dropped with the book
+    CancelCheckBook(_T("2.ol"));
+    assert(arg->running.size() == CHECKBOOK_MAX_RUNNING);
+    DropCheckBook(&opened);
+    assert(arg->running.size() == CHECKBOOK_MAX_RUNNING - 1 && arg->hosts["host0"] == 1);
+
+    // a checking instance is canceled when the book is opened
+    CancelCheckBook(_T("1.ol"));
+    assert(arg->running.size() == CHECKBOOK_MAX_RUNNING - 2 && arg->hosts.find("host0") == arg->hosts.end());
+
+    // id 0 is skipped when wrapped
+    arg->next_id = (UINT)-1;
+    task = PopCheckBook(arg);
+    assert(task && task->id == 1);
+    task->book = new OnlineBook;
+    task->owned = TRUE;
+    RunCheckBook(arg, task);
+
+    for (itor = arg->running.begin(); itor != arg->running.end(); itor++)
+        StopCheckBook(*itor);
+    arg->running.clear();
+    assert(arg->hosts.empty());
+
+    *arg = saved;
+#endif
 }
 #endif
 
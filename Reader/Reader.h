@@ -13,6 +13,7 @@
 #include "HttpClient.h"
 #include "HtmlParser.h"
 #include <map>
+#include <list>
 #include <shellapi.h>
 
 typedef struct loading_data_t
@@ -26,16 +27,50 @@ typedef struct loading_data_t
 } loading_data_t;
 
 #ifdef ENABLE_NETWORK
+#define CHECKBOOK_MAX_RUNNING       8 // books checked at the same time
+#define CHECKBOOK_MAX_HOST          2 // books of one host checked at the same time
+#define CHECKBOOK_POLL              (10 * 1000) // timer while checking
+#define CHECKBOOK_TIMEOUT           (2 * 60 * 1000) // a check without result is given up
+#define CHECKBOOK_INTERVAL          (60 * 60 * 1000) // between two sweeps
+#define CHECKBOOK_DUE               (4 * 3600) // seconds since last check, same as OnlineBook::CheckUpdate
+
+struct chkbook_item_t
+{
+    std::wstring file_name;
+    ol_book_info_t info;
+};
+
+struct chkbook_task_t
+{
+    UINT id; // posted with WM_CHECK_BOOK, the task may be freed before it is received
+    std::wstring file_name;
+    OnlineBook* book;
+    BOOL owned; // FALSE: the opened book, it may be closed during the check
+    std::string host;
+    DWORD start;
+};
+
+// one sweep checks all online books, several at the same time
 struct chkbook_arg_t
 {
     HWND hWnd;
-    OnlineBook* book;
-    std::set<std::wstring> checked_list;
+    std::vector<chkbook_item_t> pending; // most recently updated first
+    std::list<chkbook_task_t*> running;
+    std::map<std::string, int> hosts; // running checks of each host
+    UINT next_id;
+    BOOL sweeping;
+    DWORD sweep_start;
+    DWORD sweep_time; // ms, the last sweep
+    int sweep_books; // books checked by the last sweep
 
     chkbook_arg_t()
     {
         hWnd = NULL;
-        book = NULL;
+        next_id = 0;
+        sweeping = FALSE;
+        sweep_start = 0;
+        sweep_time = 0;
+        sweep_books = 0;
     }
 };
 #endif
@@ -127,6 +162,14 @@ chkbook_arg_t*      GetCheckBookArguments();
 void                StartCheckBookUpdate(HWND hWnd);
 void                OnCheckBookUpdateCallback(int is_update, int err, void* param);
 void                OnCheckBookUpdate(HWND hWnd);
+void                OnCheckBookDone(HWND hWnd, int is_update, UINT id);
+void                CheckBookNext(HWND hWnd);
+chkbook_task_t*     PopCheckBook(chkbook_arg_t* arg);
+void                RunCheckBook(chkbook_arg_t* arg, chkbook_task_t* task);
+void                StopCheckBook(chkbook_task_t* task);
+void                CancelCheckBook(const TCHAR* file_name);
+void                DropCheckBook(Book* book);
+void                UnitTestCheckBook(void);
 void                OnOpenOlBook(HWND, void*);
 void                UpdateBookMark(HWND, int, int);
 #endif
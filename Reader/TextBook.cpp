@@ -1,7 +1,16 @@
 #include "stdafx.h"
 #include "TextBook.h"
+#include "LineRegex.h"
 #include "types.h"
+#include <process.h>
+#include <shlwapi.h>
 #include <regex>
+#if TEST_MODEL
+#include <assert.h>
+#endif
+
+#define PARSER_SHARD_SIZE       (1024 * 1024) // chars
+#define PARSER_MAX_THREADS      16
 
 
 wchar_t TextBook::m_ValidChapter[] =
@@ -71,8 +80,13 @@ bool TextBook::ParserBook(HWND hWnd)
     if (!ReadBook())
         goto end;
 
-    if (!ParserChapters())
-        goto end;
+    // chapters of unchanged book are loaded from index file
+    if (!LoadChapterIndex())
+    {
+        if (!ParserChapters())
+            goto end;
+        SaveChapterIndex();
+    }
 
     ret = true;
 
@@ -85,12 +99,17 @@ end:
 
 bool TextBook::ReadBook(void)
 {
-    FILE *fp = NULL;
-    char *buf = NULL;
-    int len;
-    int size;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    HANDLE hMapping = NULL;
+    const char *view = NULL;
+    const char *buf = "";
+    DWORD len = 0;
+    FILETIME ft;
     bool ret = false;
 
+    m_FileSize = 0;
+    m_FileTime = 0;
+    m_FileHash = 0;
     if (m_Data && m_Size > 0)
     {
         buf = m_Data;
@@ -98,28 +117,40 @@ bool TextBook::ReadBook(void)
     }
     else if (m_fileName[0])
     {
-        fp = _tfopen(m_fileName, _T("rb"));
-        if (!fp)
+        // map file and decode it in chunks, no need to read whole file into memory
+        hFile = CreateFile(m_fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
             goto end;
 
-        fseek(fp, 0, SEEK_END);
-        len = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-
-        buf = (char *)malloc(len + 2);
-        buf[len] = 0;
-        if (!buf)
-            goto end;
-        size = fread(buf, 1, len, fp);
-        if (size != len)
+        len = GetFileSize(hFile, NULL);
+        if (len == INVALID_FILE_SIZE || len > 0x7FFFFFFF)
             goto end;
+
+        if (len > 0) // can't map empty file
+        {
+            hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (!hMapping)
+                goto end;
+            view = (const char *)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            if (!view)
+                goto end;
+            buf = view;
+        }
+
+        // key of index file
+        if (GetFileTime(hFile, NULL, NULL, &ft))
+        {
+            m_FileSize = len;
+            m_FileTime = ((u64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+            m_FileHash = HashContent(buf, len);
+        }
     }
     else
     {
         goto end;
     }
 
-    if (!DecodeText(buf, len, &m_Text, &m_TextLength))
+    if (!DecodeText(buf, (int)len, &m_Text, &m_TextLength))
         goto end;
 
     if (m_bForceKill)
@@ -128,12 +159,17 @@ bool TextBook::ReadBook(void)
     ret = true;
 
 end:
-    if (fp)
-        fclose(fp);
-    if (buf)
-        free(buf);
+    if (view)
+        UnmapViewOfFile(view);
+    if (hMapping)
+        CloseHandle(hMapping);
+    if (hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
     if (m_Data)
+    {
+        free(m_Data);
         m_Data = NULL;
+    }
     m_Size = 0;
 
     return ret;
@@ -144,32 +180,110 @@ bool TextBook::ParserChapters(void)
     if (m_Rule)
     {
         m_Chapters.clear();
-        if (m_Rule->rule == 0)
+        if (m_Rule->rule == 0 || m_Rule->rule == 1)
         {
-            return ParserChaptersDefault();
-        }
-        else if (m_Rule->rule == 1)
-        {
-            return ParserChaptersKeyword();
+            return ParserChaptersParallel();
         }
         else if (m_Rule->rule == 2)
         {
+            UnitTest3();
+            // patterns out of LineRegex fall back to std::wregex
+            if (LineRegex().Compile(m_Rule->regex))
+                return ParserChaptersParallel();
             return ParserChaptersRegex();
         }
     }
     return false;
 }
 
-bool TextBook::ParserChaptersDefault(void)
+// split text into shards at line end, parse them on worker threads and merge results in order
+bool TextBook::ParserChaptersParallel(void)
 {
-    wchar_t *text = m_Text;
+    chapter_shard_t shards[PARSER_MAX_THREADS];
+    HANDLE threads[PARSER_MAX_THREADS] = { 0 };
+    SYSTEM_INFO si;
+    int count, i, pos, end;
+    int menu_begin_id = 0;
+    bool ret = true;
+
+    GetSystemInfo(&si);
+    count = m_TextLength / PARSER_SHARD_SIZE + 1;
+    if (count > (int)si.dwNumberOfProcessors)
+        count = (int)si.dwNumberOfProcessors;
+    if (count > PARSER_MAX_THREADS)
+        count = PARSER_MAX_THREADS;
+    if (count < 1)
+        count = 1;
+
+    pos = 0;
+    for (i = 0; i < count; i++)
+    {
+        end = i == count - 1 ? m_TextLength : (int)((__int64)m_TextLength * (i + 1) / count);
+        if (end < pos)
+            end = pos;
+        while (end > 0 && end < m_TextLength && m_Text[end - 1] != 0x0A)
+            end++;
+        shards[i].book = this;
+        shards[i].begin = pos;
+        shards[i].end = end;
+        shards[i].ret = false;
+        pos = end;
+    }
+
+    // first shard on current thread
+    for (i = 1; i < count; i++)
+    {
+        threads[i] = (HANDLE)_beginthreadex(NULL, 0, ParserChaptersThread, &shards[i], 0, NULL);
+    }
+    ParserChaptersThread(&shards[0]);
+    for (i = 1; i < count; i++)
+    {
+        if (threads[i])
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+        else
+        {
+            ParserChaptersThread(&shards[i]);
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (!shards[i].ret)
+            ret = false;
+        for (size_t j = 0; j < shards[i].chapters.size(); j++)
+        {
+            m_Chapters.insert(std::make_pair(menu_begin_id++, shards[i].chapters[j]));
+        }
+    }
+    return ret;
+}
+
+unsigned __stdcall TextBook::ParserChaptersThread(void* pArguments)
+{
+    chapter_shard_t *shard = (chapter_shard_t *)pArguments;
+    TextBook *_this = shard->book;
+
+    if (_this->m_Rule->rule == 0)
+        shard->ret = _this->ParserChaptersDefault(shard->begin, shard->end, &shard->chapters);
+    else if (_this->m_Rule->rule == 1)
+        shard->ret = _this->ParserChaptersKeyword(shard->begin, shard->end, &shard->chapters);
+    else
+        shard->ret = _this->ParserChaptersRegex(shard->begin, shard->end, &shard->chapters);
+    return 0;
+}
+
+bool TextBook::ParserChaptersDefault(int begin, int end, std::vector<chapter_item_t> *chapters)
+{
+    wchar_t *text = m_Text + begin;
     wchar_t title[MAX_CHAPTER_LENGTH] = { 0 };
     int line_size;
     int title_len = 0;
     bool bFound = false;
     int idx_1 = -1, idx_2 = -1;
     chapter_item_t chapter;
-    int menu_begin_id = 0;
 
     while (true)
     {
@@ -178,7 +292,7 @@ bool TextBook::ParserChaptersDefault(void)
             return false;
         }
 
-        if (!GetLine(text, m_TextLength - (text - m_Text), &line_size))
+        if (!GetLine(text, end - (text - m_Text), &line_size))
         {
             break;
         }
@@ -231,7 +345,7 @@ bool TextBook::ParserChaptersDefault(void)
 
             chapter.index = /*idx_1 +*/ (text - m_Text);
             chapter.title = title;
-            m_Chapters.insert(std::make_pair(menu_begin_id++, chapter));
+            chapters->push_back(chapter);
         }
 
         // set index
@@ -241,59 +355,140 @@ bool TextBook::ParserChaptersDefault(void)
     return true;
 }
 
-bool TextBook::ParserChaptersKeyword(void)
+bool TextBook::ParserChaptersKeyword(int begin, int end, std::vector<chapter_item_t> *chapters)
 {
-    wchar_t *text = m_Text;
+    const wchar_t *keyword = m_Rule->keyword;
     wchar_t title[MAX_CHAPTER_LENGTH] = { 0 };
     int line_size;
     int title_len = 0;
-    bool bFound = false;
-    int idx_1 = -1;
-    int cmplen;
+    int keylen;
+    int skip[256];
+    int pos, found, line, i;
     chapter_item_t chapter;
-    int menu_begin_id = 0;
 
-    while (true)
+    // bad char shift of horspool, chars are hashed by low byte
+    keylen = wcslen(keyword);
+    for (i = 0; i < 256; i++)
+    {
+        skip[i] = keylen;
+    }
+    for (i = 0; i < keylen - 1; i++)
+    {
+        skip[keyword[i] & 0xFF] = keylen - 1 - i;
+    }
+
+    pos = begin;
+    while (pos < end)
     {
         if (m_bForceKill)
         {
             return false;
         }
 
-        if (!GetLine(text, m_TextLength - (text - m_Text), &line_size))
+        found = FindKeyword(m_Text + pos, end - pos, keyword, keylen, skip);
+        if (found < 0)
         {
             break;
         }
+        found += pos;
 
-        // check format
-        cmplen = wcslen(m_Rule->keyword);
-        if (cmplen <= line_size)
+        // line of the first keyword
+        for (line = found; line > begin && m_Text[line - 1] != 0x0A; line--)
+            ;
+        GetLine(m_Text + line, end - line, &line_size);
+        if (line_size > 0)
         {
-            bFound = false;
-            idx_1 = -1;
-            for (int i = 0; i < line_size; i++)
-            {
-                if (wcsncmp(text+i, m_Rule->keyword, cmplen) == 0)
-                {
-                    idx_1 = i;
-                    bFound = true;
-                    break;
-                }
-            }
-            if (bFound)
+            title_len = line_size - (found - line) < (MAX_CHAPTER_LENGTH - 1) ? line_size - (found - line) : MAX_CHAPTER_LENGTH - 1;
+            memcpy(title, m_Text + found, title_len * sizeof(wchar_t));
+            title[title_len] = 0;
+
+            chapter.index = line;
+            chapter.title = title;
+            chapters->push_back(chapter);
+        }
+
+        // set index
+        pos = line + line_size + 1; // add 0x0a
+    }
+    return true;
+}
+
+int TextBook::FindKeyword(const wchar_t *text, int len, const wchar_t *keyword, int keylen, const int *skip)
+{
+    int i = 0, j;
+    wchar_t last;
+
+    if (keylen <= 0)
+        return len > 0 ? 0 : -1;
+
+    last = keyword[keylen - 1];
+    while (i + keylen <= len)
+    {
+        if (text[i + keylen - 1] == last)
+        {
+            for (j = 0; j < keylen - 1 && text[i + j] == keyword[j]; j++)
+                ;
+            if (j == keylen - 1)
+                return i;
+        }
+        i += skip[text[i + keylen - 1] & 0xFF];
+    }
+    return -1;
+}
+
+bool TextBook::ParserChaptersRegex(int begin, int end, std::vector<chapter_item_t> *chapters)
+{
+    LineRegex regex;
+    wchar_t title[MAX_CHAPTER_LENGTH] = { 0 };
+    int line_size;
+    int title_len = 0;
+    int pos, line, from, start, stop;
+    wchar_t required;
+    chapter_item_t chapter;
+
+    if (!regex.Compile(m_Rule->regex))
+        return false;
+    required = regex.GetRequiredChar();
+
+    pos = begin;
+    while (pos < end)
+    {
+        if (m_bForceKill)
+        {
+            return false;
+        }
+
+        // skip lines without the char every title has
+        line = pos;
+        if (required)
+        {
+            for (; pos < end && m_Text[pos] != required; pos++)
+                ;
+            if (pos == end)
+                break;
+            for (line = pos; line > begin && m_Text[line - 1] != 0x0A; line--)
+                ;
+        }
+        GetLine(m_Text + line, end - line, &line_size);
+
+        from = 0;
+        while (from <= line_size && regex.Search(m_Text + line, line_size, from, &start, &stop))
+        {
+            if (stop > start) // empty match is not a title
             {
-                title_len = line_size - idx_1 < (MAX_CHAPTER_LENGTH - 1) ? line_size - idx_1 : MAX_CHAPTER_LENGTH - 1;
-                memcpy(title, text + idx_1, title_len * sizeof(wchar_t));
+                title_len = stop - start < (MAX_CHAPTER_LENGTH - 1) ? stop - start : MAX_CHAPTER_LENGTH - 1;
+                memcpy(title, m_Text + line + start, title_len * sizeof(wchar_t));
                 title[title_len] = 0;
 
-                chapter.index = /*idx_1 +*/ (text - m_Text);
+                chapter.index = line + start;
                 chapter.title = title;
-                m_Chapters.insert(std::make_pair(menu_begin_id++, chapter));
+                chapters->push_back(chapter);
             }
+            from = stop > start ? stop : stop + 1;
         }
 
         // set index
-        text += line_size + 1; // add 0x0a
+        pos = line + line_size + 1; // add 0x0a
     }
     return true;
 }
@@ -350,6 +545,141 @@ bool TextBook::ParserChaptersRegex(void)
     return true;
 }
 
+bool TextBook::LoadChapterIndex(void)
+{
+    TCHAR filename[MAX_PATH];
+    FILE *fp = NULL;
+    char *buf = NULL;
+    int len = 0;
+    txt_index_header_t *header = NULL;
+    txt_chapter_info_t *cinfo = NULL;
+    chapter_item_t item;
+    int i, n;
+    bool result = false;
+
+    if (!m_Rule || !m_FileTime || !GetIndexFileName(filename, FALSE))
+        return false;
+
+    // read file to memory
+    fp = _tfopen(filename, _T("rb"));
+    if (!fp)
+        goto end;
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (len < (int)(sizeof(txt_index_header_t) - sizeof(txt_chapter_info_t)))
+        goto end;
+    buf = (char *)malloc(len);
+    if (!buf)
+        goto end;
+    if ((int)fread(buf, 1, len, fp) != len)
+        goto end;
+
+    // file or rule is changed
+    header = (txt_index_header_t *)buf;
+    if (header->version != TXT_INDEX_VERSION
+        || header->header_size != (u32)len
+        || header->file_size != m_FileSize
+        || header->file_time != m_FileTime
+        || header->file_hash != m_FileHash
+        || header->text_length != (u32)m_TextLength
+        || header->rule.rule != m_Rule->rule
+        || wcsncmp(header->rule.keyword, m_Rule->keyword, 256)
+        || wcsncmp(header->rule.regex, m_Rule->regex, 256))
+        goto end;
+    if (header->chapter_size > (u32)((len - offsetof(txt_index_header_t, chapter_info_list)) / sizeof(txt_chapter_info_t)))
+        goto end;
+
+    m_Chapters.clear();
+    for (i = 0; i < (int)header->chapter_size; i++)
+    {
+        cinfo = &(header->chapter_info_list[i]);
+        n = (len - (int)cinfo->title_offset) / sizeof(TCHAR);
+        if (cinfo->index > (u32)m_TextLength || cinfo->title_offset >= (u32)len || n <= 0
+            || wcsnlen((TCHAR *)(buf + cinfo->title_offset), n) == (size_t)n)
+        {
+            m_Chapters.clear();
+            goto end;
+        }
+        item.index = cinfo->index;
+        item.title = (TCHAR *)(buf + cinfo->title_offset);
+        m_Chapters.insert(std::make_pair(i, item));
+    }
+    result = true;
+
+end:
+    if (fp)
+        fclose(fp);
+    if (buf)
+        free(buf);
+    return result;
+}
+
+bool TextBook::SaveChapterIndex(void)
+{
+    TCHAR filename[MAX_PATH];
+    FILE *fp = NULL;
+    txt_index_header_t *header = NULL;
+    char *buf = NULL;
+    int buf_size, offset, size;
+    int i;
+    bool result = false;
+
+    if (!m_Rule || !m_FileTime || !GetIndexFileName(filename, TRUE))
+        return false;
+
+    // calc buf size
+    buf_size = sizeof(txt_index_header_t) + (sizeof(txt_chapter_info_t) * ((int)m_Chapters.size() - 1));
+    offset = buf_size;
+    for (i = 0; i < (int)m_Chapters.size(); i++)
+    {
+        buf_size += (m_Chapters[i].title.size() + 1) * sizeof(TCHAR);
+    }
+
+    buf = (char *)malloc(buf_size);
+    if (!buf)
+        goto end;
+    memset(buf, 0, offset);
+    header = (txt_index_header_t *)buf;
+    header->header_size = buf_size;
+    header->version = TXT_INDEX_VERSION;
+    header->file_size = m_FileSize;
+    header->file_time = m_FileTime;
+    header->file_hash = m_FileHash;
+    header->text_length = m_TextLength;
+    header->rule.rule = m_Rule->rule;
+    wcsncpy(header->rule.keyword, m_Rule->keyword, 255);
+    wcsncpy(header->rule.regex, m_Rule->regex, 255);
+    header->chapter_size = m_Chapters.size();
+    for (i = 0; i < (int)m_Chapters.size(); i++)
+    {
+        size = (m_Chapters[i].title.size() + 1) * sizeof(TCHAR);
+        header->chapter_info_list[i].index = m_Chapters[i].index;
+        header->chapter_info_list[i].title_offset = offset;
+        memcpy(buf + offset, m_Chapters[i].title.c_str(), size);
+        offset += size;
+    }
+
+    fp = _tfopen(filename, _T("wb"));
+    if (!fp)
+        goto end;
+    if ((int)fwrite(buf, 1, buf_size, fp) != buf_size)
+        goto end;
+    result = true;
+
+end:
+    if (fp)
+    {
+        fclose(fp);
+        if (!result)
+            DeleteFile(filename);
+    }
+    if (buf)
+        free(buf);
+    return result;
+}
+
+// index file is named by the hash of book path
 bool TextBook::GetLine(wchar_t* text, int len, int* line_size)
 {
     if (!text || len <= 0)
@@ -390,4 +720,52 @@ bool TextBook::IsChapter(wchar_t* text, int len)
         }
     }
     return true;
+}
+
+// LineRegex must find the same matches as std::wregex in one line
+void TextBook::UnitTest3(void)
+{
+#if TEST_MODEL
+    static const wchar_t *patterns[] = {
+        L"\x7B2C.*\x7AE0\\s+.*", // sample rule of readme
+        L"^\\s*(\x7B2C[0-9\x4E00-\x9FA5]+[\x7AE0\x8282\x56DE]|Chapter\\s+\\d+).*$",
+        L"a*", L"x?", L"ab|abc", L"(a|ab)(c|bcd)", L"a.*?b", L"a{2,3}", L"(?:ab)+c", L"[^0-9 ]+",
+        L"^abc", L"abc$", L"^$", L"\\bab\\b", L"\\Bb", L"c?\\bb", L"a?\\bc"
+    };
+    static const wchar_t *lines[] = {
+        L"", L"abc", L"abcd", L"abc abc", L"xabc", L"ab ab_ ab", L"ca b", L"cbb_ab  cc", L"aXbYb", L"aaaa", L"bbb", L"ababc",
+        L"\x7B2C\x4E00\x7AE0 \x5F00\x59CB", L"  \x7B2C\x0031\x0032\x7AE0  title", L"\x7B2C\x4E00\x7AE0",
+        L"Chapter 12 end", L"\x7B2C\x4E09\x5377 \x7B2C\x4E94\x7AE0 x"
+    };
+    LineRegex regex;
+    std::wregex e;
+    std::wcmatch cm;
+    wchar_t required;
+    int i, j, len, from, start, stop;
+    bool found, ok;
+
+    for (i = 0; i < (int)(sizeof(patterns) / sizeof(patterns[0])); i++)
+    {
+        found = regex.Compile(patterns[i]) ? true : false;
+        assert(found);
+        e = std::wregex(patterns[i]);
+        required = regex.GetRequiredChar();
+        for (j = 0; j < (int)(sizeof(lines) / sizeof(lines[0])); j++)
+        {
+            // same steps as ParserChaptersRegex
+            len = (int)wcslen(lines[j]);
+            for (from = 0; from <= len; from = stop > start ? stop : stop + 1)
+            {
+                found = regex.Search(lines[j], len, from, &start, &stop) ? true : false;
+                ok = std::regex_search(lines[j] + from, lines[j] + len, cm, e,
+                    from > 0 ? std::regex_constants::match_prev_avail : std::regex_constants::match_default);
+                assert(found == ok);
+                if (!found)
+                    break;
+                assert(start == from + (int)cm.position() && stop - start == (int)cm.length());
+                assert(!required || wcschr(lines[j], required));
+            }
+        }
+    }
+#endif
 }
\ No newline at end of file
@@ -2,7 +2,17 @@
 #define __TEXT_BOOK_H__
 
 #include "Book.h"
+#include <vector>
 
+class TextBook;
+typedef struct chapter_shard_t
+{
+    TextBook *book;
+    int begin;
+    int end; // after 0x0a
+    std::vector<chapter_item_t> chapters;
+    bool ret;
+} chapter_shard_t;
 
 class TextBook : public Book
 {
@@ -19,11 +29,18 @@ protected:
     virtual bool ParserBook(HWND hWnd);
     bool ReadBook(void);
     bool ParserChapters(void);
-    bool ParserChaptersDefault(void);
-    bool ParserChaptersKeyword(void);
+    bool ParserChaptersParallel(void);
+    static unsigned __stdcall ParserChaptersThread(void* pArguments);
+    bool ParserChaptersDefault(int begin, int end, std::vector<chapter_item_t> *chapters);
+    bool ParserChaptersKeyword(int begin, int end, std::vector<chapter_item_t> *chapters);
+    bool ParserChaptersRegex(int begin, int end, std::vector<chapter_item_t> *chapters);
+    static int FindKeyword(const wchar_t *text, int len, const wchar_t *keyword, int keylen, const int *skip);
     bool ParserChaptersRegex(void);
+    bool LoadChapterIndex(void);
+    bool SaveChapterIndex(void);
     bool GetLine(wchar_t* text, int len, int* line_size);
     bool IsChapter(wchar_t* text, int len);
+    void UnitTest3(void);
 
 protected:
     static wchar_t m_ValidChapter[];
@@ -0,0 +1,46 @@
+#include "stdafx.h"
+#include "TextSink.h"
+
+
+GdiTextSink::GdiTextSink(HDC hdc)
+    : m_hdc(hdc)
+{
+}
+
+GdiTextSink::~GdiTextSink()
+{
+}
+
+BOOL GdiTextSink::DrawRun(INT x, INT y, const wchar_t *text, INT len, const INT *dx)
+{
+    if (!m_hdc || !text || len <= 0)
+        return FALSE;
+    return ExtTextOut(m_hdc, x, y, 0, NULL, text, len, dx);
+}
+
+RecordTextSink::RecordTextSink(TextSink *next)
+    : m_Next(next)
+{
+}
+
+RecordTextSink::~RecordTextSink()
+{
+}
+
+BOOL RecordTextSink::DrawRun(INT x, INT y, const wchar_t *text, INT len, const INT *dx)
+{
+    run_t run;
+
+    run.x = x;
+    run.y = y;
+    run.text = text;
+    if (dx && len > 0)
+        run.dx.assign(dx, dx + len);
+    m_Runs.push_back(run);
+    return m_Next ? m_Next->DrawRun(x, y, text, len, dx) : TRUE;
+}
+
+const std::vector<RecordTextSink::run_t> &RecordTextSink::GetRuns(void)
+{
+    return m_Runs;
+}
@@ -0,0 +1,53 @@
+#ifndef __TEXT_SINK_H__
+#define __TEXT_SINK_H__
+
+#include "types.h"
+#include <vector>
+
+// output of PageCache::DrawPage, one call per line or per same-style run
+class TextSink
+{
+public:
+    virtual ~TextSink() {}
+    // dx: advance of each glyph, same as lpDx of ExtTextOut
+    virtual BOOL DrawRun(INT x, INT y, const wchar_t *text, INT len, const INT *dx) = 0;
+};
+
+class GdiTextSink : public TextSink
+{
+public:
+    GdiTextSink(HDC hdc);
+    virtual ~GdiTextSink();
+
+public:
+    virtual BOOL DrawRun(INT x, INT y, const wchar_t *text, INT len, const INT *dx);
+
+protected:
+    HDC m_hdc;
+};
+
+// records the runs and passes them to next sink, for checking the layout of DrawPage
+class RecordTextSink : public TextSink
+{
+public:
+    typedef struct run_t
+    {
+        INT x, y;
+        const wchar_t *text;
+        std::vector<INT> dx;
+    } run_t;
+
+public:
+    RecordTextSink(TextSink *next);
+    virtual ~RecordTextSink();
+
+public:
+    virtual BOOL DrawRun(INT x, INT y, const wchar_t *text, INT len, const INT *dx);
+    const std::vector<run_t> &GetRuns(void);
+
+protected:
+    TextSink *m_Next;
+    std::vector<run_t> m_Runs;
+};
+
+#endif
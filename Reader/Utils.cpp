@@ -1,10 +1,16 @@
 #include "StdAfx.h"
 #include "Utils.h"
+#include "Charset.h"
 #include <stdint.h>
+#include <intrin.h>
+#include <immintrin.h>
 #include <Wincrypt.h>
 #include <string.h>
 #include <stdio.h>
 #include "zlib.h"
+#if TEST_MODEL
+#include <assert.h>
+#endif
 
 const char* UTF_16_BE_BOM = "\xFE\xFF";
 const char* UTF_16_LE_BOM = "\xFF\xFE";
@@ -12,6 +18,10 @@ const char* UTF_8_BOM = "\xEF\xBB\xBF";
 const char* UTF_32_BE_BOM = "\x00\x00\xFE\xFF";
 const char* UTF_32_LE_BOM = "\xFF\xFE\x00\x00";
 
+static int _utf8_valid(const unsigned char *str, size_t size, int partial, simd_t level);
+static int _utf16_length(const unsigned char *str, size_t size, simd_t level);
+static int _utf8_decode(const unsigned char *str, size_t size, wchar_t *dst, simd_t level);
+
 Utils::Utils(void)
 {
 }
@@ -124,13 +134,32 @@ wchar_t* Utils::utf8_to_utf16(const char* str, int* len)
 wchar_t* Utils::utf8_to_utf16_ex(const char* str, int size, int* len)
 {
     wchar_t* result;
-    *len = MultiByteToWideChar(CP_UTF8, 0, str, size, NULL, 0);
+    *len = utf8_decode(str, size, NULL, 0);
     result = (wchar_t*)malloc(((*len)+1) * sizeof(wchar_t));
     memset(result, 0, ((*len)+1) * sizeof(wchar_t));
-    MultiByteToWideChar(CP_UTF8, 0, str, size, (LPWSTR)result, *len);
+    utf8_decode(str, size, (LPWSTR)result, *len);
     return result;
 }
 
+int Utils::utf8_decode(const char* str, int size, wchar_t* dst, int dstsize)
+{
+    const unsigned char* s = (const unsigned char*)str;
+    simd_t level;
+    int len;
+
+    // fast path for valid utf8 text only, invalid text is left to system for the same result
+    level = get_simd_level();
+    if (size > 0 && _utf8_valid(s, size, 0, level))
+    {
+        len = _utf16_length(s, size, level);
+        if (dstsize == 0)
+            return len;
+        if (dst && dstsize >= len)
+            return _utf8_decode(s, size, dst, level);
+    }
+    return MultiByteToWideChar(CP_UTF8, 0, str, size, dst, dstsize);
+}
+
 #if 0
 char* Utils::utf16_to_utf8(const wchar_t* str, int* len)
 {
@@ -165,6 +194,30 @@ char* Utils::utf16_to_utf8_bom(const wchar_t* str, int size, int* len)
     return result;
 }
 
+char* Utils::ansi_to_utf8_ex(const char* str, int size, int* len)
+{
+    char* result;
+    wchar_t* temp;
+    int templen;
+    UINT cp;
+
+    // gbk or big5: no utf16 buffer
+    cp = Charset::guess(str, size);
+    if (CP_GB18030 == cp || CP_BIG5 == cp)
+    {
+        *len = Charset::to_utf8(cp, str, size, NULL, 0);
+        result = (char*)malloc(((*len) + 1) * sizeof(char));
+        Charset::to_utf8(cp, str, size, result, *len);
+        result[*len] = 0;
+        return result;
+    }
+
+    temp = ansi_to_utf16_ex(str, size, &templen);
+    result = utf16_to_utf8_ex(temp, templen, len);
+    free(temp);
+    return result;
+}
+
 void Utils::free_buffer(void* buffer)
 {
     if (buffer)
@@ -290,16 +343,25 @@ int Utils::is_ascii(const char *data, size_t size)
     return 1;
 }
 
-int Utils::is_utf8(const char *data, size_t size)
+// check utf8 sequences in [str, end), use sse2 to skip ascii blocks.
+// partial: truncated sequence at the end is valid (text may be a part of data)
+static int _utf8_check(const unsigned char *str, const unsigned char *end, int partial, simd_t level)
 {
-    const unsigned char *str = (unsigned char*)data;
-    const unsigned char *end = str + size;
     unsigned char byte;
     unsigned int code_length, i;
     uint32_t ch;
     while (str != end) {
         byte = *str;
         if (byte <= 0x7F) {
+            /* ascii block: 16 bytes per step */
+            if (level >= simd_sse2) {
+                while (end - str >= 16 && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)str)))
+                    str += 16;
+                if (str == end)
+                    break;
+                if (*str > 0x7F)
+                    continue;
+            }
             /* 1 byte sequence: U+0000..U+007F */
             str += 1;
             continue;
@@ -321,6 +383,8 @@ int Utils::is_utf8(const char *data, size_t size)
 
         if (str + (code_length - 1) >= end) {
             /* truncated string or invalid byte sequence */
+            if (!partial)
+                return 0;
             break;//return 0; fixed bug.... substr
         }
 
@@ -361,6 +425,326 @@ int Utils::is_utf8(const char *data, size_t size)
     return 1;
 }
 
+// Keiser & Lemire lookup validation, 32 bytes per step.
+// return the length of checked prefix which ends at a char boundary, or -1 if invalid.
+// the last 3 bytes are never checked here, so truncated sequence at the end is left to _utf8_check.
+static size_t _utf8_prefix_avx2(const unsigned char *str, size_t size)
+{
+    // bit of error class, see "Validating UTF-8 In Less Than One Instruction Per Byte"
+    const char TOO_SHORT = 1 << 0;  // 11______ 0_______ or 11______ 11______
+    const char TOO_LONG = 1 << 1;   // 0_______ 10______
+    const char OVERLONG_3 = 1 << 2; // 11100000 100_____
+    const char TOO_LARGE = 1 << 3;  // 11110100 1001____ ...
+    const char SURROGATE = 1 << 4;  // 11101101 101_____
+    const char OVERLONG_2 = 1 << 5; // 1100000_ 10______
+    const char TOO_LARGE_1000 = 1 << 6; // 11110101 1000____ ...
+    const char OVERLONG_4 = 1 << 6; // 11110000 1000____
+    const char TWO_CONTS = (char)(1 << 7); // 10______ 10______
+    const char CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+    const __m256i byte_1_high = _mm256_setr_epi8(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE, TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2, TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE, TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const __m256i byte_1_low = _mm256_setr_epi8(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+        CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+        CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000);
+    const __m256i byte_2_high = _mm256_setr_epi8(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+    // lead bytes at the end of block which need more bytes
+    const __m256i max_value = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    const __m256i mask_0f = _mm256_set1_epi8(0x0F);
+    const __m256i mask_80 = _mm256_set1_epi8((char)0x80);
+    __m256i prev = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    __m256i error = _mm256_setzero_si256();
+    __m256i input, shift, prev1, prev2, prev3, sc, must23;
+    size_t n, i;
+
+    n = size > 3 ? (size - 3) & ~(size_t)31 : 0;
+    if (n == 0)
+        return 0;
+
+    for (i = 0; i < n; i += 32)
+    {
+        input = _mm256_loadu_si256((const __m256i *)(str + i));
+        if (!_mm256_movemask_epi8(input))
+        {
+            error = _mm256_or_si256(error, prev_incomplete);
+        }
+        else
+        {
+            shift = _mm256_permute2x128_si256(prev, input, 0x21);
+            prev1 = _mm256_alignr_epi8(input, shift, 15);
+            prev2 = _mm256_alignr_epi8(input, shift, 14);
+            prev3 = _mm256_alignr_epi8(input, shift, 13);
+
+            // special cases of 2 bytes
+            sc = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), mask_0f)),
+                    _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, mask_0f))),
+                _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), mask_0f)));
+
+            // 3rd and 4th bytes must be continuation
+            must23 = _mm256_or_si256(
+                _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80))),
+                _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80))));
+            error = _mm256_or_si256(error, _mm256_xor_si256(_mm256_and_si256(must23, mask_80), sc));
+            prev_incomplete = _mm256_subs_epu8(input, max_value);
+        }
+        prev = input;
+    }
+    if (!_mm256_testz_si256(error, error))
+        return (size_t)-1;
+
+    // back to the lead byte of last char
+    for (i = n - 1; i > n - 4 && (str[i] & 0xC0) == 0x80; i--)
+        ;
+    return i;
+}
+
+static int _utf8_valid(const unsigned char *str, size_t size, int partial, simd_t level)
+{
+    size_t n = 0;
+
+    if (level >= simd_avx2)
+    {
+        n = _utf8_prefix_avx2(str, size);
+        if (n == (size_t)-1)
+            return 0;
+    }
+    return _utf8_check(str + n, str + size, partial, level);
+}
+
+static int _bit_count(unsigned int x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (int)((x * 0x01010101) >> 24);
+}
+
+// utf16 length of valid utf8 text: every non-continuation byte is a char, 4 bytes sequence is a surrogate pair
+static int _utf16_length(const unsigned char *str, size_t size, simd_t level)
+{
+    size_t i = 0;
+    int len = 0;
+
+    if (level >= simd_sse2)
+    {
+        const __m128i cont = _mm_set1_epi8((char)0xBF);  // > 0xBF in signed: not 10xxxxxx
+        const __m128i mask_f0 = _mm_set1_epi8((char)0xF0);
+        __m128i v;
+        for (; i + 16 <= size; i += 16)
+        {
+            v = _mm_loadu_si128((const __m128i *)(str + i));
+            len += _bit_count(_mm_movemask_epi8(_mm_cmpgt_epi8(v, cont)));
+            len += _bit_count(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, mask_f0), mask_f0)));
+        }
+    }
+    for (; i < size; i++)
+    {
+        if ((str[i] & 0xC0) != 0x80)
+            len++;
+        if (str[i] >= 0xF0)
+            len++;
+    }
+    return len;
+}
+
+// decode valid utf8 text, ascii is widened 16 or 32 bytes per step
+static int _utf8_decode(const unsigned char *str, size_t size, wchar_t *dst, simd_t level)
+{
+    const unsigned char *end = str + size;
+    wchar_t *d = dst;
+    uint32_t ch;
+    __m128i v;
+    __m128i zero = _mm_setzero_si128();
+
+    while (str != end) {
+        if (*str <= 0x7F) {
+            if (level >= simd_avx2) {
+                while (end - str >= 32 && !_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)str))) {
+                    _mm256_storeu_si256((__m256i *)d, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)str)));
+                    _mm256_storeu_si256((__m256i *)(d + 16), _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(str + 16))));
+                    str += 32;
+                    d += 32;
+                }
+            }
+            if (level >= simd_sse2) {
+                while (end - str >= 16 && !_mm_movemask_epi8(v = _mm_loadu_si128((const __m128i *)str))) {
+                    _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi8(v, zero));
+                    _mm_storeu_si128((__m128i *)(d + 8), _mm_unpackhi_epi8(v, zero));
+                    str += 16;
+                    d += 16;
+                }
+                if (str == end)
+                    break;
+                if (*str > 0x7F)
+                    continue;
+            }
+            *d++ = *str++;
+        }
+        else if (*str < 0xE0) {
+            *d++ = (wchar_t)(((str[0] & 0x1F) << 6) | (str[1] & 0x3F));
+            str += 2;
+        }
+        else if (*str < 0xF0) {
+            *d++ = (wchar_t)(((str[0] & 0x0F) << 12) | ((str[1] & 0x3F) << 6) | (str[2] & 0x3F));
+            str += 3;
+        }
+        else {
+            ch = ((str[0] & 0x07) << 18) | ((str[1] & 0x3F) << 12) | ((str[2] & 0x3F) << 6) | (str[3] & 0x3F);
+            ch -= 0x10000;
+            *d++ = (wchar_t)(0xD800 + (ch >> 10));
+            *d++ = (wchar_t)(0xDC00 + (ch & 0x3FF));
+            str += 4;
+        }
+    }
+    return (int)(d - dst);
+}
+
+int Utils::is_utf8(const char *data, size_t size)
+{
+    return _utf8_valid((const unsigned char *)data, size, 1, get_simd_level());
+}
+
+void Utils::UnitTest6(void)
+{
+#if TEST_MODEL
+#define CASE_TEXT(s) s, sizeof(s) - 1
+    static const struct {
+        const char *text;
+        int len;
+        int valid; // as a whole text
+    } cases[] = {
+        { CASE_TEXT("abc"), 1 },
+        { CASE_TEXT("\xC2\xA9\xE4\xB8\xAD\xF0\x9F\x98\x80\xED\x9F\xBF\xEE\x80\x80\xF4\x8F\xBF\xBF"), 1 },
+        { CASE_TEXT("a\x00" "b"), 1 },
+        // truncated tails
+        { CASE_TEXT("\xC2"), 0 },
+        { CASE_TEXT("ab\xE4\xB8"), 0 },
+        { CASE_TEXT("\xF0\x9F\x98"), 0 },
+        { CASE_TEXT("\xE4\xB8" "a"), 0 },
+        // overlongs
+        { CASE_TEXT("\xC0\xAF"), 0 },
+        { CASE_TEXT("\xC1\xBF"), 0 },
+        { CASE_TEXT("\xE0\x80\xAF"), 0 },
+        { CASE_TEXT("\xE0\x9F\xBF"), 0 },
+        { CASE_TEXT("\xF0\x80\x80\xAF"), 0 },
+        { CASE_TEXT("\xF0\x8F\xBF\xBF"), 0 },
+        // surrogates
+        { CASE_TEXT("\xED\xA0\x80"), 0 },
+        { CASE_TEXT("\xED\xBF\xBF"), 0 },
+        { CASE_TEXT("\xED\xA0\xBD\xED\xB8\x80"), 0 },
+        // > U+10FFFF
+        { CASE_TEXT("\xF4\x90\x80\x80"), 0 },
+        { CASE_TEXT("\xF5\x80\x80\x80"), 0 },
+        { CASE_TEXT("\xF7\xBF\xBF\xBF"), 0 },
+        // stray bytes
+        { CASE_TEXT("\x80"), 0 },
+        { CASE_TEXT("a\xBF" "b"), 0 },
+        { CASE_TEXT("\xC2" "a"), 0 },
+        { CASE_TEXT("\xFE\xFF"), 0 },
+    };
+#undef CASE_TEXT
+    // ascii before and after the case, so the case is checked by every kernel and at block boundaries
+    static const int heads[] = { 0, 15, 29, 31, 45 };
+    static const int tails[] = { 0, 1, 40 };
+    char buf[128];
+    wchar_t out[128], expect[128];
+    int i, j, k, n, len, partial, strict;
+    simd_t level;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        for (j = 0; j < sizeof(heads) / sizeof(heads[0]); j++)
+        {
+            for (k = 0; k < sizeof(tails) / sizeof(tails[0]); k++)
+            {
+                memset(buf, 'x', sizeof(buf));
+                memcpy(buf + heads[j], cases[i].text, cases[i].len);
+                n = heads[j] + cases[i].len + tails[k];
+
+                // simd_none is the original scalar is_utf8
+                partial = _utf8_check((const unsigned char *)buf, (const unsigned char *)buf + n, 1, simd_none);
+                strict = _utf8_check((const unsigned char *)buf, (const unsigned char *)buf + n, 0, simd_none);
+                assert(strict == cases[i].valid);
+                assert(strict == (MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, buf, n, NULL, 0) > 0));
+
+                len = MultiByteToWideChar(CP_UTF8, 0, buf, n, expect, 128);
+                assert(len > 0);
+                for (level = simd_none; level <= get_simd_level(); level = (simd_t)(level + 1))
+                {
+                    assert(_utf8_valid((const unsigned char *)buf, n, 1, level) == partial);
+                    assert(_utf8_valid((const unsigned char *)buf, n, 0, level) == strict);
+                    if (strict)
+                    {
+                        assert(_utf16_length((const unsigned char *)buf, n, level) == len);
+                        assert(_utf8_decode((const unsigned char *)buf, n, out, level) == len && !memcmp(out, expect, len * sizeof(wchar_t)));
+                    }
+                }
+                assert(utf8_decode(buf, n, NULL, 0) == len);
+                assert(utf8_decode(buf, n, out, 128) == len && !memcmp(out, expect, len * sizeof(wchar_t)));
+            }
+        }
+    }
+#endif
+}
+
+simd_t Utils::get_simd_level(void)
+{
+    static int level = -1;
+    int info[4];
+    int max;
+
+    if (level >= 0)
+        return (simd_t)level;
+
+    __cpuid(info, 0);
+    max = info[0];
+    __cpuid(info, 1);
+    if (info[3] & (1 << 26)) // sse2
+    {
+        // avx2 also needs os support to save ymm registers: osxsave and xgetbv
+        if (max >= 7 && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6)
+        {
+            __cpuidex(info, 7, 0);
+            if (info[1] & (1 << 5))
+            {
+                level = simd_avx2;
+                return (simd_t)level;
+            }
+        }
+        level = simd_sse2;
+        return (simd_t)level;
+    }
+    level = simd_none;
+    return (simd_t)level;
+}
+
 char* Utils::le_to_be(char* data, int len)
 {
     char tmp;
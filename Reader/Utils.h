@@ -3,6 +3,13 @@
 
 #include "types.h"
 
+typedef enum simd_t
+{
+    simd_none = 0,
+    simd_sse2,
+    simd_avx2
+} simd_t;
+
 class Utils
 {
 public:
@@ -22,9 +29,11 @@ public:
     static char* utf16_to_ansi_ex(const wchar_t* str, int size, int* len);
     //static wchar_t* utf8_to_utf16(const char* str, int* len);
     static wchar_t* utf8_to_utf16_ex(const char* str, int size, int* len);
+    static int utf8_decode(const char* str, int size, wchar_t* dst, int dstsize); // same as MultiByteToWideChar(CP_UTF8, ...)
     //static char* utf16_to_utf8(const wchar_t* str, int* len);
     static char* utf16_to_utf8_ex(const wchar_t* str, int size, int* len);
     static char* utf16_to_utf8_bom(const wchar_t* str, int size, int* len);
+    static char* ansi_to_utf8_ex(const char* str, int size, int* len); // gbk, big5 are converted directly
     static void free_buffer(void* buffer);
 
     static char* Utf16ToUtf8(const wchar_t* str); // not free
@@ -36,6 +45,10 @@ public:
     static type_t check_bom(const char *data, size_t size);
     static int is_ascii(const char *data, size_t size);    
     static int is_utf8(const char *data, size_t size);
+    static void UnitTest6(void);
+
+    // cpu
+    static simd_t get_simd_level(void);
 
     // le be
     static char* le_to_be(char* data, int len);
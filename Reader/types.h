@@ -5,6 +5,7 @@
 
 #define CACHE_FILE_NAME             _T(".cache.dat")
 #define ONLINE_FILE_SAVE_PATH       _T(".online\\")
+#define INDEX_FILE_SAVE_PATH        _T(".index\\")
 
 #define DEFAULT_APP_WIDTH           (300)
 #define DEFAULT_APP_HEIGHT          (500)
@@ -44,12 +45,14 @@
 
 #ifdef ENABLE_NETWORK
 #define WM_NEW_VERSION              (WM_USER + 100)
+#define WM_CHECK_BOOK               (WM_USER + 107)
 #endif
 #define WM_UPDATE_CHAPTERS          (WM_USER + 101)
 #define WM_OPEN_BOOK                (WM_USER + 102)
 #define WM_SYSTRAY                  (WM_USER + 103)
 #define WM_BOOK_EVENT               (WM_USER + 104)
 #define WM_SAVE_CACHE               (WM_USER + 105)
+#define WM_UPDATE_PAGES             (WM_USER + 106)
 #define WM_TASKBAR_CREATED          (RegisterWindowMessage(_T("TaskbarCreated")))
 
 
@@ -58,6 +61,7 @@
 #ifdef ENABLE_NETWORK
 #define IDT_TIMER_UPGRADE           103
 #define IDT_TIMER_CHECKBOOK         104
+#define IDT_TIMER_DOWNLOAD          106
 #endif
 #define IDT_TIMER_LOADING           105
 
@@ -214,6 +218,8 @@ typedef struct header_t
     BYTE meun_font_follow;
     int book_source_count;
     book_source_t book_sources[MAX_BOOKSRC_COUNT];
+    int prefetch_ahead; // online chapters downloaded before reading them
+    int prefetch_behind;
 } header_t;
 
 typedef struct body_t
@@ -269,6 +275,7 @@ typedef struct ol_chapter_info_t
     u32 size;
 } ol_chapter_info_t;
 
+// legacy .ol format: header, then the whole text. only read to migrate old files
 typedef struct ol_header_t
 {
     u32 header_size;
@@ -282,5 +289,90 @@ typedef struct ol_header_t
     ol_chapter_info_t chapter_info_list[1];
 } ol_header_t;
 
+// .ol format: fixed header, then an append-only log of chapter texts and chapter tables.
+// a downloaded chapter is appended and its table entry is updated in place,
+// a new chapter list appends a new table and the old one becomes garbage,
+// chapters only added at the end append a tail table for the chapters after the table.
+#define OL_FILE_MAGIC               0x324C4F52 // "ROL2", legacy files start with header_size
+#define OL_FILE_VERSION             1
+#define OL_COMPACT_PERCENT          50 // rewrite the file when garbage is more than this
+#define OL_TAIL_PERCENT             25 // write a whole table when the tail is larger than this of the table
+
+typedef struct ol_chapter_entry_t
+{
+    u32 offset; // text offset in file, 0: not downloaded
+    u32 size; // text length in TCHAR
+    u32 crc; // crc32 of text
+    u32 title_offset; // offset in table
+    u32 url_offset;
+} ol_chapter_entry_t;
+
+typedef struct ol_table_t
+{
+    u32 book_name_offset;
+    u32 main_page_offset;
+    u32 host_offset;
+    u32 chapter_size;
+    ol_chapter_entry_t chapter_list[1];
+} ol_table_t;
+
+typedef struct ol_file_header_t
+{
+    u32 magic;
+    u32 version;
+    u64 update_time;
+    u32 is_finished;
+    u32 table_offset; // current chapter table
+    u32 table_size;
+    u32 garbage_size; // bytes in the log not referenced any more
+    u32 is_downloading; // whole book download is not finished, resume it on open
+    u32 tail_offset; // tail table, 0: none
+    u32 tail_size;
+    u32 found_time; // last time new chapters were found
+} ol_file_header_t;
+
+#define TXT_INDEX_VERSION           1
+
+typedef struct txt_chapter_info_t
+{
+    u32 index;
+    u32 title_offset;
+} txt_chapter_info_t;
+
+// chapters of txt book, saved to INDEX_FILE_SAVE_PATH
+typedef struct txt_index_header_t
+{
+    u32 header_size;
+    u32 version;
+    u64 file_size;
+    u64 file_time; // last write time
+    u64 file_hash; // hash of sampled content
+    u32 text_length;
+    chapter_rule_t rule;
+    u32 chapter_size;
+    txt_chapter_info_t chapter_info_list[1];
+} txt_index_header_t;
+
+#define EPUB_INDEX_VERSION          1
+
+typedef struct epub_spine_info_t
+{
+    u32 length; // text length, 0: no text
+    u32 title_offset; // 0: not a chapter
+} epub_spine_info_t;
+
+// text of every spine document of epub book, saved to INDEX_FILE_SAVE_PATH
+typedef struct epub_index_header_t
+{
+    u32 header_size;
+    u32 version;
+    u64 file_size;
+    u64 file_time; // last write time
+    u64 file_hash; // hash of sampled content
+    u32 text_length;
+    u32 spine_size;
+    epub_spine_info_t spine_info_list[1];
+} epub_index_header_t;
+
 
 #endif
\ No newline at end of file